@@ -0,0 +1,97 @@
+#include "capabilities.h"
+
+#include <cstring>
+
+static bool HasExtension(const char *name) {
+  GLint count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (GLint i = 0; i < count; i++) {
+    const char *ext =
+        reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, i));
+    // Desktop GL and Emscripten report extensions with a GL_ prefix
+    if (ext != nullptr &&
+        (std::strcmp(ext, name) == 0 ||
+         (std::strncmp(ext, "GL_", 3) == 0 && std::strcmp(ext + 3, name) == 0)))
+      return true;
+  }
+  return false;
+}
+
+static bool IsColorRenderable(GLenum internalFormat, GLenum format,
+                              GLenum type) {
+  GLuint texture, fbo;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, 4, 4, 0, format, type,
+               nullptr);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         texture, 0);
+  const bool complete =
+      glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteTextures(1, &texture);
+
+  // Unsupported formats may also raise GL_INVALID_* from glTexImage2D
+  while (glGetError() != GL_NO_ERROR) {
+  }
+  return complete;
+}
+
+static Capabilities Probe() {
+  Capabilities caps;
+  for (int i = 0; i < kNumParticleFormats; i++) {
+    const ParticleFormatInfo &info =
+        GetParticleFormatInfo(static_cast<ParticleFormat>(i));
+    caps.particleFormats[i] =
+        IsColorRenderable(info.internalFormat, info.format, info.type);
+  }
+
+#ifdef EMSCRIPTEN
+  caps.floatBlend = HasExtension("EXT_float_blend");
+  caps.floatLinear = HasExtension("OES_texture_float_linear");
+#else
+  // Core since GL 3.0; GLES contexts still need the extensions
+  caps.floatBlend = true;
+  caps.floatLinear = true;
+#endif
+
+  // R32F halves the accumulator compared to RG32F
+  caps.histogramFormat = GL_NONE;
+  if (caps.floatBlend) {
+    if (IsColorRenderable(GL_R32F, GL_RED, GL_FLOAT))
+      caps.histogramFormat = GL_R32F;
+    else if (IsColorRenderable(GL_RG32F, GL_RG, GL_FLOAT))
+      caps.histogramFormat = GL_RG32F;
+  }
+
+  caps.parallelShaderCompile = HasExtension("KHR_parallel_shader_compile") ||
+                               HasExtension("ARB_parallel_shader_compile");
+  return caps;
+}
+
+const Capabilities &GetCapabilities() {
+  static const Capabilities caps = Probe();
+  return caps;
+}
+
+bool IsParticleFormatSupported(ParticleFormat format) {
+  return GetCapabilities().particleFormats[static_cast<int>(format)];
+}
+
+ParticleFormat PreferredParticleFormat() {
+  // RGBA8 before Fixed16: same resolution, but normalized RGBA8 is the
+  // attachment every driver has been exercised with.
+  for (ParticleFormat format :
+       {ParticleFormat::RG32F, ParticleFormat::RG16F,
+        ParticleFormat::RGBA8Packed, ParticleFormat::Fixed16}) {
+    if (IsParticleFormatSupported(format))
+      return format;
+  }
+  return ParticleFormat::RGBA8Packed;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#ifdef EMSCRIPTEN
+#include <GLES3/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+
+#include "particle_storage.h"
+
+// What the current context can render to. WebGL2 and GLES3 only guarantee
+// 8-bit normalized and integer color attachments; float targets need
+// EXT_color_buffer_float (or _half_float) and blending into them
+// EXT_float_blend.
+struct Capabilities {
+  // Indexed by ParticleFormat
+  bool particleFormats[kNumParticleFormats];
+  bool floatBlend;
+  // Internal format of the histogram accumulator: GL_R32F, GL_RG32F, or
+  // GL_NONE when histograms have to be binned on the CPU.
+  GLenum histogramFormat;
+  // Float textures can be sampled with GL_LINEAR, which GLES3 and WebGL2
+  // only allow with OES_texture_float_linear.
+  bool floatLinear;
+  // KHR_parallel_shader_compile (or ARB_): programs can be polled with
+  // GL_COMPLETION_STATUS_KHR instead of blocking on their link status.
+  bool parallelShaderCompile;
+};
+
+// Probed on first use by attaching a small texture of each format to a
+// framebuffer; needs a current context.
+const Capabilities &GetCapabilities();
+
+bool IsParticleFormatSupported(ParticleFormat format);
+// The most precise supported format. RGBA8 and integer targets are always
+// renderable, so there is one.
+ParticleFormat PreferredParticleFormat();
@@ -0,0 +1,205 @@
+#include "cpu_simulation.h"
+
+#include "reference.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Particles are processed in blocks so that the integer hashing runs over
+// plain arrays, which the compiler vectorizes (wasm SIMD with -msimd128).
+static constexpr size_t kBlock = 64;
+
+CpuSimulation::CpuSimulation(size_t width, size_t height, int threads)
+    : m_width(width), m_height(height), m_step(0),
+      m_mixtures(1, MixtureOfGaussians{}), m_members(1), m_pool(threads) {
+  m_particles.Resize(width, height);
+  m_partials.resize(m_pool.Size());
+  m_partialUsed.resize(m_pool.Size());
+  ResetParticles();
+}
+
+void CpuSimulation::SetMixture(const MixtureOfGaussians &m) {
+  m_mixtures.assign(1, m);
+  for (EnsembleMember &member : m_members)
+    member.mixture = 0;
+}
+
+void CpuSimulation::SetDt(float dt) {
+  for (EnsembleMember &member : m_members)
+    member.dt = dt;
+}
+
+void CpuSimulation::SetEnsemble(
+    const std::vector<MixtureOfGaussians> &mixtures,
+    const std::vector<EnsembleMember> &members) {
+  ValidateEnsemble(mixtures, members);
+
+  m_mixtures = mixtures;
+  m_members = members;
+}
+
+void CpuSimulation::SetTarget(const Target &target) { m_target = target; }
+
+void CpuSimulation::ResetParticles() {
+  // A grid over [-1, 1]^2, written with the same split of rows as Update so
+  // the first touch places every row on the node that steps it
+  m_pool.ParallelFor(m_height, [&](size_t begin, size_t end, int) {
+    m_particles.FillGrid(begin, end);
+  });
+  m_step = 0;
+}
+
+void CpuSimulation::ReadParticles(std::vector<glm::vec2> &particles) {
+  m_particles.Read(particles);
+}
+
+void CpuSimulation::ReadFrame(ParticleFrame &frame) {
+  m_particles.Read(frame.particles);
+  frame.width = m_width;
+  frame.height = m_height;
+  frame.ensembleSize = static_cast<int>(m_members.size());
+  frame.step = m_step;
+}
+
+void CpuSimulation::Update() {
+  m_step++;
+
+  // One instantiation of the step loop per target, with the density inlined
+  switch (m_target.kind) {
+  case TargetKind::Mixture:
+    StepRows(m_step, [this](int mixture) {
+      return MixtureDensity{&m_mixtures[mixture]};
+    });
+    break;
+  case TargetKind::Rosenbrock:
+    StepRows(m_step, [this](int) { return RosenbrockDensity(m_target); });
+    break;
+  case TargetKind::DoubleWell:
+    StepRows(m_step, [this](int) { return DoubleWellDensity(m_target); });
+    break;
+  case TargetKind::Grid:
+    StepRows(m_step, [this](int) { return GridDensity{&m_target}; });
+    break;
+  }
+}
+
+template <typename Select>
+void CpuSimulation::StepRows(uint32_t frameId, Select density) {
+  // Same mapping as ensemble_member() in simulation.frag
+  const int numMembers = static_cast<int>(m_members.size());
+  m_pool.ParallelFor(m_height, [&](size_t begin, size_t end, int) {
+    for (size_t row = begin; row < end; row++) {
+      const int member =
+          static_cast<int>(((row + 1) * numMembers - 1) / m_height);
+      const EnsembleMember &m = m_members[member];
+      StepRow(row, frameId, m, density(m.mixture));
+    }
+  });
+}
+
+template <typename Density>
+void CpuSimulation::StepRow(size_t row, uint32_t frameId,
+                            const EnsembleMember &m, const Density &density) {
+  const float noiseScale = std::sqrt(2.0f * m.dt);
+
+  float *xs = m_particles.X() + row * m_width;
+  float *ys = m_particles.Y() + row * m_width;
+  for (size_t x0 = 0; x0 < m_width; x0 += kBlock) {
+    const size_t n = std::min(kBlock, m_width - x0);
+
+    ReferenceRng rng[kBlock];
+    float ux[kBlock], uy[kBlock];
+    for (size_t i = 0; i < n; i++) {
+      rng[i].Seed(x0 + i, row, m_width, frameId, m.seed);
+      ux[i] = rng[i].NextFloat();
+      uy[i] = rng[i].NextFloat();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      glm::vec2 p(xs[x0 + i], ys[x0 + i]);
+      p += m.dt * density.Score(p) +
+           noiseScale * ReferenceGaussian(ux[i], uy[i]);
+      xs[x0 + i] = p.x;
+      ys[x0 + i] = p.y;
+    }
+  }
+}
+
+void CpuSimulation::Histogram(Viewport particleViewport, int width,
+                              int height, int member,
+                              std::vector<float> &counts) {
+  int firstRow, numRows;
+  EnsembleRowRange(m_height, m_members.size(), member, firstRow, numRows);
+
+  const glm::vec2 scale = glm::vec2(width, height) /
+                          (particleViewport.pmax - particleViewport.pmin);
+  const size_t bins = static_cast<size_t>(width) * height;
+  const float *xs = m_particles.X() + firstRow * m_width;
+  const float *ys = m_particles.Y() + firstRow * m_width;
+
+  std::fill(m_partialUsed.begin(), m_partialUsed.end(), 0);
+
+  m_pool.ParallelFor(numRows * m_width, [&](size_t begin, size_t end,
+                                            int slot) {
+    std::vector<float> &partial = m_partials[slot];
+    if (!m_partialUsed[slot]) {
+      partial.assign(bins, 0.0f);
+      m_partialUsed[slot] = 1;
+    }
+    for (size_t i = begin; i < end; i++) {
+      const glm::vec2 w =
+          (glm::vec2(xs[i], ys[i]) - particleViewport.pmin) * scale;
+      if (!(w.x >= 0.0f && w.x < width && w.y >= 0.0f && w.y < height))
+        continue;
+      partial[static_cast<size_t>(w.y) * width + static_cast<size_t>(w.x)] +=
+          1.0f;
+    }
+  });
+
+  counts.resize(bins);
+  m_pool.ParallelFor(bins, [&](size_t begin, size_t end, int) {
+    for (size_t i = begin; i < end; i++) {
+      float sum = 0.0f;
+      for (size_t slot = 0; slot < m_partials.size(); slot++) {
+        if (m_partialUsed[slot])
+          sum += m_partials[slot][i];
+      }
+      counts[i] = sum;
+    }
+  });
+}
+
+ParticleMoments CpuSimulation::Moments(int member) {
+  int firstRow, numRows;
+  EnsembleRowRange(m_height, m_members.size(), member, firstRow, numRows);
+  const float *xs = m_particles.X() + firstRow * m_width;
+  const float *ys = m_particles.Y() + firstRow * m_width;
+
+  std::vector<ParticleMoments> partials(m_pool.Size());
+  m_pool.ParallelFor(numRows * m_width, [&](size_t begin, size_t end,
+                                            int slot) {
+    ParticleMoments m;
+    m.count = static_cast<double>(end - begin);
+    for (size_t i = begin; i < end; i++) {
+      const double x = xs[i], y = ys[i];
+      m.sumX += x;
+      m.sumY += y;
+      m.sumXX += x * x;
+      m.sumYY += y * y;
+      m.sumXY += x * y;
+    }
+    partials[slot] += m;
+  });
+
+  ParticleMoments moments;
+  for (const ParticleMoments &m : partials)
+    moments += m;
+  return moments;
+}
+
+int CpuSimulation::EnsembleSize() { return static_cast<int>(m_members.size()); }
+int CpuSimulation::Threads() { return m_pool.Size(); }
+int CpuSimulation::Nodes() { return m_pool.Nodes(); }
+size_t CpuSimulation::Width() { return m_width; }
+size_t CpuSimulation::Height() { return m_height; }
+size_t CpuSimulation::NumParticles() { return m_width * m_height; }
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "mixture.h"
+#include "particle_store.h"
+#include "simulation.h"
+#include "target.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+// Snapshot of a CpuSimulation, e.g. handed from SimulationThread to the
+// renderers.
+struct ParticleFrame {
+  std::vector<glm::vec2> particles;
+  size_t width = 0;
+  size_t height = 0;
+  int ensembleSize = 1;
+  uint32_t step = 0;
+};
+
+// Sums over particles; those of several simulations merge by adding.
+struct ParticleMoments {
+  double count = 0.0;
+  double sumX = 0.0;
+  double sumY = 0.0;
+  double sumXX = 0.0;
+  double sumYY = 0.0;
+  double sumXY = 0.0;
+
+  ParticleMoments &operator+=(const ParticleMoments &o) {
+    count += o.count;
+    sumX += o.sumX;
+    sumY += o.sumY;
+    sumXX += o.sumXX;
+    sumYY += o.sumYY;
+    sumXY += o.sumXY;
+    return *this;
+  }
+  glm::vec2 Mean() const {
+    return count > 0.0 ? glm::vec2(sumX / count, sumY / count)
+                       : glm::vec2(0.0f);
+  }
+  glm::vec2 Variance() const {
+    if (count <= 0.0)
+      return glm::vec2(0.0f);
+    const double mx = sumX / count, my = sumY / count;
+    return glm::vec2(sumXX / count - mx * mx, sumYY / count - my * my);
+  }
+};
+
+// Runs the same dynamics as Simulation on the CPU, for when float render
+// targets are unavailable. Particles, ensemble bands and random numbers
+// follow the GPU layout, so both produce the same statistics.
+//
+// Rows are first touched by the pool threads that step them, so on NUMA
+// hosts each node steps particles in its own memory. Random numbers are
+// hashed from particle and step, so results do not depend on which thread
+// runs a row.
+class CpuSimulation {
+public:
+  CpuSimulation(size_t width = 960, size_t height = 540, int threads = -1);
+
+  void Update();
+  // Sets the mixture of every ensemble member.
+  void SetMixture(const MixtureOfGaussians &m);
+  // Sets the dt of every ensemble member.
+  void SetDt(float dt);
+  void SetEnsemble(const std::vector<MixtureOfGaussians> &mixtures,
+                   const std::vector<EnsembleMember> &members);
+  void SetTarget(const Target &target);
+  void ResetParticles();
+  void ReadParticles(std::vector<glm::vec2> &particles);
+  void ReadFrame(ParticleFrame &frame);
+
+  // Bins the particles of one ensemble member like the accumulator pass of
+  // EstimatedDistributionRenderer, into a row-major width x height grid.
+  void Histogram(Viewport particleViewport, int width, int height, int member,
+                 std::vector<float> &counts);
+  // Moments of one ensemble member's positions.
+  ParticleMoments Moments(int member);
+
+  int EnsembleSize();
+  int Threads();
+  // NUMA nodes the threads are spread over
+  int Nodes();
+
+  size_t Width();
+  size_t Height();
+  size_t NumParticles();
+
+private:
+  // Steps every row with the density density(mixture) returns for each
+  // member's mixture index, see target.h.
+  template <typename Select> void StepRows(uint32_t frameId, Select density);
+  template <typename Density>
+  void StepRow(size_t row, uint32_t frameId, const EnsembleMember &m,
+               const Density &density);
+
+private:
+  size_t m_width;
+  size_t m_height;
+  uint32_t m_step;
+
+  // Pages are first touched by ResetParticles
+  ParticleStore m_particles;
+  // One partial histogram per pool slot, allocated and zeroed by the slot's
+  // thread and summed by Histogram
+  std::vector<std::vector<float>> m_partials;
+  std::vector<char> m_partialUsed;
+
+  std::vector<MixtureOfGaussians> m_mixtures;
+  std::vector<EnsembleMember> m_members;
+  Target m_target;
+
+  ThreadPool m_pool;
+};
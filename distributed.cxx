@@ -0,0 +1,577 @@
+#include "distributed.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <spawn.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "capabilities.h"
+#include "estimated_distribution_renderer.h"
+#include "reference.h"
+#include "simulation.h"
+
+extern char **environ;
+
+static constexpr size_t kHistogramBins =
+    static_cast<size_t>(kWorkerHistogramSize) * kWorkerHistogramSize;
+
+// False on end of file or error
+static bool ReadAll(int fd, void *data, size_t size) {
+  char *p = static_cast<char *>(data);
+  while (size > 0) {
+    const ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool WriteAll(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    const ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Grid targets travel as their log densities, see WorkerConfig
+static void CheckTarget(const Target &target) {
+  if (target.kind == TargetKind::Grid &&
+      (target.gridWidth < 2 || target.gridHeight < 2 ||
+       static_cast<uint32_t>(target.gridWidth) > kMaxWorkerGridSide ||
+       static_cast<uint32_t>(target.gridHeight) > kMaxWorkerGridSide))
+    throw std::invalid_argument("Workers take grid targets of 2 to " +
+                                std::to_string(kMaxWorkerGridSide) +
+                                " nodes per side");
+}
+
+static double Seconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Coordinator::Coordinator(const std::string &executable, int workers,
+                         const WorkerConfig &config, const Target &target)
+    : m_config(config), m_target(target) {
+  if (workers < 1)
+    throw std::invalid_argument("Need at least one worker");
+  CheckTarget(target);
+  if (pipe(m_wakePipe) != 0)
+    throw std::runtime_error("Cannot create pipe: " +
+                             std::string(std::strerror(errno)));
+  // A full pipe already wakes Run, so neither end needs to wait
+  fcntl(m_wakePipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(m_wakePipe[1], F_SETFL, O_NONBLOCK);
+
+  m_workers.resize(workers);
+  std::string failure;
+  for (int i = 0; i < workers; i++) {
+    Worker &worker = m_workers[i];
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+      failure = std::strerror(errno);
+      break;
+    }
+    // dup2 onto a different descriptor clears close-on-exec
+    const int childFd = fds[1] == 3 ? 4 : 3;
+    const std::string fdArg = std::to_string(childFd);
+    char *argv[] = {const_cast<char *>(executable.c_str()),
+                    const_cast<char *>("--worker"),
+                    const_cast<char *>(fdArg.c_str()), nullptr};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], childFd);
+    const int error = posix_spawnp(&worker.pid, executable.c_str(), &actions,
+                                   nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (error != 0) {
+      failure = std::strerror(error);
+      close(fds[0]);
+      worker.pid = -1;
+      break;
+    }
+    worker.fd = fds[0];
+    worker.connected = true;
+    worker.counts.assign(kHistogramBins, 0.0f);
+  }
+  if (!failure.empty()) {
+    for (Worker &worker : m_workers) {
+      if (worker.fd >= 0)
+        close(worker.fd);
+      if (worker.pid > 0)
+        waitpid(worker.pid, nullptr, 0);
+    }
+    close(m_wakePipe[0]);
+    close(m_wakePipe[1]);
+    throw std::runtime_error("Cannot start workers from " + executable +
+                             ": " + failure);
+  }
+
+  SetGrid();
+  Configure(config);
+  m_thread = std::thread(&Coordinator::Run, this);
+}
+
+Coordinator::~Coordinator() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  Wake();
+  m_thread.join();
+  // Workers exit when their connection closes
+  for (Worker &worker : m_workers) {
+    close(worker.fd);
+    waitpid(worker.pid, nullptr, 0);
+  }
+  close(m_wakePipe[0]);
+  close(m_wakePipe[1]);
+}
+
+void Coordinator::Configure(const WorkerConfig &config) {
+  const bool grid = m_target.kind == TargetKind::Grid;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  const uint32_t generation = m_config.generation + 1;
+  m_config = config;
+  m_config.generation = generation;
+  m_config.targetKind = static_cast<int32_t>(m_target.kind);
+  m_config.targetParams = m_target.params;
+  m_config.gridWidth = grid ? m_target.gridWidth : 0;
+  m_config.gridHeight = grid ? m_target.gridHeight : 0;
+  // Replaces any config still waiting; Run sends it
+  for (size_t i = 0; i < m_workers.size(); i++) {
+    Worker &worker = m_workers[i];
+    if (!worker.connected)
+      continue;
+    worker.pending.config = m_config;
+    worker.pending.config.worker = static_cast<uint32_t>(i);
+    worker.pending.grid = m_grid;
+    worker.queued = true;
+  }
+  Wake();
+}
+
+void Coordinator::Wake() {
+  const char wake = 0;
+  // Fails only when the pipe is full, and then Run wakes anyway
+  while (write(m_wakePipe[1], &wake, 1) < 0 && errno == EINTR) {
+  }
+}
+
+void Coordinator::Configure(const WorkerConfig &config,
+                            const Target &target) {
+  CheckTarget(target);
+  m_target = target;
+  SetGrid();
+  Configure(config);
+}
+
+void Coordinator::SetGrid() {
+  if (m_target.kind == TargetKind::Grid) {
+    m_grid = std::make_shared<const std::vector<float>>(
+        m_target.gridLogDensity);
+  } else {
+    m_grid.reset();
+  }
+}
+
+size_t Coordinator::Message::Size() const {
+  return sizeof(config) + (grid ? grid->size() * sizeof(float) : 0);
+}
+
+const WorkerConfig &Coordinator::Config() { return m_config; }
+
+const Target &Coordinator::CurrentTarget() { return m_target; }
+
+bool Coordinator::Merge(DistributedFrame &frame) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  bool fresh = false;
+  int current = 0;
+  for (const Worker &worker : m_workers) {
+    fresh |= worker.fresh;
+    current += worker.header.generation == m_config.generation;
+  }
+  if (!fresh || current == 0)
+    return false;
+
+  frame.viewport = m_config.viewport;
+  frame.counts.assign(kHistogramBins, 0.0f);
+  frame.particles = 0;
+  frame.moments = ParticleMoments();
+  frame.workers = 0;
+  frame.step = UINT32_MAX;
+  for (Worker &worker : m_workers) {
+    worker.fresh = false;
+    if (worker.header.generation != m_config.generation)
+      continue;
+    for (size_t i = 0; i < kHistogramBins; i++)
+      frame.counts[i] += worker.counts[i];
+    frame.particles += worker.header.particles;
+    frame.moments += worker.header.moments;
+    frame.workers++;
+    frame.step = std::min(frame.step, worker.header.step);
+  }
+  return true;
+}
+
+int Coordinator::Workers() { return static_cast<int>(m_workers.size()); }
+
+int Coordinator::Connected() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  int connected = 0;
+  for (const Worker &worker : m_workers)
+    connected += worker.connected;
+  return connected;
+}
+
+double Coordinator::StepsPerSecond() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  double rate = 0.0;
+  for (const Worker &worker : m_workers)
+    rate += worker.connected ? worker.rate : 0.0;
+  return rate;
+}
+
+void Coordinator::Run() {
+  std::vector<float> counts(kHistogramBins);
+  std::vector<pollfd> fds;
+  std::vector<size_t> indices;
+  for (;;) {
+    fds.assign(1, {m_wakePipe[0], POLLIN, 0});
+    indices.clear();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_stop)
+        return;
+      for (size_t i = 0; i < m_workers.size(); i++) {
+        const Worker &worker = m_workers[i];
+        if (!worker.connected)
+          continue;
+        const bool sending =
+            worker.sendOffset < worker.sendSize || worker.queued;
+        fds.push_back(
+            {worker.fd, static_cast<short>(POLLIN | (sending ? POLLOUT : 0)),
+             0});
+        indices.push_back(i);
+      }
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+      return;
+    if (fds[0].revents != 0) {
+      char wakes[64];
+      while (read(m_wakePipe[0], wakes, sizeof(wakes)) > 0) {
+      }
+    }
+    for (size_t k = 0; k < indices.size(); k++) {
+      const short revents = fds[k + 1].revents;
+      bool connected = true;
+      if (revents & POLLOUT)
+        connected = Send(indices[k]);
+      if (connected && (revents & ~POLLOUT) != 0)
+        connected = Receive(indices[k], counts);
+      if (!connected) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_workers[indices[k]].connected = false;
+      }
+    }
+  }
+}
+
+bool Coordinator::Send(size_t index) {
+  // Never blocks, so holding the lock is fine
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Worker &worker = m_workers[index];
+  for (;;) {
+    if (worker.sendOffset == worker.sendSize) {
+      if (!worker.queued)
+        return true;
+      worker.sending = std::move(worker.pending);
+      worker.queued = false;
+      worker.sendOffset = 0;
+      worker.sendSize = worker.sending.Size();
+    }
+    // The config, then its grid
+    const size_t offset = worker.sendOffset;
+    const size_t header = sizeof(worker.sending.config);
+    const char *data =
+        offset < header
+            ? reinterpret_cast<const char *>(&worker.sending.config) + offset
+            : reinterpret_cast<const char *>(worker.sending.grid->data()) +
+                  (offset - header);
+    const size_t size =
+        offset < header ? header - offset : worker.sendSize - offset;
+    const ssize_t n = send(worker.fd, data, size, MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (n <= 0)
+      return false;
+    worker.sendOffset += n;
+  }
+}
+
+bool Coordinator::Receive(size_t index, std::vector<float> &counts) {
+  WorkerHistogramHeader header;
+  if (!ReadAll(m_workers[index].fd, &header, sizeof(header)) ||
+      !ReadAll(m_workers[index].fd, counts.data(),
+               counts.size() * sizeof(float)))
+    return false;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Worker &worker = m_workers[index];
+  worker.header = header;
+  worker.counts.swap(counts);
+  worker.fresh = true;
+
+  // Rate over windows of about a second; resets restart the step count
+  const double now = Seconds();
+  if (worker.firstTime < 0.0 || header.step < worker.firstStep) {
+    worker.firstTime = now;
+    worker.firstStep = header.step;
+  } else if (now - worker.firstTime >= 1.0) {
+    worker.rate = (header.step - worker.firstStep) / (now - worker.firstTime);
+    worker.firstTime = now;
+    worker.firstStep = header.step;
+  }
+  return true;
+}
+
+// A config and, for grid targets, the log densities that follow it
+static bool ReadConfig(int fd, WorkerConfig &config, std::vector<float> &grid) {
+  if (!ReadAll(fd, &config, sizeof(config)))
+    return false;
+  if (config.gridWidth > kMaxWorkerGridSide ||
+      config.gridHeight > kMaxWorkerGridSide)
+    return false;
+  grid.resize(static_cast<size_t>(config.gridWidth) * config.gridHeight);
+  return ReadAll(fd, grid.data(), grid.size() * sizeof(float));
+}
+
+// Throws std::invalid_argument for grids GridTarget rejects
+static Target WorkerTarget(const WorkerConfig &config,
+                           const std::vector<float> &grid) {
+  const glm::vec4 &p = config.targetParams;
+  switch (static_cast<TargetKind>(config.targetKind)) {
+  case TargetKind::Rosenbrock:
+    return RosenbrockTarget(p.x, p.y, p.z);
+  case TargetKind::DoubleWell:
+    return DoubleWellTarget(p.x, p.y, p.z);
+  case TargetKind::Grid:
+    return GridTarget(config.gridWidth, config.gridHeight, glm::vec2(p.x, p.y),
+                      glm::vec2(p.z, p.w), grid);
+  default:
+    return Target();
+  }
+}
+
+// The GPU worker reads its member back for the moments only every this many
+// steps, and whenever it goes idle
+static constexpr uint32_t kWorkerMomentsInterval = 16;
+
+// Moments of `count` read back positions, as CpuSimulation::Moments
+static ParticleMoments BandMoments(const glm::vec2 *particles, size_t count) {
+  ParticleMoments m;
+  m.count = static_cast<double>(count);
+  for (size_t i = 0; i < count; i++) {
+    const double x = particles[i].x, y = particles[i].y;
+    m.sumX += x;
+    m.sumY += y;
+    m.sumXX += x * x;
+    m.sumYY += y * y;
+    m.sumXY += x * y;
+  }
+  return m;
+}
+
+int RunWorker(int fd, bool gpu) {
+  WorkerConfig config;
+  std::vector<float> grid;
+  if (!ReadConfig(fd, config, grid))
+    return 0;
+
+  // One of the two, the GPU one while it can be created
+  std::unique_ptr<Simulation> gpuSimulation;
+  std::unique_ptr<CpuSimulation> simulation;
+  // Bins gpuSimulation's member without reading its particles back
+  std::unique_ptr<EstimatedDistributionRenderer> estimated;
+  WorkerConfig applied;
+  std::vector<float> appliedGrid;
+  // Returns true when the particles start over at a new size
+  auto apply = [&](const WorkerConfig &next, const std::vector<float> &values) {
+    if (next.particlesWidth == 0 || next.particlesHeight == 0 ||
+        next.ensembleSize < 1 || next.ensembleSize > kMaxEnsembleMembers)
+      throw std::invalid_argument("Invalid worker config");
+    const bool resize = (!gpuSimulation && !simulation) ||
+                        next.particlesWidth != applied.particlesWidth ||
+                        next.particlesHeight != applied.particlesHeight;
+    if (resize) {
+      estimated.reset();
+      gpuSimulation.reset();
+      simulation.reset();
+      if (gpu) {
+        try {
+          gpuSimulation = std::make_unique<Simulation>(
+              next.particlesWidth, next.particlesHeight,
+              PreferredParticleFormat());
+          estimated = std::make_unique<EstimatedDistributionRenderer>();
+          estimated->SetParticleFormat(gpuSimulation->Format());
+          estimated->SetResolution(kWorkerHistogramSize, kWorkerHistogramSize);
+        } catch (const std::exception &e) {
+          fprintf(stderr, "Worker %u: GPU simulation unavailable (%s), "
+                          "using the CPU\n",
+                  next.worker, e.what());
+          estimated.reset();
+          gpuSimulation.reset();
+          gpu = false;
+        }
+      }
+      if (!gpu)
+        simulation = std::make_unique<CpuSimulation>(
+            next.particlesWidth, next.particlesHeight, next.threads);
+    }
+    std::vector<EnsembleMember> members(next.ensembleSize);
+    float dt = next.dt;
+    for (uint32_t k = 0; k < next.ensembleSize; k++) {
+      members[k].dt = dt;
+      members[k].seed = WorkerSeed(next.seed, next.worker) + k;
+      dt *= next.dtSpread;
+    }
+    // Normalizing a target integrates it, so only on changes
+    const bool retarget = resize || next.targetKind != applied.targetKind ||
+                          next.targetParams != applied.targetParams ||
+                          values != appliedGrid;
+    if (gpuSimulation) {
+      gpuSimulation->SetEnsemble({next.mixture}, members);
+      if (retarget)
+        gpuSimulation->SetTarget(WorkerTarget(next, values));
+    } else {
+      simulation->SetEnsemble({next.mixture}, members);
+      if (retarget)
+        simulation->SetTarget(WorkerTarget(next, values));
+    }
+    applied = next;
+    appliedGrid = values;
+    return resize;
+  };
+  try {
+    apply(config, grid);
+  } catch (const std::exception &) {
+    return 1;
+  }
+
+  uint32_t step = 0;
+  std::vector<float> counts;
+  std::vector<glm::vec2> particles;
+  ParticleMoments moments;
+  bool momentsStale = true;
+  for (;;) {
+    const int member = static_cast<int>(
+        std::min(config.member, config.ensembleSize - 1));
+    int firstRow, numRows;
+    EnsembleRowRange(config.particlesHeight, config.ensembleSize, member,
+                     firstRow, numRows);
+    const size_t first = static_cast<size_t>(firstRow) * config.particlesWidth;
+    const size_t count = static_cast<size_t>(numRows) * config.particlesWidth;
+    const bool idle =
+        config.paused || (config.maxSteps > 0 && step >= config.maxSteps);
+    WorkerHistogramHeader header;
+    header.generation = config.generation;
+    header.worker = config.worker;
+    header.step = step;
+    header.particles = count;
+    if (gpuSimulation) {
+      // Only the member's rows; the moments lag by up to the interval
+      const bool gpuBinning = estimated->GpuAccumulation();
+      if (momentsStale || step % kWorkerMomentsInterval == 0 || idle ||
+          !gpuBinning) {
+        gpuSimulation->ReadParticles(firstRow, numRows, particles);
+        moments = BandMoments(particles.data(), count);
+        momentsStale = false;
+      }
+      header.moments = moments;
+      if (gpuBinning) {
+        // The member's band alone, into the histogram's first band
+        const MemberRanges ranges = {
+            {{static_cast<int>(first), static_cast<int>(count)}}};
+        estimated->Accumulate(config.viewport, config.particlesWidth,
+                              config.particlesHeight,
+                              gpuSimulation->ParticlesTexture(), 1, &ranges);
+        estimated->ReadHistogram(0, counts);
+      } else {
+        ReferenceHistogram(particles.data(), count, config.viewport,
+                           kWorkerHistogramSize, kWorkerHistogramSize, counts);
+      }
+    } else {
+      header.moments = simulation->Moments(member);
+      simulation->Histogram(config.viewport, kWorkerHistogramSize,
+                            kWorkerHistogramSize, member, counts);
+    }
+    if (!WriteAll(fd, &header, sizeof(header)) ||
+        !WriteAll(fd, counts.data(), counts.size() * sizeof(float)))
+      return 0;
+
+    // Wait for a new config while paused or done, otherwise just check
+    pollfd p = {fd, POLLIN, 0};
+    int ready;
+    do {
+      ready = poll(&p, 1, idle ? -1 : 0);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0)
+      return 1;
+    if (ready > 0) {
+      // Only the newest of the queued configs matters
+      WorkerConfig next;
+      do {
+        if (!ReadConfig(fd, next, grid))
+          return 0;
+      } while (poll(&p, 1, 0) > 0);
+      bool resized;
+      try {
+        resized = apply(next, grid);
+      } catch (const std::exception &) {
+        return 1;
+      }
+      // A new simulation starts from the initial particles already
+      if (!resized && next.resets != config.resets) {
+        if (gpuSimulation)
+          gpuSimulation->ResetParticles();
+        else
+          simulation->ResetParticles();
+      }
+      if (resized || next.resets != config.resets)
+        step = 0;
+      config = next;
+      momentsStale = true;
+      // Report the new config before stepping
+      continue;
+    }
+
+    if (gpuSimulation)
+      gpuSimulation->Update();
+    else
+      simulation->Update();
+    step++;
+  }
+}
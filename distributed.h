@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#include "cpu_simulation.h"
+#include "mixture.h"
+#include "target.h"
+#include "utils.h"
+
+// Bins per side of the histograms workers send
+static constexpr int kWorkerHistogramSize = 200;
+
+// Largest grid target side workers accept, as scenario files
+static constexpr uint32_t kMaxWorkerGridSide = 1024;
+
+// What a coordinator sends its workers, whole, on every change. Workers run
+// the same ensemble as the window, seeded with WorkerSeed, and bin one of
+// its members.
+struct WorkerConfig {
+  // Set by Coordinator::Configure and echoed in histograms
+  uint32_t generation = 0;
+  uint32_t worker = 0;
+  // Per worker; workers recreate their simulation when it changes
+  uint32_t particlesWidth = 960;
+  uint32_t particlesHeight = 540;
+  // Pool threads per worker besides its main thread, when it steps on the
+  // CPU
+  int32_t threads = 0;
+  MixtureOfGaussians mixture = {};
+  // Set from the Target passed to Coordinator::Configure. A Grid target's
+  // log densities follow the config on the wire.
+  int32_t targetKind = static_cast<int32_t>(TargetKind::Mixture);
+  glm::vec4 targetParams = glm::vec4(0.0f);
+  uint32_t gridWidth = 0;
+  uint32_t gridHeight = 0;
+  // Member k runs with dt * dtSpread^k; `member` is the one binned
+  float dt = 0.00004f;
+  uint32_t ensembleSize = 1;
+  float dtSpread = 1.0f;
+  uint32_t member = 0;
+  uint32_t seed = 0;
+  // Region binned into the histograms
+  Viewport viewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  // Workers reset their particles whenever this changes
+  uint32_t resets = 0;
+  // Paused workers wait for the next config
+  uint32_t paused = 0;
+  // Workers pause themselves after this many steps, 0 for never
+  uint32_t maxSteps = 0;
+};
+
+// Seed of member 0 of worker `worker`, member k adds k; no two workers, nor
+// the coordinator's own ensemble, share random numbers.
+inline uint32_t WorkerSeed(uint32_t seed, uint32_t worker) {
+  return seed + kMaxEnsembleMembers * (worker + 1);
+}
+
+// Sent by a worker after every step, followed by the histogram.
+struct WorkerHistogramHeader {
+  uint32_t generation = 0;
+  uint32_t worker = 0;
+  uint32_t step = 0;
+  // All of the binned member's particles, in view or not
+  uint64_t particles = 0;
+  ParticleMoments moments;
+};
+
+// The merged state of every worker that has applied the last config.
+struct DistributedFrame {
+  // The config's viewport, kWorkerHistogramSize bins per side, row-major
+  Viewport viewport = {};
+  std::vector<float> counts;
+  uint64_t particles = 0;
+  ParticleMoments moments;
+  int workers = 0;
+  // Lowest step among the merged workers
+  uint32_t step = 0;
+};
+
+// Runs a simulation across `workers` local processes, each stepping its own
+// Simulation, or CpuSimulation without a GPU, and streaming a histogram and
+// moments every step over a Unix socket. The workers are copies of
+// `executable` started with `--worker FD`, which must call RunWorker(FD, ...);
+// a thread here collects their messages. Particle counts and memory grow
+// with the number of processes, which can spread over NUMA nodes or sockets.
+//
+// POSIX only; this process and the workers must ignore SIGPIPE. Throws
+// std::runtime_error when the workers cannot be started.
+class Coordinator {
+public:
+  Coordinator(const std::string &executable, int workers,
+              const WorkerConfig &config, const Target &target = Target());
+  // Stops the workers and waits for them to exit.
+  ~Coordinator();
+
+  Coordinator(const Coordinator &) = delete;
+  Coordinator &operator=(const Coordinator &) = delete;
+
+  // Sends `config` and `target` to every worker from the collecting thread,
+  // without waiting; a config not yet sent is replaced. Histograms binned
+  // before the workers apply it are no longer merged. Without `target` the
+  // last one is kept. Throws std::invalid_argument for grids larger than
+  // kMaxWorkerGridSide.
+  void Configure(const WorkerConfig &config);
+  void Configure(const WorkerConfig &config, const Target &target);
+  const WorkerConfig &Config();
+  const Target &CurrentTarget();
+  // Sums the newest histograms of the workers that applied the last config.
+  // Returns false when nothing arrived since the last call or no worker
+  // has applied it yet, leaving `frame` as it was.
+  bool Merge(DistributedFrame &frame);
+
+  int Workers();
+  // Workers whose connection is still open
+  int Connected();
+  // Steps per second summed over the workers
+  double StepsPerSecond();
+
+private:
+  // A config and the grid that follows it, shared by every worker's copy
+  struct Message {
+    WorkerConfig config;
+    std::shared_ptr<const std::vector<float>> grid;
+    size_t Size() const;
+  };
+
+  struct Worker {
+    pid_t pid = -1;
+    int fd = -1;
+    bool connected = false;
+    bool fresh = false;
+    WorkerHistogramHeader header;
+    std::vector<float> counts;
+    // The config being written, and the newest one queued behind it
+    Message sending;
+    size_t sendOffset = 0;
+    size_t sendSize = 0;
+    Message pending;
+    bool queued = false;
+    uint32_t firstStep = 0;
+    double firstTime = -1.0;
+    double rate = 0.0;
+  };
+
+  void SetGrid();
+  void Wake();
+  void Run();
+  // Writes what the socket takes of the worker's configs
+  bool Send(size_t index);
+  bool Receive(size_t index, std::vector<float> &counts);
+
+private:
+  WorkerConfig m_config;
+  Target m_target;
+  // m_target's log densities for grid targets
+  std::shared_ptr<const std::vector<float>> m_grid;
+  std::vector<Worker> m_workers;
+  // Wakes the collecting thread to send configs or exit
+  int m_wakePipe[2];
+  bool m_stop = false;
+  std::mutex m_mutex;
+  std::thread m_thread;
+};
+
+// Worker side of Coordinator: steps and reports until the connection on
+// `fd` closes. Returns the process exit code. With `gpu` it steps a
+// Simulation in the current GL context and bins it there too, reading back
+// only the histogram and, every few steps, the binned member for its
+// moments. It falls back to CpuSimulation when the Simulation cannot be
+// created.
+int RunWorker(int fd, bool gpu = false);
@@ -3,8 +3,17 @@
 #include "distribution.frag.h"
 #include "distribution.vert.h"
 #include "mixture.h"
+#include "target.h"
 
-DistributionRenderer::DistributionRenderer() {
+#include <stdexcept>
+#include <utility>
+
+DistributionRenderer::DistributionRenderer()
+    : m_variants("distribution", DistributionVert, DistributionVert_len,
+                 DistributionFrag, DistributionFrag_len),
+      m_program(0), m_mixturePeak(0.0f), m_mixtureCount(0), m_cacheWidth(0),
+      m_cacheHeight(0),
+      m_cacheValid(false) {
   // Create VAO and VBO
   glGenVertexArrays(1, &m_quadVAO);
   glBindVertexArray(m_quadVAO);
@@ -24,87 +33,174 @@ DistributionRenderer::DistributionRenderer() {
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
   glEnableVertexAttribArray(0);
 
-  // Create shaders
-  {
-    m_vertShader = glCreateShader(GL_VERTEX_SHADER);
-    const GLchar *src = (const GLchar *)DistributionVert;
-    const GLsizei len = DistributionVert_len;
-    glShaderSource(m_vertShader, 1, &src, &len);
-    glCompileShader(m_vertShader);
-    CheckCompilationResult(m_vertShader, "distribution.vert");
-  }
+  SelectProgram();
+
+  // Create Mixture UBO. MixtureBlock holds one mixture per ensemble member;
+  // only the first is shown.
+  glGenBuffers(1, &m_mogUBO);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_mogUBO);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(GpuMixtures), nullptr,
+               GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-  {
-    m_fragShader = glCreateShader(GL_FRAGMENT_SHADER);
-    const GLchar *src = (const GLchar *)DistributionFrag;
-    const GLsizei len = DistributionFrag_len;
-    glShaderSource(m_fragShader, 1, &src, &len);
-    glCompileShader(m_fragShader);
-    CheckCompilationResult(m_fragShader, "distribution.frag");
+  glGenTextures(1, &m_targetGrid);
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glGenFramebuffers(1, &m_cacheFbo);
+  glGenTextures(1, &m_cacheColor);
+}
+
+void DistributionRenderer::SelectProgram() {
+  m_pendingPrelude.clear();
+  if (m_target.kind == TargetKind::Mixture && m_mixtureCount > 0) {
+    std::string prelude = TargetPrelude(m_target.kind, m_mixtureCount);
+    if (const GLuint program = m_variants.Poll(prelude)) {
+      UseProgram(program);
+      return;
+    }
+    m_pendingPrelude = std::move(prelude);
   }
+  UseProgram(m_variants.Get(TargetPrelude(m_target.kind)));
+}
 
-  m_program = glCreateProgram();
-  glAttachShader(m_program, m_vertShader);
-  glAttachShader(m_program, m_fragShader);
-  glLinkProgram(m_program);
+void DistributionRenderer::UseProgram(GLuint program) {
+  if (program == m_program)
+    return;
+  m_program = program;
 
   m_minUniform = glGetUniformLocation(m_program, "uMin");
   m_maxUniform = glGetUniformLocation(m_program, "uMax");
+  m_peakUniform = glGetUniformLocation(m_program, "uPeak");
+  m_targetUniforms.Locate(m_program);
 
-  // Bind uniform block index to binding 0
   GLuint blockIdx = glGetUniformBlockIndex(m_program, "MixtureBlock");
   if (blockIdx != GL_INVALID_INDEX) {
-    glUniformBlockBinding(m_program, blockIdx, 0);
+    glUniformBlockBinding(m_program, blockIdx, kMixtureBlockBinding);
   }
-
-  // Create Mixture UBO
-  glGenBuffers(1, &m_mogUBO);
-  glBindBuffer(GL_UNIFORM_BUFFER, m_mogUBO);
-  glBufferData(GL_UNIFORM_BUFFER, sizeof(MixtureOfGaussians), nullptr, GL_DYNAMIC_DRAW);
-  glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_mogUBO);
-  glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 void DistributionRenderer::SetMixture(const MixtureOfGaussians &m) {
   glBindBuffer(GL_UNIFORM_BUFFER, m_mogUBO);
   glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MixtureOfGaussians), &m);
   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  m_mixturePeak = m.peak;
+  const bool recompile = m.count != m_mixtureCount;
+  m_mixtureCount = m.count;
+
+  if (m_target.kind == TargetKind::Mixture) {
+    if (recompile)
+      SelectProgram();
+    m_cacheValid = false;
+  }
+}
+
+void DistributionRenderer::SetTarget(const Target &target) {
+  const bool recompile = target.kind != m_target.kind;
+  m_target = target;
+  if (recompile)
+    SelectProgram();
+  UploadTargetGrid(m_targetGrid, m_target);
+  m_cacheValid = false;
+}
+
+void DistributionRenderer::ResizeCache(int width, int height) {
+  glBindTexture(GL_TEXTURE_2D, m_cacheColor);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, nullptr);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, m_cacheFbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         m_cacheColor, 0);
+
+  const GLenum bufs[] = {GL_COLOR_ATTACHMENT0};
+  glDrawBuffers(1, bufs);
+
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+    throw std::runtime_error("Error creating framebuffer");
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  m_cacheWidth = width;
+  m_cacheHeight = height;
+  m_cacheValid = false;
 }
 
 void DistributionRenderer::Render(Viewport particleViewport,
                                   Viewport pixelViewport) {
-  glViewport(pixelViewport.pmin.x, pixelViewport.pmin.y, pixelViewport.Width(),
-             pixelViewport.Height());
+  const int width = static_cast<int>(pixelViewport.Width());
+  const int height = static_cast<int>(pixelViewport.Height());
+  if (width <= 0 || height <= 0)
+    return;
+
+  // Remember where the caller wants the panel to end up.
+  GLint target;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+
+  if (width != m_cacheWidth || height != m_cacheHeight)
+    ResizeCache(width, height);
+  if (!m_cacheValid || particleViewport != m_cacheViewport)
+    RenderToCache(particleViewport);
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_cacheFbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+  glBlitFramebuffer(0, 0, width, height, pixelViewport.pmin.x,
+                    pixelViewport.pmin.y, pixelViewport.pmin.x + width,
+                    pixelViewport.pmin.y + height, GL_COLOR_BUFFER_BIT,
+                    GL_NEAREST);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, target);
+}
+
+void DistributionRenderer::RenderToCache(Viewport particleViewport) {
+  glBindFramebuffer(GL_FRAMEBUFFER, m_cacheFbo);
+  glViewport(0, 0, m_cacheWidth, m_cacheHeight);
 
-#ifndef EMSCRIPTEN
-  glEnable(GL_PROGRAM_POINT_SIZE);
-#endif
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glDisable(GL_BLEND);
+
+  if (!m_pendingPrelude.empty()) {
+    if (const GLuint program = m_variants.Poll(m_pendingPrelude)) {
+      UseProgram(program);
+      m_pendingPrelude.clear();
+    }
+  }
 
   glBindVertexArray(m_quadVAO);
   glUseProgram(m_program);
 
   glUniform2f(m_minUniform, particleViewport.pmin.x, particleViewport.pmin.y);
   glUniform2f(m_maxUniform, particleViewport.pmax.x, particleViewport.pmax.y);
+  glUniform1f(m_peakUniform, m_target.kind == TargetKind::Mixture
+                                 ? m_mixturePeak
+                                 : m_target.peak);
+  m_targetUniforms.Apply(m_target, m_targetGrid, 0);
 
-  // Bind mixture UBO at binding=0
-  glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_mogUBO);
+  glBindBufferBase(GL_UNIFORM_BUFFER, kMixtureBlockBinding, m_mogUBO);
 
   glDrawArrays(GL_TRIANGLES, 0, 6);
 
   glBindVertexArray(0);
   glUseProgram(0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  m_cacheViewport = particleViewport;
+  m_cacheValid = true;
 }
 
 DistributionRenderer::~DistributionRenderer() {
   glDeleteVertexArrays(1, &m_quadVAO);
   glDeleteBuffers(1, &m_quadVBO);
-  glDeleteProgram(m_program);
-  glDeleteShader(m_vertShader);
-  glDeleteShader(m_fragShader);
   glDeleteBuffers(1, &m_mogUBO);
+  glDeleteTextures(1, &m_targetGrid);
+  glDeleteFramebuffers(1, &m_cacheFbo);
+  glDeleteTextures(1, &m_cacheColor);
 }
@@ -4,6 +4,10 @@
 
 #include "utils.h"
 #include "mixture.h"
+#include "shader_variants.h"
+#include "target.h"
+
+#include <string>
 
 class DistributionRenderer {
 public:
@@ -11,18 +15,46 @@ public:
   ~DistributionRenderer();
 
   void Render(Viewport particleViewport, Viewport pixelViewport);
+  // Shown for Mixture targets.
   void SetMixture(const MixtureOfGaussians &m);
+  // Switching kinds recompiles the program.
+  void SetTarget(const Target &target);
+
+private:
+  // Switches to the program for the current target, specialized on the
+  // mixture's component count once that variant has compiled.
+  void SelectProgram();
+  void UseProgram(GLuint program);
+  void ResizeCache(int width, int height);
+  void RenderToCache(Viewport particleViewport);
 
 private:
   GLuint m_quadVAO;
   GLuint m_quadVBO;
 
-  GLuint m_vertShader;
-  GLuint m_fragShader;
+  ShaderVariants m_variants;
   GLuint m_program;
+  // Prelude of the variant to switch to once compiled, empty if none
+  std::string m_pendingPrelude;
 
   GLint m_minUniform;
   GLint m_maxUniform;
+  GLint m_peakUniform;
 
   GLuint m_mogUBO;
+  float m_mixturePeak;
+  int m_mixtureCount;
+
+  Target m_target;
+  TargetUniforms m_targetUniforms;
+  GLuint m_targetGrid;
+
+  // The analytic distribution only changes with the mixture or the viewport,
+  // so it is rendered once into this texture and blitted every frame.
+  GLuint m_cacheFbo;
+  GLuint m_cacheColor;
+  int m_cacheWidth;
+  int m_cacheHeight;
+  bool m_cacheValid;
+  Viewport m_cacheViewport;
 };
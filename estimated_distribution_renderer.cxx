@@ -2,17 +2,43 @@
 
 #include "accumulator.frag.h"
 #include "accumulator.vert.h"
+#include "capabilities.h"
+#include "cpu_simulation.h"
 #include "estimated_distribution.frag.h"
 #include "estimated_distribution.vert.h"
 #include "mixture.h"
+#include "particle_storage.h"
+#include "reference.h"
 #include "utils.h"
 
-static constexpr size_t kWidth = 200;
-static constexpr size_t kHeight = 200;
-
-EstimatedDistributionRenderer::EstimatedDistributionRenderer() {
-  CreateAccumulatorProgram();
-  CreateRendererProgram();
+#include <algorithm>
+
+EstimatedDistributionRenderer::EstimatedDistributionRenderer(
+    bool gpuAccumulation)
+    : m_gpuAccumulation(gpuAccumulation &&
+                        GetCapabilities().histogramFormat != GL_NONE),
+      m_histogramFormat(m_gpuAccumulation ? GetCapabilities().histogramFormat
+                                          : GL_R32F),
+      m_particleFormat(ParticleFormat::RG32F), m_width(200), m_height(200),
+      m_accumVAO(0), m_accumVertShader(0), m_accumFragShader(0),
+      m_accumProgram(0), m_fbo(0), m_color(0), m_accumValid(false),
+      m_accumEnsembleSize(0), m_accumMember(0), m_accumStride(1),
+      m_readbackFbo(0), m_renderQuadVAO(0), m_renderQuadVBO(0),
+      m_renderVertShader(0), m_renderFragShader(0), m_renderProgram(0) {
+  try {
+    if (m_gpuAccumulation)
+      CreateAccumulatorProgram();
+    CreateAccumulatorFramebuffer();
+    CreateRendererProgram();
+  } catch (...) {
+    // The destructor does not run when the constructor throws; whatever
+    // replaces this renderer must not inherit its bindings
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    DeleteObjects();
+    throw;
+  }
 }
 
 void EstimatedDistributionRenderer::CreateAccumulatorProgram() {
@@ -23,9 +49,11 @@ void EstimatedDistributionRenderer::CreateAccumulatorProgram() {
   // Create shaders
   {
     m_accumVertShader = glCreateShader(GL_VERTEX_SHADER);
-    const GLchar *src = (const GLchar *)AccumulatorVert;
-    const GLsizei len = AccumulatorVert_len;
-    glShaderSource(m_accumVertShader, 1, &src, &len);
+    const std::string source = ShaderSource(
+        AccumulatorVert, AccumulatorVert_len,
+        ParticleStoragePrelude(m_particleFormat));
+    const GLchar *src = source.c_str();
+    glShaderSource(m_accumVertShader, 1, &src, nullptr);
     glCompileShader(m_accumVertShader);
     CheckCompilationResult(m_accumVertShader, "accumulator.vert");
   }
@@ -47,21 +75,27 @@ void EstimatedDistributionRenderer::CreateAccumulatorProgram() {
   m_accumParticlesUniform = glGetUniformLocation(m_accumProgram, "uParticles");
   m_accumParticlesWidthUniform =
       glGetUniformLocation(m_accumProgram, "uParticlesWidth");
+  m_accumFirstUniform = glGetUniformLocation(m_accumProgram, "uFirst");
+  m_accumCountUniform = glGetUniformLocation(m_accumProgram, "uCount");
+  m_accumStrideUniform = glGetUniformLocation(m_accumProgram, "uStride");
   m_accumMinUniform = glGetUniformLocation(m_accumProgram, "uMin");
   m_accumMaxUniform = glGetUniformLocation(m_accumProgram, "uMax");
 
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-  // Create framebuffers
-  glGenFramebuffers(1, &m_fbo);
+void EstimatedDistributionRenderer::CreateAccumulatorFramebuffer() {
+  // Create framebuffers. Ensemble members get stacked m_width x m_height
+  // bands.
+  if (m_gpuAccumulation)
+    glGenFramebuffers(1, &m_fbo);
   glGenTextures(1, &m_color);
 
   glBindTexture(GL_TEXTURE_2D, m_color);
-  // FIXME: Why doesn't this work
-  // glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, kWidth, kHeight, 0, GL_R, GL_FLOAT,
-  // nullptr);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, kWidth, kHeight, 0, GL_RG, GL_FLOAT,
+  glTexImage2D(GL_TEXTURE_2D, 0, m_histogramFormat, m_width,
+               m_height * kMaxEnsembleMembers, 0,
+               m_histogramFormat == GL_R32F ? GL_RED : GL_RG, GL_FLOAT,
                nullptr);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -71,6 +105,10 @@ void EstimatedDistributionRenderer::CreateAccumulatorProgram() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
   glBindTexture(GL_TEXTURE_2D, 0);
 
+  // Uploaded histograms only need the texture to be sampleable
+  if (!m_gpuAccumulation)
+    return;
+
   glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
                          m_color, 0);
@@ -79,10 +117,13 @@ void EstimatedDistributionRenderer::CreateAccumulatorProgram() {
   glDrawBuffers(1, bufs);
 
   GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-  if (status != GL_FRAMEBUFFER_COMPLETE)
-    throw std::runtime_error("Error creating framebuffer");
-
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    glDeleteFramebuffers(1, &m_fbo);
+    glDeleteTextures(1, &m_color);
+    m_fbo = m_color = 0;
+    throw std::runtime_error("Error creating framebuffer");
+  }
 }
 
 void EstimatedDistributionRenderer::CreateRendererProgram() {
@@ -136,6 +177,11 @@ void EstimatedDistributionRenderer::CreateRendererProgram() {
       glGetUniformLocation(m_renderProgram, "uNumParticles");
   m_renderAreaUniform = glGetUniformLocation(m_renderProgram, "uArea");
   m_renderPeakUniform = glGetUniformLocation(m_renderProgram, "uPeak");
+  m_renderMemberUniform = glGetUniformLocation(m_renderProgram, "uMember");
+  m_renderAccumSizeUniform =
+      glGetUniformLocation(m_renderProgram, "uAccumSize");
+  m_renderUVMinUniform = glGetUniformLocation(m_renderProgram, "uUVMin");
+  m_renderUVMaxUniform = glGetUniformLocation(m_renderProgram, "uUVMax");
 
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -145,25 +191,193 @@ void EstimatedDistributionRenderer::Render(Viewport particleViewport,
                                            Viewport pixelViewport,
                                            int particlesWidth,
                                            int particlesHeight,
-                                           GLuint particlesTexture) {
-  Accumulate(particleViewport, particlesWidth, particlesHeight,
-             particlesTexture);
+                                           GLuint particlesTexture,
+                                           int ensembleSize, int member,
+                                           const MemberRanges *ranges,
+                                           const Viewport *region) {
+  if (HistogramStale(particleViewport, ensembleSize, member)) {
+    // Accumulating and reading back rebind framebuffers; draw the panel
+    // where the caller wants it.
+    GLint target;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+    if (m_gpuAccumulation) {
+      Accumulate(particleViewport, particlesWidth, particlesHeight,
+                 particlesTexture, ensembleSize, ranges);
+    } else {
+      ReadbackHistogram(particleViewport, particlesWidth, particlesHeight,
+                        particlesTexture, ensembleSize, member);
+    }
+    m_accumViewport = particleViewport;
+    m_accumEnsembleSize = ensembleSize;
+    m_accumMember = member;
+    m_accumValid = true;
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+  }
+
+  int firstRow, numRows;
+  EnsembleRowRange(particlesHeight, ensembleSize, member, firstRow, numRows);
+  // Read back histograms bin every particle
+  const int stride = m_gpuAccumulation ? m_accumStride : 1;
+  DoRender(particleViewport, pixelViewport,
+           std::max(particlesWidth * numRows / stride, 1), member, region);
+}
+
+void EstimatedDistributionRenderer::Render(Viewport particleViewport,
+                                           Viewport pixelViewport,
+                                           const ParticleFrame &frame,
+                                           int member,
+                                           const Viewport *region) {
+  const int ensembleSize = frame.ensembleSize;
+  if (HistogramStale(particleViewport, ensembleSize, member)) {
+    BinMember(particleViewport, frame.particles, frame.width, frame.height,
+              ensembleSize, member);
+    m_accumViewport = particleViewport;
+    m_accumEnsembleSize = ensembleSize;
+    m_accumMember = member;
+    m_accumValid = true;
+  }
 
-  DoRender(particleViewport, pixelViewport, particlesWidth * particlesHeight);
+  int firstRow, numRows;
+  EnsembleRowRange(frame.height, ensembleSize, member, firstRow, numRows);
+  DoRender(particleViewport, pixelViewport, frame.width * numRows, member,
+           region);
+}
+
+bool EstimatedDistributionRenderer::HistogramStale(Viewport particleViewport,
+                                                   int ensembleSize,
+                                                   int member) {
+  // The GPU accumulates every member at once, CPU binning only the shown one
+  return !m_accumValid || particleViewport != m_accumViewport ||
+         ensembleSize != m_accumEnsembleSize ||
+         (!m_gpuAccumulation && member != m_accumMember);
+}
+
+void EstimatedDistributionRenderer::ReadbackHistogram(
+    Viewport particleViewport, int particlesWidth, int particlesHeight,
+    GLuint particlesTexture, int ensembleSize, int member) {
+  if (m_readbackFbo == 0)
+    glGenFramebuffers(1, &m_readbackFbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_readbackFbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         particlesTexture, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  ReadParticles(m_particleFormat, m_readbackFbo, particlesWidth,
+                particlesHeight, m_readback);
+  BinMember(particleViewport, m_readback, particlesWidth, particlesHeight,
+            ensembleSize, member);
+}
+
+void EstimatedDistributionRenderer::BinMember(
+    Viewport particleViewport, const std::vector<glm::vec2> &particles,
+    int particlesWidth, int particlesHeight, int ensembleSize, int member) {
+  int firstRow, numRows;
+  EnsembleRowRange(particlesHeight, ensembleSize, member, firstRow, numRows);
+  ReferenceHistogram(&particles[firstRow * particlesWidth],
+                     static_cast<size_t>(numRows) * particlesWidth,
+                     particleViewport, m_width, m_height, m_histogram);
+  UploadHistogram(member, m_histogram);
 }
 
 void EstimatedDistributionRenderer::SetMixture(const MixtureOfGaussians &m) {
+  SetPeak(m.peak);
+}
+
+void EstimatedDistributionRenderer::SetPeak(float peak) {
   glUseProgram(m_renderProgram);
-  glUniform1f(m_renderPeakUniform, m.peak);
+  glUniform1f(m_renderPeakUniform, peak);
   glUseProgram(0);
 }
 
+void EstimatedDistributionRenderer::Invalidate() { m_accumValid = false; }
+
+bool EstimatedDistributionRenderer::GpuAccumulation() {
+  return m_gpuAccumulation;
+}
+
+GLenum EstimatedDistributionRenderer::HistogramFormat() {
+  return m_histogramFormat;
+}
+
+void EstimatedDistributionRenderer::ReadHistogram(int member,
+                                                  std::vector<float> &counts) {
+  std::vector<float> texels(4 * m_width * m_height);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glReadPixels(0, member * m_height, m_width, m_height, GL_RGBA, GL_FLOAT,
+               texels.data());
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+  counts.resize(m_width * m_height);
+  for (size_t i = 0; i < counts.size(); i++)
+    counts[i] = texels[4 * i];
+}
+
+void EstimatedDistributionRenderer::UploadHistogram(
+    int member, const std::vector<float> &counts) {
+  glBindTexture(GL_TEXTURE_2D, m_color);
+  if (m_histogramFormat == GL_R32F) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, member * m_height, m_width, m_height,
+                    GL_RED, GL_FLOAT, counts.data());
+  } else {
+    // RG32F only accepts RG uploads
+    m_histogramStaging.resize(counts.size());
+    for (size_t i = 0; i < counts.size(); i++)
+      m_histogramStaging[i] = glm::vec2(counts[i], 0.0f);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, member * m_height, m_width, m_height,
+                    GL_RG, GL_FLOAT, m_histogramStaging.data());
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void EstimatedDistributionRenderer::SetResolution(int width, int height) {
+  if (width == m_width && height == m_height)
+    return;
+
+  glDeleteFramebuffers(1, &m_fbo);
+  glDeleteTextures(1, &m_color);
+
+  m_width = width;
+  m_height = height;
+  CreateAccumulatorFramebuffer();
+  Invalidate();
+}
+
+void EstimatedDistributionRenderer::SetAccumulationStride(int stride) {
+  stride = std::max(stride, 1);
+  if (stride == m_accumStride)
+    return;
+  m_accumStride = stride;
+  Invalidate();
+}
+
+int EstimatedDistributionRenderer::AccumulationStride() {
+  return m_accumStride;
+}
+
+void EstimatedDistributionRenderer::SetParticleFormat(ParticleFormat format) {
+  if (format == m_particleFormat)
+    return;
+
+  m_particleFormat = format;
+  Invalidate();
+  // Read back particles are decoded on the CPU
+  if (!m_gpuAccumulation)
+    return;
+
+  glDeleteVertexArrays(1, &m_accumVAO);
+  glDeleteProgram(m_accumProgram);
+  glDeleteShader(m_accumVertShader);
+  glDeleteShader(m_accumFragShader);
+  CreateAccumulatorProgram();
+}
+
 void EstimatedDistributionRenderer::Accumulate(Viewport particleViewport,
                                                int particlesWidth,
                                                int particlesHeight,
-                                               GLuint particlesTexture) {
+                                               GLuint particlesTexture,
+                                               int ensembleSize,
+                                               const MemberRanges *ranges) {
   // Accumulate
-  glViewport(0, 0, kWidth, kHeight);
   glEnable(GL_BLEND);
   glBlendFunc(GL_ONE, GL_ONE);
 
@@ -179,12 +393,32 @@ void EstimatedDistributionRenderer::Accumulate(Viewport particleViewport,
   glUniform1i(m_accumParticlesUniform, 0);
 
   glUniform1i(m_accumParticlesWidthUniform, particlesWidth);
+  glUniform1i(m_accumStrideUniform, m_accumStride);
   glUniform2f(m_accumMinUniform, particleViewport.pmin.x,
               particleViewport.pmin.y);
   glUniform2f(m_accumMaxUniform, particleViewport.pmax.x,
               particleViewport.pmax.y);
 
-  glDrawArrays(GL_POINTS, 0, particlesWidth * particlesHeight);
+  auto draw = [this](int first, int count) {
+    glUniform1i(m_accumFirstUniform, first);
+    glUniform1i(m_accumCountUniform, count);
+    glDrawArrays(GL_POINTS, 0, (count + m_accumStride - 1) / m_accumStride);
+  };
+
+  // Each member's rows land in its own band; points are 1px so the viewport
+  // alone keeps them from spilling into the neighbouring bands.
+  for (int member = 0; member < ensembleSize; member++) {
+    glViewport(0, member * m_height, m_width, m_height);
+    if (ranges != nullptr) {
+      for (const ParticleRange &range : (*ranges)[member])
+        draw(range.first, range.count);
+    } else {
+      int firstRow, numRows;
+      EnsembleRowRange(particlesHeight, ensembleSize, member, firstRow,
+                       numRows);
+      draw(firstRow * particlesWidth, numRows * particlesWidth);
+    }
+  }
 
   glBindTexture(GL_TEXTURE_2D, 0);
   glUseProgram(0);
@@ -194,7 +428,8 @@ void EstimatedDistributionRenderer::Accumulate(Viewport particleViewport,
 
 void EstimatedDistributionRenderer::DoRender(Viewport particleViewport,
                                              Viewport pixelViewport,
-                                             int numParticles) {
+                                             int numParticles, int member,
+                                             const Viewport *region) {
   glViewport(pixelViewport.pmin.x, pixelViewport.pmin.y, pixelViewport.Width(),
              pixelViewport.Height());
 
@@ -212,9 +447,19 @@ void EstimatedDistributionRenderer::DoRender(Viewport particleViewport,
   glBindTexture(GL_TEXTURE_2D, m_color);
   glUniform1i(m_renderAccumUniform, 0);
 
+  glUniform1i(m_renderMemberUniform, member);
+  glUniform2i(m_renderAccumSizeUniform, m_width, m_height);
+  glm::vec2 uvMin(0.0f), uvMax(1.0f);
+  if (region != nullptr) {
+    const glm::vec2 size(particleViewport.Width(), particleViewport.Height());
+    uvMin = (region->pmin - particleViewport.pmin) / size;
+    uvMax = (region->pmax - particleViewport.pmin) / size;
+  }
+  glUniform2f(m_renderUVMinUniform, uvMin.x, uvMin.y);
+  glUniform2f(m_renderUVMaxUniform, uvMax.x, uvMax.y);
   glUniform1i(m_renderNumParticlesUniform, numParticles);
-  glUniform1f(m_renderAreaUniform, (particleViewport.Width() / kWidth) *
-                                       (particleViewport.Height() / kHeight));
+  glUniform1f(m_renderAreaUniform, (particleViewport.Width() / m_width) *
+                                       (particleViewport.Height() / m_height));
 
   glDrawArrays(GL_TRIANGLES, 0, 6);
 
@@ -224,11 +469,18 @@ void EstimatedDistributionRenderer::DoRender(Viewport particleViewport,
 }
 
 EstimatedDistributionRenderer::~EstimatedDistributionRenderer() {
+  DeleteObjects();
+}
+
+void EstimatedDistributionRenderer::DeleteObjects() {
   // Accumulator
   glDeleteVertexArrays(1, &m_accumVAO);
   glDeleteProgram(m_accumProgram);
   glDeleteShader(m_accumVertShader);
   glDeleteShader(m_accumFragShader);
+  glDeleteFramebuffers(1, &m_fbo);
+  glDeleteTextures(1, &m_color);
+  glDeleteFramebuffers(1, &m_readbackFbo);
 
   // Renderer
   glDeleteVertexArrays(1, &m_renderQuadVAO);
@@ -2,29 +2,93 @@
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
+#include <vector>
 
 #include "utils.h"
 #include "mixture.h"
+#include "particle_storage.h"
+#include "spatial_index.h"
+
+struct ParticleFrame;
 
 class EstimatedDistributionRenderer {
 public:
-  EstimatedDistributionRenderer();
+  // Without GPU accumulation no float framebuffer is created and histograms
+  // are binned on the CPU, from ParticleFrames or from particles read back
+  // from the GPU. The latter also happens when the context cannot blend
+  // into float targets, see Capabilities::histogramFormat.
+  explicit EstimatedDistributionRenderer(bool gpuAccumulation = true);
   ~EstimatedDistributionRenderer();
 
+  // Accumulates one histogram per ensemble member in a single pass and shows
+  // the one of `member`. With `ranges` (see Simulation::VisibleRanges) only
+  // those particles are accumulated. With `region`, a part of
+  // particleViewport, only that part of the histogram is drawn into
+  // pixelViewport; drawing a panel in tiles this way bins it once.
+  void Render(Viewport particleViewport, Viewport pixelViewport,
+              int particlesWidth, int particlesHeight, GLuint particlesTexture,
+              int ensembleSize, int member,
+              const MemberRanges *ranges = nullptr,
+              const Viewport *region = nullptr);
+  // Same, binning only the shown member's particles on the CPU.
   void Render(Viewport particleViewport, Viewport pixelViewport,
-              int particlesWidth, int particlesHeight, GLuint particlesTexture);
+              const ParticleFrame &frame, int member,
+              const Viewport *region = nullptr);
   void SetMixture(const MixtureOfGaussians &m);
+  // Density at the top of the colormap, see TargetPeak; SetMixture sets the
+  // mixture's.
+  void SetPeak(float peak);
+  // Marks the cached histogram stale; call whenever the particles moved.
+  void Invalidate();
+  // Must match the format of the particles texture passed to Render.
+  void SetParticleFormat(ParticleFormat format);
+  // Number of histogram bins per ensemble member.
+  void SetResolution(int width, int height);
+  // Accumulates one in every `stride` particles, a fixed stratified subset,
+  // and scales the density to match: less fill for more noise. Only affects
+  // GPU accumulation.
+  void SetAccumulationStride(int stride);
+  int AccumulationStride();
 
-private:
-  void CreateAccumulatorProgram();
-  void CreateRendererProgram();
+  bool GpuAccumulation();
+  // GL_R32F, or GL_RG32F where R32F is not renderable
+  GLenum HistogramFormat();
+
+  // Reads back the histogram of one ensemble member, row-major. Needs GPU
+  // accumulation.
+  void ReadHistogram(int member, std::vector<float> &counts);
+  // Replaces the histogram of one ensemble member, row-major.
+  void UploadHistogram(int member, const std::vector<float> &counts);
 
+  // The two halves of Render, exposed for benchmarking.
   void Accumulate(Viewport particleViewport, int particlesWidth,
-                  int particlesHeight, GLuint particlesTexture);
+                  int particlesHeight, GLuint particlesTexture,
+                  int ensembleSize, const MemberRanges *ranges = nullptr);
   void DoRender(Viewport particleViewport, Viewport pixelViewport,
-                int numParticles);
+                int numParticles, int member,
+                const Viewport *region = nullptr);
 
 private:
+  void CreateAccumulatorProgram();
+  void CreateAccumulatorFramebuffer();
+  void CreateRendererProgram();
+  void DeleteObjects();
+  bool HistogramStale(Viewport particleViewport, int ensembleSize,
+                      int member);
+  void ReadbackHistogram(Viewport particleViewport, int particlesWidth,
+                         int particlesHeight, GLuint particlesTexture,
+                         int ensembleSize, int member);
+  void BinMember(Viewport particleViewport,
+                 const std::vector<glm::vec2> &particles, int particlesWidth,
+                 int particlesHeight, int ensembleSize, int member);
+
+private:
+  bool m_gpuAccumulation;
+  GLenum m_histogramFormat;
+  ParticleFormat m_particleFormat;
+  int m_width;
+  int m_height;
+
   // Accumulator
   GLuint m_accumVAO;
   GLuint m_accumVertShader;
@@ -32,9 +96,22 @@ private:
   GLuint m_accumProgram;
   GLuint m_fbo;
   GLuint m_color;
+  bool m_accumValid;
+  Viewport m_accumViewport;
+  int m_accumEnsembleSize;
+  int m_accumMember;
+  int m_accumStride;
+  std::vector<float> m_histogram;
+  std::vector<glm::vec2> m_histogramStaging;
+  // Only without GPU accumulation
+  GLuint m_readbackFbo;
+  std::vector<glm::vec2> m_readback;
 
   GLint m_accumParticlesUniform;
   GLint m_accumParticlesWidthUniform;
+  GLint m_accumFirstUniform;
+  GLint m_accumCountUniform;
+  GLint m_accumStrideUniform;
   GLint m_accumMinUniform;
   GLint m_accumMaxUniform;
 
@@ -52,4 +129,8 @@ private:
   GLint m_renderNumParticlesUniform;
   GLint m_renderAreaUniform;
   GLint m_renderPeakUniform;
+  GLint m_renderMemberUniform;
+  GLint m_renderAccumSizeUniform;
+  GLint m_renderUVMinUniform;
+  GLint m_renderUVMaxUniform;
 };
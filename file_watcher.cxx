@@ -0,0 +1,76 @@
+#include "file_watcher.h"
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+static long long ModificationTime(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return -1;
+#ifdef __linux__
+  return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  return st.st_mtime * 1000000000LL;
+#endif
+}
+
+FileWatcher::FileWatcher(const std::string &path)
+    : m_path(path), m_inotify(-1), m_mtime(ModificationTime(path)) {
+  const size_t slash = path.find_last_of('/');
+  const std::string dir =
+      slash == std::string::npos ? "." : path.substr(0, slash + 1);
+  m_name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+#ifdef __linux__
+  m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m_inotify >= 0 &&
+      inotify_add_watch(m_inotify, dir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(m_inotify);
+    m_inotify = -1;
+  }
+#endif
+}
+
+FileWatcher::~FileWatcher() {
+#ifdef __linux__
+  if (m_inotify >= 0)
+    close(m_inotify);
+#endif
+}
+
+bool FileWatcher::Poll() {
+  return m_inotify >= 0 ? PollInotify() : PollModificationTime();
+}
+
+bool FileWatcher::PollInotify() {
+  bool changed = false;
+#ifdef __linux__
+  alignas(inotify_event) char buffer[4096];
+  for (;;) {
+    const ssize_t n = read(m_inotify, buffer, sizeof(buffer));
+    if (n <= 0)
+      break;
+    for (ssize_t offset = 0; offset < n;) {
+      const inotify_event *event =
+          reinterpret_cast<const inotify_event *>(buffer + offset);
+      if (event->len > 0 && m_name == event->name)
+        changed = true;
+      offset += sizeof(inotify_event) + event->len;
+    }
+  }
+#endif
+  return changed;
+}
+
+bool FileWatcher::PollModificationTime() {
+  const long long mtime = ModificationTime(m_path);
+  if (mtime == m_mtime)
+    return false;
+  m_mtime = mtime;
+  return mtime >= 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+// Reports changes to one file without blocking. On Linux it watches the
+// file's directory with inotify, which also catches editors that save by
+// renaming a new file over the old one; elsewhere, or if inotify is
+// unavailable, each Poll() compares the modification time.
+class FileWatcher {
+public:
+  explicit FileWatcher(const std::string &path);
+  ~FileWatcher();
+
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+  // True if the file was written, replaced or created since the last call.
+  bool Poll();
+
+private:
+  bool PollInotify();
+  bool PollModificationTime();
+
+private:
+  std::string m_path;
+  // Name within the watched directory
+  std::string m_name;
+  int m_inotify;
+  // Modification time in nanoseconds, -1 while the file is missing
+  long long m_mtime;
+};
@@ -0,0 +1,108 @@
+#include "frame_governor.h"
+
+#include <algorithm>
+
+// Weight of a new frame in the average, about a 10 frame window
+static constexpr double kSmoothing = 0.1;
+// Frames after a level change whose times are not trusted: resizing the
+// histogram or a first draw can stall
+static constexpr int kSettleFrames = 10;
+// Over budget means above kOverload times it, within budget below
+// kHeadroom times it; in between neither timer runs
+static constexpr double kOverload = 1.2;
+static constexpr double kHeadroom = 1.05;
+// Seconds
+static constexpr double kDropAfter = 0.25;
+static constexpr double kProbeAfter = 3.0;
+static constexpr double kMaxProbeAfter = 30.0;
+// A probe that survives this long is kept
+static constexpr double kProbeWindow = 2.0;
+
+FrameGovernor::FrameGovernor(int levels, int level)
+    : m_levels(std::max(levels, 1)), m_level(0), m_enabled(true),
+      m_targetFps(60.0), m_average(0.0), m_samples(0), m_overTime(0.0),
+      m_underTime(0.0), m_probing(false), m_probeTime(0.0),
+      m_probeWait(kProbeAfter) {
+  SetLevel(level);
+}
+
+bool FrameGovernor::Update(double seconds) {
+  m_average = m_samples == 0 ? seconds
+                             : m_average + kSmoothing * (seconds - m_average);
+  if (++m_samples < kSettleFrames || !m_enabled)
+    return false;
+
+  const double budget = 1.0 / m_targetFps;
+  if (m_average > budget * kOverload) {
+    m_overTime += seconds;
+    m_underTime = 0.0;
+  } else if (m_average <= budget * kHeadroom) {
+    m_underTime += seconds;
+    m_overTime = 0.0;
+  } else {
+    m_overTime = 0.0;
+    m_underTime = 0.0;
+  }
+
+  if (m_probing)
+    m_probeTime += seconds;
+  if (m_overTime >= kDropAfter) {
+    if (m_probing && m_probeTime < kProbeWindow)
+      m_probeWait = std::min(2.0 * m_probeWait, kMaxProbeAfter);
+    m_probing = false;
+    return ChangeLevel(m_level - 1);
+  }
+  if (m_probing && m_probeTime >= kProbeWindow) {
+    m_probing = false;
+    m_probeWait = kProbeAfter;
+  }
+  if (!m_probing && m_underTime >= m_probeWait && m_level + 1 < m_levels) {
+    m_probing = true;
+    m_probeTime = 0.0;
+    return ChangeLevel(m_level + 1);
+  }
+  return false;
+}
+
+bool FrameGovernor::ChangeLevel(int level) {
+  level = std::max(0, std::min(level, m_levels - 1));
+  m_samples = 0;
+  m_overTime = 0.0;
+  m_underTime = 0.0;
+  if (level == m_level)
+    return false;
+  m_level = level;
+  return true;
+}
+
+void FrameGovernor::SetEnabled(bool enabled) {
+  if (enabled == m_enabled)
+    return;
+  m_enabled = enabled;
+  m_probing = false;
+  m_probeWait = kProbeAfter;
+  m_overTime = 0.0;
+  m_underTime = 0.0;
+}
+
+bool FrameGovernor::Enabled() { return m_enabled; }
+
+void FrameGovernor::SetTargetFps(double fps) {
+  m_targetFps = std::max(fps, 1.0);
+  m_overTime = 0.0;
+  m_underTime = 0.0;
+}
+
+double FrameGovernor::TargetFps() { return m_targetFps; }
+
+void FrameGovernor::SetLevel(int level) {
+  m_probing = false;
+  m_probeWait = kProbeAfter;
+  ChangeLevel(level);
+}
+
+int FrameGovernor::Level() { return m_level; }
+
+int FrameGovernor::Levels() { return m_levels; }
+
+double FrameGovernor::AverageMs() { return 1000.0 * m_average; }
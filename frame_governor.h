@@ -0,0 +1,51 @@
+#pragma once
+
+// Picks one of `levels` quality levels, 0 the cheapest, that holds the
+// frame rate at a target. It measures only the intervals between frames,
+// which WebGL can time as well as desktop GL; with vsync they cannot show
+// headroom, so it finds some by trying the next level up.
+//
+// A smoothed frame time over the budget for a while drops a level. After a
+// longer stretch within budget it probes one level up; a probe that
+// overruns soon after drops back and doubles the wait before the next one,
+// so the level settles instead of oscillating around the budget.
+class FrameGovernor {
+public:
+  FrameGovernor(int levels, int level);
+
+  // Feeds the time since the previous frame started. Returns true when the
+  // level changed.
+  bool Update(double seconds);
+
+  // While disabled Update only measures and the level stays where set.
+  void SetEnabled(bool enabled);
+  bool Enabled();
+  void SetTargetFps(double fps);
+  double TargetFps();
+  // Also restarts the measurements.
+  void SetLevel(int level);
+  int Level();
+  int Levels();
+
+  // Smoothed frame time
+  double AverageMs();
+
+private:
+  bool ChangeLevel(int level);
+
+private:
+  int m_levels;
+  int m_level;
+  bool m_enabled;
+  double m_targetFps;
+
+  double m_average;
+  int m_samples;
+  // Seconds the average has been over budget, and within it
+  double m_overTime;
+  double m_underTime;
+
+  bool m_probing;
+  double m_probeTime;
+  double m_probeWait;
+};
@@ -0,0 +1,110 @@
+#include "image_writer.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Largest payload of a deflate stored block
+static constexpr size_t kStoredBlock = 65535;
+
+static uint32_t Crc32(const uint8_t *data, size_t size, uint32_t crc) {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> t;
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void PutU32(std::vector<uint8_t> &out, uint32_t v) {
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+static void PutChunk(FILE *file, const char type[4],
+                     const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> chunk;
+  chunk.reserve(data.size() + 12);
+  PutU32(chunk, static_cast<uint32_t>(data.size()));
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  PutU32(chunk, Crc32(chunk.data() + 4, data.size() + 4, 0));
+  fwrite(chunk.data(), 1, chunk.size(), file);
+}
+
+void WritePng(const std::string &path, int width, int height,
+              const uint8_t *rgba) {
+  // Filter type 0 before every row, top row first. Alpha is dropped: the
+  // framebuffer's is whatever blending left, not coverage.
+  const size_t stride = static_cast<size_t>(width) * 4;
+  std::vector<uint8_t> raw;
+  raw.reserve((static_cast<size_t>(width) * 3 + 1) * height);
+  for (int y = height - 1; y >= 0; y--) {
+    raw.push_back(0);
+    const uint8_t *row = rgba + y * stride;
+    for (int x = 0; x < width; x++)
+      raw.insert(raw.end(), row + 4 * x, row + 4 * x + 3);
+  }
+
+  // zlib stream of stored blocks, then the Adler-32 of the raw data
+  std::vector<uint8_t> idat;
+  idat.reserve(raw.size() + raw.size() / kStoredBlock * 5 + 16);
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+  for (size_t offset = 0;;) {
+    const size_t size = std::min(kStoredBlock, raw.size() - offset);
+    const bool last = offset + size == raw.size();
+    idat.push_back(last ? 1 : 0);
+    idat.push_back(size & 0xff);
+    idat.push_back(size >> 8);
+    idat.push_back(~size & 0xff);
+    idat.push_back((~size >> 8) & 0xff);
+    idat.insert(idat.end(), raw.begin() + offset, raw.begin() + offset + size);
+    offset += size;
+    if (last)
+      break;
+  }
+  uint32_t a = 1, b = 0;
+  for (uint8_t byte : raw) {
+    a = (a + byte) % 65521;
+    b = (b + a) % 65521;
+  }
+  PutU32(idat, (b << 16) | a);
+
+  std::vector<uint8_t> header;
+  PutU32(header, width);
+  PutU32(header, height);
+  header.push_back(8); // Bit depth
+  header.push_back(2); // RGB
+  header.push_back(0); // Deflate
+  header.push_back(0); // Adaptive filtering
+  header.push_back(0); // No interlace
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    throw std::runtime_error("Cannot open " + path + ": " +
+                             std::strerror(errno));
+  static const uint8_t kSignature[] = {0x89, 'P',  'N',  'G',
+                                       '\r', '\n', 0x1a, '\n'};
+  fwrite(kSignature, 1, sizeof(kSignature), file);
+  PutChunk(file, "IHDR", header);
+  PutChunk(file, "IDAT", idat);
+  PutChunk(file, "IEND", {});
+  const bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed)
+    throw std::runtime_error("Error writing " + path);
+}
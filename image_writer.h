@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Writes 8-bit RGBA pixels as an opaque RGB PNG. Rows are bottom-up like
+// glReadPixels returns them. The image data is stored uncompressed (deflate
+// "stored" blocks), trading file size for needing no zlib and almost no CPU
+// time.
+// Throws std::runtime_error when the file cannot be written.
+void WritePng(const std::string &path, int width, int height,
+              const uint8_t *rgba);
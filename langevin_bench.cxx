@@ -0,0 +1,1337 @@
+// Headless benchmark of the simulation and render passes.
+//
+// Sweeps particle counts, mixture sizes, estimator resolutions and particle
+// storage formats, times every pass separately and prints the results as one
+// JSON document. On machines without a display run it with
+// SDL_VIDEODRIVER=offscreen (EGL surfaceless) or on Mesa's llvmpipe.
+//
+// With --validate it instead checks the GPU passes against the CPU reference
+// in reference.h, and Coordinator against local Simulations by starting
+// copies of itself with --worker FD that step on the GPU. It exits with a
+// non-zero status when any check fails.
+//
+// With --backend cpu it times CpuSimulation instead and needs no GL context;
+// that is the only backend of the wasm build, which runs under Node. It ends
+// with a scaling report of CpuSimulation::Update over thread counts.
+#ifndef EMSCRIPTEN
+#include <GL/glew.h>
+#include <SDL.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "capabilities.h"
+#include "cpu_simulation.h"
+#ifdef LANGEVIN_DISTRIBUTED
+#include "distributed.h"
+#endif
+#include "distribution_renderer.h"
+#include "estimated_distribution_renderer.h"
+#include "mixture.h"
+#include "offscreen.h"
+#include "particle_renderer.h"
+#include "particle_storage.h"
+#include "reference.h"
+#include "score_table.h"
+#include "simulation.h"
+#include "target.h"
+#include "utils.h"
+
+enum class Backend { Gpu, Cpu };
+
+struct Options {
+  int iterations = 20;
+  int warmup = 3;
+  bool quick = false;
+  bool validate = false;
+  Backend backend = Backend::Gpu;
+  int threads = -1; // CPU backend workers besides the main thread
+  const char *output = nullptr;
+  // Started again as the workers of the distributed check
+  const char *executable = nullptr;
+};
+
+struct ParticleSize {
+  size_t width;
+  size_t height;
+};
+
+static const ParticleSize kParticleSizes[] = {
+    {480, 270}, {960, 540}, {1920, 1080}, {2880, 1620}};
+static const int kComponentCounts[] = {1, 2, 4, 10};
+static const int kResolutions[] = {100, 200, 400};
+// Largest score table side of Simulation::UpdateTabulated
+static constexpr int kBenchTableSize = 256;
+
+// Output panel used by the render passes, the size of half the default window
+static constexpr int kPanelWidth = 640;
+static constexpr int kPanelHeight = 800;
+
+static constexpr int kAccuracySteps = 100;
+
+static void PrintUsage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--iterations N] [--warmup N] [--quick] [--validate] "
+          "[--backend gpu|cpu] [--threads N] [--output FILE]\n",
+          argv0);
+}
+
+static bool ParseOptions(int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+      options.iterations = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+      options.warmup = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--quick")) {
+      options.quick = true;
+    } else if (!strcmp(argv[i], "--validate")) {
+      options.validate = true;
+    } else if (!strcmp(argv[i], "--backend") && i + 1 < argc) {
+      const char *backend = argv[++i];
+      if (!strcmp(backend, "gpu"))
+        options.backend = Backend::Gpu;
+      else if (!strcmp(backend, "cpu"))
+        options.backend = Backend::Cpu;
+      else
+        return false;
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      options.threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+      options.output = argv[++i];
+    } else {
+      return false;
+    }
+  }
+  return options.iterations > 0 && options.warmup >= 0 &&
+         !(options.validate && options.backend == Backend::Cpu);
+}
+
+// Components spread on a circle so that every one of them contributes.
+static MixtureOfGaussians MakeMixture(int count) {
+  MixtureOfGaussians m = {};
+  m.count = count;
+  for (int i = 0; i < count; i++) {
+    const float angle = 6.283185307179586f * i / count;
+    m.g[i].mean = count == 1
+                      ? glm::vec2(0.0f)
+                      : 0.5f * glm::vec2(std::cos(angle), std::sin(angle));
+    m.g[i].sigma = glm::vec2(0.1f, 0.1f);
+  }
+  m.UpdatePeak();
+  return m;
+}
+
+static void Synchronize(const Options &options) {
+#ifndef EMSCRIPTEN
+  if (options.backend == Backend::Gpu)
+    glFinish();
+#endif
+}
+
+// Average milliseconds per call of `pass`, synchronizing with the GPU around
+// the timed loop only.
+template <typename F>
+static double TimePass(const Options &options, F &&pass) {
+  for (int i = 0; i < options.warmup; i++)
+    pass();
+  Synchronize(options);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.iterations; i++)
+    pass();
+  Synchronize(options);
+  const auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         options.iterations;
+}
+
+class JsonWriter {
+public:
+  explicit JsonWriter(FILE *file) : m_file(file), m_first(true) {}
+
+  void Begin(const char *renderer, const char *version) {
+    fprintf(m_file, "{\n  \"renderer\": \"%s\",\n  \"version\": \"%s\",\n",
+            renderer, version);
+    fprintf(m_file, "  \"results\": [");
+  }
+
+  // Passes that do not touch particles record a zero particle size.
+  void Record(const char *pass, ParticleSize size, const char *format,
+              int components, int resolution, double ms) {
+    Separator();
+    fprintf(m_file,
+            "    {\"pass\": \"%s\", \"particles\": %zu, \"width\": %zu, "
+            "\"height\": %zu, \"components\": %d, \"resolution\": %d, "
+            "\"format\": \"%s\", \"ms\": %.4f, \"per_second\": %.2f}",
+            pass, size.width * size.height, size.width, size.height,
+            components, resolution, format, ms, ms > 0.0 ? 1000.0 / ms : 0.0);
+  }
+
+  void Accuracy(ParticleFormat format, const ParticleStorageReport &r) {
+    Separator();
+    fprintf(m_file,
+            "    {\"pass\": \"StorageAccuracy\", \"format\": \"%s\", "
+            "\"steps\": %d, \"rms_error\": %.6g, \"max_error\": %.6g, "
+            "\"mean_error\": [%.6g, %.6g], \"variance_error\": [%.6g, %.6g]}",
+            GetParticleFormatInfo(format).name, kAccuracySteps, r.rmsError,
+            r.maxError, r.meanError.x, r.meanError.y, r.varianceError.x,
+            r.varianceError.y);
+  }
+
+  // Speedup and parallel efficiency relative to one thread.
+  void Scaling(const char *pass, ParticleSize size, int threads, int nodes,
+               double ms, double msOneThread) {
+    Separator();
+    const double speedup = ms > 0.0 ? msOneThread / ms : 0.0;
+    fprintf(m_file,
+            "    {\"pass\": \"%s\", \"particles\": %zu, \"threads\": %d, "
+            "\"nodes\": %d, \"ms\": %.4f, \"speedup\": %.2f, "
+            "\"efficiency\": %.3f}",
+            pass, size.width * size.height, threads, nodes, ms, speedup,
+            speedup / threads);
+  }
+
+  void Check(const char *check, double error, double tolerance) {
+    Separator();
+    fprintf(m_file,
+            "    {\"check\": \"%s\", \"error\": %.6g, \"tolerance\": %.6g, "
+            "\"passed\": %s}",
+            check, error, tolerance, error <= tolerance ? "true" : "false");
+  }
+
+  void End() { fprintf(m_file, "\n  ]\n}\n"); }
+
+private:
+  void Separator() {
+    fprintf(m_file, m_first ? "\n" : ",\n");
+    m_first = false;
+  }
+
+  FILE *m_file;
+  bool m_first;
+};
+
+#ifndef EMSCRIPTEN
+// Framebuffer standing in for the window, so no pass depends on the default
+// framebuffer of the hidden window.
+class PanelTarget {
+public:
+  PanelTarget() {
+    glGenFramebuffers(1, &m_fbo);
+    glGenTextures(1, &m_color);
+    glBindTexture(GL_TEXTURE_2D, m_color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, kPanelWidth, kPanelHeight, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           m_color, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+      throw std::runtime_error("Error creating framebuffer");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  ~PanelTarget() {
+    glDeleteFramebuffers(1, &m_fbo);
+    glDeleteTextures(1, &m_color);
+  }
+
+  void Bind() { glBindFramebuffer(GL_FRAMEBUFFER, m_fbo); }
+
+  void Read(std::vector<unsigned char> &rgba) {
+    rgba.resize(4 * kPanelWidth * kPanelHeight);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+    glReadPixels(0, 0, kPanelWidth, kPanelHeight, GL_RGBA, GL_UNSIGNED_BYTE,
+                 rgba.data());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  }
+
+private:
+  GLuint m_fbo;
+  GLuint m_color;
+};
+
+static void BenchmarkSimulation(const Options &options, JsonWriter &json,
+                                ParticleSize size, ParticleFormat format) {
+  Simulation simulation(size.width, size.height);
+  simulation.SetParticleFormat(format);
+  simulation.SetDt(0.0004f);
+
+  // Generic is the program that runs while a specialized variant compiles
+  for (int components : kComponentCounts) {
+    simulation.SetMixture(MakeMixture(components));
+    for (bool specialize : {true, false}) {
+      simulation.SetShaderSpecialization(specialize);
+      simulation.FinishShaders();
+      simulation.ResetParticles();
+      const double ms = TimePass(options, [&] { simulation.Update(); });
+      json.Record(specialize ? "Simulation::Update"
+                             : "Simulation::UpdateGeneric",
+                  size, GetParticleFormatInfo(format).name, components, 0, ms);
+    }
+  }
+  simulation.SetShaderSpecialization(true);
+
+  for (int components : kComponentCounts) {
+    simulation.SetMixture(MakeMixture(components));
+    simulation.SetScoreTable(kBenchTableSize);
+    simulation.FinishShaders();
+    simulation.ResetParticles();
+    const double ms = TimePass(options, [&] { simulation.Update(); });
+    json.Record("Simulation::UpdateTabulated", size,
+                GetParticleFormatInfo(format).name, components, 0, ms);
+  }
+  simulation.SetScoreTable(0);
+
+  // Labels and hop counts only, then also reading back and reducing them
+  // every step, which stalls like sorting
+  for (int steps : {std::numeric_limits<int>::max(), 1}) {
+    simulation.SetModeTracking(steps);
+    for (int components : kComponentCounts) {
+      simulation.SetMixture(MakeMixture(components));
+      simulation.FinishShaders();
+      simulation.ResetParticles();
+      const double ms = TimePass(options, [&] { simulation.Update(); });
+      json.Record(steps == 1 ? "Simulation::UpdateModesReduced"
+                             : "Simulation::UpdateModes",
+                  size, GetParticleFormatInfo(format).name, components, 0, ms);
+    }
+  }
+  simulation.SetModeTracking(0);
+
+  PanelTarget target;
+  EstimatedDistributionRenderer estimated;
+  estimated.SetParticleFormat(format);
+  estimated.SetMixture(MakeMixture(4));
+
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  const Viewport pixelViewport = {{0.0f, 0.0f},
+                                  {(float)kPanelWidth, (float)kPanelHeight}};
+  for (int resolution : kResolutions) {
+    estimated.SetResolution(resolution, resolution);
+
+    const double accumulateMs = TimePass(options, [&] {
+      estimated.Accumulate(particleViewport, simulation.Width(),
+                           simulation.Height(), simulation.ParticlesTexture(),
+                           1);
+    });
+    json.Record("EstimatedDistributionRenderer::Accumulate", size,
+                GetParticleFormatInfo(format).name, 4, resolution,
+                accumulateMs);
+
+    const double renderMs = TimePass(options, [&] {
+      target.Bind();
+      estimated.DoRender(particleViewport, pixelViewport,
+                         simulation.NumParticles(), 0);
+    });
+    json.Record("EstimatedDistributionRenderer::DoRender", size,
+                GetParticleFormatInfo(format).name, 4, resolution, renderMs);
+  }
+
+  // Zoomed into one mode (viewScale 0.05), with and without culling
+  const double sortMs = TimePass(options, [&] { simulation.Sort(); });
+  json.Record("Simulation::Sort", size, GetParticleFormatInfo(format).name, 4,
+              0, sortMs);
+  const Viewport zoomed = {{0.45f, -0.05f}, {0.55f, 0.05f}};
+  MemberRanges ranges;
+  simulation.VisibleRanges(zoomed, ranges);
+  estimated.SetResolution(200, 200);
+  for (const MemberRanges *culling : {(const MemberRanges *)nullptr,
+                                      (const MemberRanges *)&ranges}) {
+    const double ms = TimePass(options, [&] {
+      estimated.Accumulate(zoomed, simulation.Width(), simulation.Height(),
+                           simulation.ParticlesTexture(), 1, culling);
+    });
+    json.Record(culling ? "EstimatedDistributionRenderer::AccumulateCulled"
+                        : "EstimatedDistributionRenderer::AccumulateZoomed",
+                size, GetParticleFormatInfo(format).name, 4, 200, ms);
+  }
+
+  // The lowest quality levels of the frame governor
+  estimated.SetAccumulationStride(4);
+  const double stridedMs = TimePass(options, [&] {
+    estimated.Accumulate(particleViewport, simulation.Width(),
+                         simulation.Height(), simulation.ParticlesTexture(), 1);
+  });
+  json.Record("EstimatedDistributionRenderer::AccumulateStrided", size,
+              GetParticleFormatInfo(format).name, 4, 200, stridedMs);
+  estimated.SetAccumulationStride(1);
+
+  // The panel-sized budget bounds the sprites drawn at any particle count
+  ParticleRenderer particles;
+  particles.SetParticleFormat(format);
+  const double particlesMs = TimePass(options, [&] {
+    target.Bind();
+    particles.Render(particleViewport, pixelViewport, simulation.Width(),
+                     simulation.Height(), simulation.ParticlesTexture(),
+                     simulation.PreviousParticlesTexture(), 1, 0);
+  });
+  json.Record("ParticleRenderer::Render", size,
+              GetParticleFormatInfo(format).name, 4, 0, particlesMs);
+}
+
+static void BenchmarkDistribution(const Options &options, JsonWriter &json) {
+  PanelTarget target;
+  DistributionRenderer distribution;
+
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  const Viewport pixelViewport = {{0.0f, 0.0f},
+                                  {(float)kPanelWidth, (float)kPanelHeight}};
+  for (int components : kComponentCounts) {
+    const MixtureOfGaussians mixture = MakeMixture(components);
+    // SetMixture drops the cached panel, so every call re-evaluates it
+    const double ms = TimePass(options, [&] {
+      distribution.SetMixture(mixture);
+      target.Bind();
+      distribution.Render(particleViewport, pixelViewport);
+    });
+    json.Record("DistributionRenderer::Render", ParticleSize{0, 0}, "RG32F",
+                components, 0, ms);
+  }
+}
+
+static void BenchmarkAccuracy(JsonWriter &json) {
+  const MixtureOfGaussians mixture = MakeMixture(4);
+
+  Simulation reference;
+  reference.SetMixture(mixture);
+  reference.SetDt(0.0004f);
+  for (int i = 0; i < kAccuracySteps; i++)
+    reference.Update();
+  std::vector<glm::vec2> expected;
+  reference.ReadParticles(expected);
+
+  for (int i = 1; i < kNumParticleFormats; i++) {
+    const ParticleFormat format = static_cast<ParticleFormat>(i);
+    if (!IsParticleFormatSupported(format))
+      continue;
+    Simulation compact;
+    compact.SetParticleFormat(format);
+    compact.SetMixture(mixture);
+    compact.SetDt(0.0004f);
+    for (int step = 0; step < kAccuracySteps; step++)
+      compact.Update();
+
+    std::vector<glm::vec2> actual;
+    compact.ReadParticles(actual);
+    json.Accuracy(format, CompareParticleStorage(expected, actual));
+  }
+}
+
+// Tolerances of the validation checks. GLSL leaves the precision of sin, cos,
+// log and exp unspecified (llvmpipe's sin is off by ~3e-3), so positions are
+// compared in units of the noise standard deviation; a wrong random number
+// or score is off by O(1). Colors are limited by the 8-bit framebuffer.
+static constexpr double kPositionTolerance = 5e-2;
+// Relative to max(|score|, sqrt(2 / dt)), the larger of drift and diffusion
+static constexpr double kScoreTolerance = 5e-2;
+static constexpr double kNoiseSigmas = 5.0;     // Moments within 5 std errors
+static constexpr double kHistogramTolerance = 1e-4; // Misbinned fraction
+// Particles this close to a bin edge (in pixels) may land on either side,
+// allowing for subpixel snapping and the vertex shader's float math
+static constexpr float kRasterSnap = 1.0f / 16.0f;
+// Likewise particles this close to a grid target's node lines (in cells)
+static constexpr float kCellSnap = 1.0f / 64.0f;
+static constexpr double kPeakTolerance = 0.05;      // Relative
+static constexpr double kColorTolerance = 2.0 / 255.0;
+
+static constexpr size_t kValidationWidth = 256;
+static constexpr size_t kValidationHeight = 128;
+static constexpr int kValidationSteps = 3;
+// Panel pixel centers never fall on a bin edge at this resolution
+static constexpr int kValidationResolution = 100;
+static constexpr int kValidationTableSize = 128;
+// Does not divide the panel, so edge tiles are partial
+static constexpr int kValidationTileSize = 96;
+// Enough steps for particles near the component boundaries to hop
+static constexpr int kValidationModeSteps = 20;
+
+// A mixture with anisotropic, unevenly sized components, so that the score
+// and the peak are not symmetric by accident.
+static MixtureOfGaussians MakeValidationMixture() {
+  MixtureOfGaussians m = {};
+  m.count = 3;
+  m.g[0].mean = glm::vec2(-0.4f, 0.1f);
+  m.g[0].sigma = glm::vec2(0.15f, 0.08f);
+  m.g[1].mean = glm::vec2(0.35f, -0.3f);
+  m.g[1].sigma = glm::vec2(0.1f, 0.2f);
+  m.g[2].mean = glm::vec2(0.3f, 0.45f);
+  m.g[2].sigma = glm::vec2(0.25f, 0.12f);
+  m.UpdatePeak();
+  return m;
+}
+
+// Largest channel difference between an 8-bit pixel and a reference color
+static double ColorError(const unsigned char *rgba, glm::vec3 expected) {
+  const float channels[] = {expected.x, expected.y, expected.z};
+  double error = 0.0;
+  for (int i = 0; i < 3; i++) {
+    const double c = std::min(std::max(channels[i], 0.0f), 1.0f);
+    error = std::max(error, std::abs(rgba[i] / 255.0 - c));
+  }
+  return error;
+}
+
+// Steps a two member ensemble on the GPU and replays every particle on the
+// CPU with the same generator, checking positions, the score implied by the
+// drift and the moments of the implied noise.
+static bool ValidateSimulation(JsonWriter &json,
+                               std::vector<glm::vec2> &particles) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  std::vector<EnsembleMember> members(2);
+  members[0].dt = 0.001f;
+  members[0].seed = 0;
+  members[1].dt = 0.0004f;
+  members[1].seed = 7;
+
+  Simulation simulation(kValidationWidth, kValidationHeight);
+  simulation.SetEnsemble({mixture}, members);
+  simulation.FinishShaders();
+
+  std::vector<glm::vec2> expected;
+  simulation.ReadParticles(expected);
+
+  double positionError = 0.0;
+  double scoreError = 0.0;
+  double sum = 0.0, sumSquares = 0.0;
+  size_t samples = 0;
+  for (int step = 1; step <= kValidationSteps; step++) {
+    const std::vector<glm::vec2> previous = expected;
+    simulation.Update();
+    simulation.ReadParticles(particles);
+
+    for (int m = 0; m < (int)members.size(); m++) {
+      int firstRow, numRows;
+      EnsembleRowRange(kValidationHeight, members.size(), m, firstRow,
+                       numRows);
+      const float dt = members[m].dt;
+      for (int y = firstRow; y < firstRow + numRows; y++) {
+        for (size_t x = 0; x < kValidationWidth; x++) {
+          const size_t i = y * kValidationWidth + x;
+          const glm::vec2 p = previous[i];
+          expected[i] = ReferenceStep(mixture, dt, p, x, y, kValidationWidth,
+                                      step, members[m].seed);
+          positionError =
+              std::max(positionError,
+                       (double)glm::length(particles[i] - expected[i]) /
+                           std::sqrt(2.0f * dt));
+
+          ReferenceRng rng;
+          rng.Seed(x, y, kValidationWidth, step, members[m].seed);
+          const glm::vec2 w = rng.NextGaussian();
+          const glm::vec2 score = mixture.Score(p);
+          const glm::vec2 implied =
+              (particles[i] - p - std::sqrt(2.0f * dt) * w) / dt;
+          scoreError =
+              std::max(scoreError, (double)glm::length(implied - score) /
+                                       std::max(glm::length(score),
+                                                std::sqrt(2.0f / dt)));
+
+          const glm::vec2 z =
+              (particles[i] - p - dt * score) / std::sqrt(2.0f * dt);
+          sum += z.x + z.y;
+          sumSquares += z.x * z.x + z.y * z.y;
+          samples += 2;
+        }
+      }
+    }
+    // Continue from the GPU state so errors do not compound
+    expected = particles;
+  }
+
+  const double mean = sum / samples;
+  const double variance = sumSquares / samples - mean * mean;
+  const double meanTolerance = kNoiseSigmas / std::sqrt((double)samples);
+  const double varianceTolerance =
+      kNoiseSigmas * std::sqrt(2.0 / (double)samples);
+
+  json.Check("Simulation::Position", positionError, kPositionTolerance);
+  json.Check("Simulation::Score", scoreError, kScoreTolerance);
+  json.Check("Simulation::NoiseMean", std::abs(mean), meanTolerance);
+  json.Check("Simulation::NoiseVariance", std::abs(variance - 1.0),
+             varianceTolerance);
+  return positionError <= kPositionTolerance &&
+         scoreError <= kScoreTolerance &&
+         std::abs(mean) <= meanTolerance &&
+         std::abs(variance - 1.0) <= varianceTolerance;
+}
+
+// Tracks modes over kValidationModeSteps steps, reduced once at the end, and
+// compares the occupancy and hops with labels computed on the CPU from the
+// positions read before every step.
+static bool ValidateModes(JsonWriter &json) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  std::vector<EnsembleMember> members(2);
+  members[0].dt = 0.001f;
+  members[1].dt = 0.0004f;
+  members[1].seed = 7;
+
+  Simulation simulation(kValidationWidth, kValidationHeight);
+  simulation.SetEnsemble({mixture}, members);
+  simulation.SetModeTracking(kValidationModeSteps);
+  simulation.FinishShaders();
+
+  const size_t n = kValidationWidth * kValidationHeight;
+  std::vector<glm::vec2> particles;
+  std::vector<int> labels(n, -1);
+  std::vector<uint64_t> occupancy(members.size() * kMaxModes, 0);
+  std::vector<uint64_t> hops(members.size(), 0);
+  for (int step = 1; step <= kValidationModeSteps; step++) {
+    // Labels describe the positions the step starts from
+    simulation.ReadParticles(particles);
+    for (size_t m = 0; m < members.size(); m++) {
+      int firstRow, numRows;
+      EnsembleRowRange(kValidationHeight, members.size(), m, firstRow,
+                       numRows);
+      for (size_t i = firstRow * kValidationWidth;
+           i < (firstRow + numRows) * kValidationWidth; i++) {
+        const int label = mixture.Mode(particles[i]);
+        hops[m] += labels[i] >= 0 && labels[i] != label;
+        labels[i] = label;
+        if (step == kValidationModeSteps)
+          occupancy[m * kMaxModes + label]++;
+      }
+    }
+    simulation.Update();
+  }
+
+  const ModeStatistics &statistics = simulation.Modes();
+  if (statistics.members.size() != members.size() ||
+      statistics.step != kValidationModeSteps)
+    throw std::runtime_error("No mode reduction after the tracked steps");
+  double mislabeled = 0.0, hopError = 0.0;
+  for (size_t m = 0; m < members.size(); m++) {
+    const MemberModeStatistics &member = statistics.members[m];
+    for (int c = 0; c < kMaxModes; c++) {
+      mislabeled += std::abs(static_cast<double>(member.occupancy[c]) -
+                             occupancy[m * kMaxModes + c]);
+    }
+    hopError += std::abs(static_cast<double>(member.windowHops) - hops[m]);
+  }
+  mislabeled /= 2.0 * n;
+  // Particles on a component boundary can round to either label at every
+  // step, and each disagreement shifts up to two hops
+  hopError /= 2.0 * n * kValidationModeSteps;
+  json.Check("Simulation::ModeOccupancy", mislabeled, kHistogramTolerance);
+  json.Check("Simulation::ModeHops", hopError, kHistogramTolerance);
+  return mislabeled <= kHistogramTolerance && hopError <= kHistogramTolerance;
+}
+
+// Steps the specialized and the generic simulation program side by side; the
+// unrolled loops may only round differently.
+static bool ValidateSpecialization(JsonWriter &json) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  const float dt = 0.001f;
+
+  Simulation specialized(kValidationWidth, kValidationHeight);
+  Simulation generic(kValidationWidth, kValidationHeight);
+  generic.SetShaderSpecialization(false);
+  for (Simulation *simulation : {&specialized, &generic}) {
+    simulation->SetMixture(mixture);
+    simulation->SetDt(dt);
+    simulation->FinishShaders();
+    for (int step = 0; step < kValidationSteps; step++)
+      simulation->Update();
+  }
+
+  std::vector<glm::vec2> a, b;
+  specialized.ReadParticles(a);
+  generic.ReadParticles(b);
+  double error = 0.0;
+  for (size_t i = 0; i < a.size(); i++)
+    error = std::max(error, (double)glm::length(a[i] - b[i]) /
+                                std::sqrt(2.0f * dt));
+  if (!specialized.ShaderSpecialized() || generic.ShaderSpecialized())
+    error = INFINITY;
+
+  json.Check("Simulation::Specialization", error, kPositionTolerance);
+  return error <= kPositionTolerance;
+}
+
+// The score a Simulation with score tables steps with
+struct TabulatedDensity {
+  const ScoreTable *table;
+  const MixtureOfGaussians *mixture;
+
+  glm::vec2 Score(glm::vec2 p) const {
+    return table->Contains(p) ? table->Lookup(p) : mixture->Score(p);
+  }
+};
+
+// Steps with a score table and checks the positions against the CPU lookup
+// of the same table.
+static bool ValidateScoreTable(JsonWriter &json) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  const float dt = 0.001f;
+
+  Simulation simulation(kValidationWidth, kValidationHeight);
+  simulation.SetMixture(mixture);
+  simulation.SetDt(dt);
+  simulation.SetScoreTable(kValidationTableSize);
+  simulation.FinishShaders();
+  const TabulatedDensity density{&simulation.ScoreTables()[0], &mixture};
+
+  std::vector<glm::vec2> previous, particles;
+  simulation.ReadParticles(previous);
+  double error = 0.0;
+  for (int step = 1; step <= kValidationSteps; step++) {
+    simulation.Update();
+    simulation.ReadParticles(particles);
+    for (size_t y = 0; y < kValidationHeight; y++) {
+      for (size_t x = 0; x < kValidationWidth; x++) {
+        const size_t i = y * kValidationWidth + x;
+        const glm::vec2 expected = ReferenceStep(
+            density, dt, previous[i], x, y, kValidationWidth, step, 0);
+        error = std::max(error, (double)glm::length(particles[i] - expected) /
+                                    std::sqrt(2.0f * dt));
+      }
+    }
+    previous = particles;
+  }
+
+  json.Check("Simulation::ScoreTable", error, kPositionTolerance);
+  return error <= kPositionTolerance;
+}
+
+// Bins the final positions of ValidateSimulation on the GPU and checks the
+// counts against the CPU bounds, then the colors of the estimated
+// distribution against the counts.
+static bool ValidateEstimatedDistribution(
+    JsonWriter &json, const std::vector<glm::vec2> &particles) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  const Viewport pixelViewport = {{0.0f, 0.0f},
+                                  {(float)kPanelWidth, (float)kPanelHeight}};
+  const int ensembleSize = 2;
+
+  // Upload the particles into a simulation texture of the same layout
+  Simulation simulation(kValidationWidth, kValidationHeight);
+  UploadParticles(ParticleFormat::RG32F, simulation.ParticlesTexture(),
+                  kValidationWidth, kValidationHeight, particles);
+
+  EstimatedDistributionRenderer estimated;
+  estimated.SetMixture(mixture);
+  estimated.SetResolution(kValidationResolution, kValidationResolution);
+
+  // Accumulates with `stride` and returns the largest misbinned fraction of
+  // a member, leaving the histograms in `counts`
+  std::vector<std::vector<float>> counts(ensembleSize);
+  auto accumulate = [&](int stride) {
+    estimated.SetAccumulationStride(stride);
+    estimated.Accumulate(particleViewport, kValidationWidth,
+                         kValidationHeight, simulation.ParticlesTexture(),
+                         ensembleSize);
+    double error = 0.0;
+    for (int m = 0; m < ensembleSize; m++) {
+      int firstRow, numRows;
+      EnsembleRowRange(kValidationHeight, ensembleSize, m, firstRow, numRows);
+      const std::vector<glm::vec2> band(
+          particles.begin() + firstRow * kValidationWidth,
+          particles.begin() + (firstRow + numRows) * kValidationWidth);
+      std::vector<glm::vec2> drawn;
+      ReferenceStridedSubset(band, stride, drawn);
+      std::vector<float> lower, upper;
+      ReferenceHistogramBounds(drawn, particleViewport, kValidationResolution,
+                               kValidationResolution, kRasterSnap, lower,
+                               upper);
+
+      estimated.ReadHistogram(m, counts[m]);
+      double misbinned = 0.0;
+      for (size_t i = 0; i < counts[m].size(); i++) {
+        misbinned += std::max(lower[i] - counts[m][i], 0.0f) +
+                     std::max(counts[m][i] - upper[i], 0.0f);
+      }
+      error = std::max(error, misbinned / (double)drawn.size());
+    }
+    return error;
+  };
+
+  // A strided pass bins exactly the subset accumulator.vert picks; a stride
+  // that does not divide the bands leaves a short last run
+  bool passed = true;
+  const double stridedError = accumulate(3);
+  json.Check("EstimatedDistributionRenderer::AccumulateStrided", stridedError,
+             kHistogramTolerance);
+  passed &= stridedError <= kHistogramTolerance;
+
+  const double histogramError = accumulate(1);
+  json.Check("EstimatedDistributionRenderer::Accumulate", histogramError,
+             kHistogramTolerance);
+  passed &= histogramError <= kHistogramTolerance;
+
+  // Colors are checked against the GPU histogram, so that a misbinned
+  // particle does not also count against the render pass
+  PanelTarget target;
+  std::vector<unsigned char> rgba;
+  double colorError = 0.0;
+  const float area =
+      (particleViewport.Width() / kValidationResolution) *
+      (particleViewport.Height() / kValidationResolution);
+  for (int m = 0; m < ensembleSize; m++) {
+    int firstRow, numRows;
+    EnsembleRowRange(kValidationHeight, ensembleSize, m, firstRow, numRows);
+    const int numParticles = numRows * kValidationWidth;
+
+    target.Bind();
+    estimated.DoRender(particleViewport, pixelViewport, numParticles, m);
+    target.Read(rgba);
+
+    for (int y = 0; y < kPanelHeight; y++) {
+      for (int x = 0; x < kPanelWidth; x++) {
+        const int tx = std::min(
+            int((x + 0.5f) / kPanelWidth * kValidationResolution),
+            kValidationResolution - 1);
+        const int ty = std::min(
+            int((y + 0.5f) / kPanelHeight * kValidationResolution),
+            kValidationResolution - 1);
+        const float count = counts[m][ty * kValidationResolution + tx];
+        const float density = count / (numParticles * area);
+        const glm::vec3 color = ReferenceColormap(
+            std::sqrt(density / std::max(mixture.peak, 1e-8f)));
+        colorError = std::max(
+            colorError, ColorError(&rgba[4 * (y * kPanelWidth + x)], color));
+      }
+    }
+  }
+  json.Check("EstimatedDistributionRenderer::DoRender", colorError,
+             kColorTolerance);
+  passed &= colorError <= kColorTolerance;
+  return passed;
+}
+
+// Checks the analytic panel against the CPU density, and the peak used to
+// normalize it against a brute-force search.
+static bool ValidateDistribution(JsonWriter &json) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  const Viewport pixelViewport = {{0.0f, 0.0f},
+                                  {(float)kPanelWidth, (float)kPanelHeight}};
+
+  float gridPeak = 0.0f;
+  const int gridSize = 1001;
+  for (int j = 0; j < gridSize; j++) {
+    for (int i = 0; i < gridSize; i++) {
+      const glm::vec2 p = particleViewport.pmin +
+                          (particleViewport.pmax - particleViewport.pmin) *
+                              glm::vec2(i, j) / float(gridSize - 1);
+      gridPeak = std::max(gridPeak, mixture.Evaluate(p));
+    }
+  }
+  const double peakError = std::abs(mixture.peak - gridPeak) / gridPeak;
+  json.Check("MixtureOfGaussians::UpdatePeak", peakError, kPeakTolerance);
+
+  PanelTarget target;
+  DistributionRenderer distribution;
+  distribution.SetMixture(mixture);
+  target.Bind();
+  distribution.Render(particleViewport, pixelViewport);
+
+  std::vector<unsigned char> rgba;
+  target.Read(rgba);
+  double colorError = 0.0;
+  for (int y = 0; y < kPanelHeight; y++) {
+    for (int x = 0; x < kPanelWidth; x++) {
+      const glm::vec2 uv((x + 0.5f) / kPanelWidth, (y + 0.5f) / kPanelHeight);
+      const glm::vec2 p = particleViewport.pmin +
+                          (particleViewport.pmax - particleViewport.pmin) * uv;
+      const glm::vec3 color = ReferenceColormap(
+          std::sqrt(mixture.Evaluate(p) / std::max(mixture.peak, 1e-8f)));
+      colorError = std::max(
+          colorError,
+          ColorError(&rgba[4 * (y * kPanelWidth + x)], color));
+    }
+  }
+  json.Check("DistributionRenderer::Render", colorError, kColorTolerance);
+  return peakError <= kPeakTolerance && colorError <= kColorTolerance;
+}
+
+// Steps one member on a target other than the mixture, replaying every
+// particle with the C++ density, and checks the analytic panel against the
+// normalized density. Particles for which ambiguous(p) holds are not
+// compared.
+template <typename Density, typename Ambiguous>
+static bool ValidateTarget(JsonWriter &json, const Target &target,
+                           const Density &density, Ambiguous ambiguous) {
+  EnsembleMember member;
+  member.dt = 0.001f;
+  Simulation simulation(kValidationWidth, kValidationHeight);
+  simulation.SetEnsemble({MakeValidationMixture()}, {member});
+  simulation.SetTarget(target);
+
+  std::vector<glm::vec2> previous, particles;
+  simulation.ReadParticles(previous);
+  double positionError = 0.0;
+  for (int step = 1; step <= kValidationSteps; step++) {
+    simulation.Update();
+    simulation.ReadParticles(particles);
+    for (size_t y = 0; y < kValidationHeight; y++) {
+      for (size_t x = 0; x < kValidationWidth; x++) {
+        const size_t i = y * kValidationWidth + x;
+        if (ambiguous(previous[i]))
+          continue;
+        const glm::vec2 expected =
+            ReferenceStep(density, member.dt, previous[i], x, y,
+                          kValidationWidth, step, member.seed);
+        positionError =
+            std::max(positionError,
+                     (double)glm::length(particles[i] - expected) /
+                         std::sqrt(2.0f * member.dt));
+      }
+    }
+    previous = particles;
+  }
+
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  const Viewport pixelViewport = {{0.0f, 0.0f},
+                                  {(float)kPanelWidth, (float)kPanelHeight}};
+  PanelTarget panel;
+  DistributionRenderer distribution;
+  distribution.SetTarget(target);
+  panel.Bind();
+  distribution.Render(particleViewport, pixelViewport);
+
+  std::vector<unsigned char> rgba;
+  panel.Read(rgba);
+  double colorError = 0.0;
+  for (int y = 0; y < kPanelHeight; y++) {
+    for (int x = 0; x < kPanelWidth; x++) {
+      const glm::vec2 uv((x + 0.5f) / kPanelWidth, (y + 0.5f) / kPanelHeight);
+      const glm::vec2 p = particleViewport.pmin +
+                          (particleViewport.pmax - particleViewport.pmin) * uv;
+      const float prob =
+          std::exp(density.LogDensity(p) - target.logNormalizer);
+      const glm::vec3 color = ReferenceColormap(std::sqrt(prob / target.peak));
+      colorError = std::max(
+          colorError, ColorError(&rgba[4 * (y * kPanelWidth + x)], color));
+    }
+  }
+
+  const std::string name = TargetName(target.kind);
+  json.Check(("Simulation::" + name).c_str(), positionError,
+             kPositionTolerance);
+  json.Check(("DistributionRenderer::" + name).c_str(), colorError,
+             kColorTolerance);
+  return positionError <= kPositionTolerance && colorError <= kColorTolerance;
+}
+
+static bool ValidateTargets(JsonWriter &json) {
+  const Target rosenbrock = RosenbrockTarget();
+  const Target doubleWell = DoubleWellTarget();
+  // Coarse enough that interpolation errors would show
+  const Target grid = TabulateMixture(MakeValidationMixture(), 33, 17,
+                                      glm::vec2(-1.5f), glm::vec2(1.5f));
+  auto none = [](glm::vec2) { return false; };
+  // The gradient jumps between grid cells, and GLSL division may be a few
+  // ULPs off, so near cell edges the shader may pick either cell
+  auto nearCellEdge = [&](glm::vec2 p) {
+    const glm::vec2 u = (p - glm::vec2(grid.params.x, grid.params.y)) /
+                        glm::vec2(grid.params.z - grid.params.x,
+                                  grid.params.w - grid.params.y) *
+                        glm::vec2(grid.gridWidth - 1, grid.gridHeight - 1);
+    const glm::vec2 d = glm::abs(u - glm::floor(u + 0.5f));
+    return d.x < kCellSnap || d.y < kCellSnap;
+  };
+
+  bool passed =
+      ValidateTarget(json, rosenbrock, RosenbrockDensity(rosenbrock), none);
+  passed &=
+      ValidateTarget(json, doubleWell, DoubleWellDensity(doubleWell), none);
+  passed &= ValidateTarget(json, grid, GridDensity{&grid}, nearCellEdge);
+  return passed;
+}
+
+// Renders both panels of ValidateEstimatedDistribution into one image, in
+// tiles and in one piece, and checks that the tiles join without seams.
+static bool ValidateOffscreen(JsonWriter &json,
+                              const std::vector<glm::vec2> &particles) {
+  const MixtureOfGaussians mixture = MakeValidationMixture();
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  const int width = 2 * kPanelWidth;
+  const int height = kPanelHeight;
+  const glm::vec2 panelSize(kPanelWidth, kPanelHeight);
+
+  Simulation simulation(kValidationWidth, kValidationHeight);
+  UploadParticles(ParticleFormat::RG32F, simulation.ParticlesTexture(),
+                  kValidationWidth, kValidationHeight, particles);
+  EstimatedDistributionRenderer estimated;
+  estimated.SetMixture(mixture);
+  estimated.SetResolution(kValidationResolution, kValidationResolution);
+  DistributionRenderer distribution;
+  distribution.SetMixture(mixture);
+
+  // Estimated density on the left, analytic on the right
+  auto draw = [&](Viewport tile) {
+    for (int panel = 0; panel < 2; panel++) {
+      const glm::vec2 origin(panel * kPanelWidth, 0.0f);
+      const glm::vec2 pmin = glm::max(tile.pmin, origin);
+      const glm::vec2 pmax = glm::min(tile.pmax, origin + panelSize);
+      if (pmin.x >= pmax.x || pmin.y >= pmax.y)
+        continue;
+      const glm::vec2 scale =
+          (particleViewport.pmax - particleViewport.pmin) / panelSize;
+      const Viewport region = {
+          particleViewport.pmin + (pmin - origin) * scale,
+          particleViewport.pmin + (pmax - origin) * scale};
+      const Viewport pixels = {pmin - tile.pmin, pmax - tile.pmin};
+      if (panel == 0) {
+        estimated.Render(particleViewport, pixels, kValidationWidth,
+                         kValidationHeight, simulation.ParticlesTexture(), 1,
+                         0, nullptr, &region);
+      } else {
+        distribution.Render(region, pixels);
+      }
+    }
+  };
+
+  std::vector<uint8_t> whole, tiled;
+  RenderOffscreen(width, height, draw, whole);
+  RenderOffscreen(width, height, draw, tiled, kValidationTileSize);
+
+  double colorError = 0.0;
+  for (size_t i = 0; i < whole.size(); i++) {
+    colorError =
+        std::max(colorError, std::abs(whole[i] - tiled[i]) / 255.0);
+  }
+  json.Check("RenderOffscreen::Tiles", colorError, kColorTolerance);
+  return colorError <= kColorTolerance;
+}
+
+#ifdef LANGEVIN_DISTRIBUTED
+// Workers must take this long at most for kValidationSteps steps
+static constexpr double kWorkerTimeoutSeconds = 60.0;
+
+// Two workers run kValidationSteps steps; their merged histogram must match
+// that of two local simulations seeded the same way.
+static bool ValidateDistributed(JsonWriter &json, const char *executable) {
+  const int workers = 2;
+  WorkerConfig config;
+  config.particlesWidth = kValidationWidth;
+  config.particlesHeight = kValidationHeight;
+  config.mixture = MakeValidationMixture();
+  config.maxSteps = kValidationSteps;
+  // A target other than the mixture, binning a member other than the first
+  const Target target = DoubleWellTarget();
+  config.ensembleSize = 2;
+  config.dtSpread = 2.0f;
+  config.member = 1;
+
+  DistributedFrame frame;
+  bool finished = false;
+  {
+    Coordinator coordinator(executable, workers, config, target);
+    const auto start = std::chrono::steady_clock::now();
+    while (std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+               .count() < kWorkerTimeoutSeconds &&
+           coordinator.Connected() == workers) {
+      if (coordinator.Merge(frame) && frame.workers == workers &&
+          frame.step >= config.maxSteps) {
+        finished = true;
+        break;
+      }
+      SDL_Delay(1);
+    }
+  }
+  if (!finished)
+    throw std::runtime_error("Workers did not finish");
+
+  // The workers step and bin on the GPU like this process; GPU and CPU
+  // rounding drift apart over the steps, so compare with the same passes here
+  int firstRow, numRows;
+  EnsembleRowRange(kValidationHeight, config.ensembleSize, config.member,
+                   firstRow, numRows);
+  const size_t first = static_cast<size_t>(firstRow) * kValidationWidth;
+  const size_t count = static_cast<size_t>(numRows) * kValidationWidth;
+  std::vector<float> expected(frame.counts.size(), 0.0f), counts;
+  std::vector<glm::vec2> particles;
+  const MemberRanges ranges = {
+      {{static_cast<int>(first), static_cast<int>(count)}}};
+  for (int w = 0; w < workers; w++) {
+    Simulation simulation(kValidationWidth, kValidationHeight,
+                          PreferredParticleFormat());
+    std::vector<EnsembleMember> members(config.ensembleSize);
+    for (uint32_t k = 0; k < config.ensembleSize; k++) {
+      members[k].dt = config.dt * std::pow(config.dtSpread, (float)k);
+      members[k].seed = WorkerSeed(config.seed, w) + k;
+    }
+    simulation.SetEnsemble({config.mixture}, members);
+    simulation.SetTarget(target);
+    for (int step = 0; step < kValidationSteps; step++)
+      simulation.Update();
+    EstimatedDistributionRenderer estimated;
+    if (estimated.GpuAccumulation()) {
+      estimated.SetParticleFormat(simulation.Format());
+      estimated.SetResolution(kWorkerHistogramSize, kWorkerHistogramSize);
+      estimated.Accumulate(config.viewport, kValidationWidth,
+                           kValidationHeight, simulation.ParticlesTexture(), 1,
+                           &ranges);
+      estimated.ReadHistogram(0, counts);
+    } else {
+      simulation.ReadParticles(firstRow, numRows, particles);
+      ReferenceHistogram(particles.data(), count, config.viewport,
+                         kWorkerHistogramSize, kWorkerHistogramSize, counts);
+    }
+    for (size_t i = 0; i < counts.size(); i++)
+      expected[i] += counts[i];
+  }
+
+  double misbinned = 0.0;
+  for (size_t i = 0; i < expected.size(); i++)
+    misbinned += std::abs(frame.counts[i] - expected[i]);
+  misbinned /= 2.0 * count * workers;
+  json.Check("Coordinator::Merge", misbinned, kHistogramTolerance);
+  return misbinned <= kHistogramTolerance;
+}
+#endif
+
+static bool Validate(JsonWriter &json, const Options &options) {
+  std::vector<glm::vec2> particles;
+  bool passed = ValidateSimulation(json, particles);
+  passed &= ValidateSpecialization(json);
+  passed &= ValidateModes(json);
+  passed &= ValidateScoreTable(json);
+  passed &= ValidateEstimatedDistribution(json, particles);
+  passed &= ValidateOffscreen(json, particles);
+  passed &= ValidateDistribution(json);
+  passed &= ValidateTargets(json);
+#ifdef LANGEVIN_DISTRIBUTED
+  passed &= ValidateDistributed(json, options.executable);
+#endif
+  return passed;
+}
+
+// A hidden window's GL 3.3 core context, made current. Prints why when it
+// returns false.
+static bool CreateContext(SDL_Window *&window, SDL_GLContext &gl_context) {
+  gl_context = nullptr;
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 0);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+
+  window =
+      SDL_CreateWindow("langevin_bench", SDL_WINDOWPOS_CENTERED,
+                       SDL_WINDOWPOS_CENTERED, 64, 64,
+                       SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+  if (window == nullptr) {
+    fprintf(stderr, "Error: SDL_CreateWindow(): %s\n", SDL_GetError());
+    return false;
+  }
+
+  gl_context = SDL_GL_CreateContext(window);
+  if (gl_context == nullptr) {
+    fprintf(stderr, "Error: SDL_GL_CreateContext(): %s\n", SDL_GetError());
+    return false;
+  }
+  SDL_GL_MakeCurrent(window, gl_context);
+
+  // GLEW reports a missing GLX display on EGL contexts after it has already
+  // loaded every GL entry point.
+  glewExperimental = GL_TRUE;
+  GLenum err = glewInit();
+  if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY) {
+    fprintf(stderr, "Error: %s\n", glewGetErrorString(err));
+    return false;
+  }
+  return true;
+}
+
+#ifdef LANGEVIN_DISTRIBUTED
+// --worker FD: steps on the GPU like the app's workers, or on the CPU
+// without a context.
+static int RunBenchWorker(int fd) {
+  SDL_Window *window = nullptr;
+  SDL_GLContext gl_context = nullptr;
+  const bool gpu =
+      SDL_Init(SDL_INIT_VIDEO) == 0 && CreateContext(window, gl_context);
+  const int result = RunWorker(fd, gpu);
+  if (gl_context != nullptr)
+    SDL_GL_DeleteContext(gl_context);
+  if (window != nullptr)
+    SDL_DestroyWindow(window);
+  SDL_Quit();
+  return result;
+}
+#endif
+
+static int RunGpu(const Options &options, FILE *out) {
+  if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+    fprintf(stderr, "Error: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  SDL_Window *window = nullptr;
+  SDL_GLContext gl_context = nullptr;
+  bool passed = false;
+  if (CreateContext(window, gl_context)) {
+    JsonWriter json(out);
+    json.Begin((const char *)glGetString(GL_RENDERER),
+               (const char *)glGetString(GL_VERSION));
+
+    try {
+      if (options.validate) {
+        passed = Validate(json, options);
+      } else {
+        const size_t numSizes = options.quick ? 2 : std::size(kParticleSizes);
+        for (size_t i = 0; i < numSizes; i++) {
+          for (int f = 0; f < kNumParticleFormats; f++) {
+            const ParticleFormat format = static_cast<ParticleFormat>(f);
+            if (IsParticleFormatSupported(format))
+              BenchmarkSimulation(options, json, kParticleSizes[i], format);
+          }
+        }
+
+        BenchmarkDistribution(options, json);
+        BenchmarkAccuracy(json);
+        passed = true;
+      }
+    } catch (const std::exception &e) {
+      // The results so far are still written out
+      fprintf(stderr, "Error: %s\n", e.what());
+      passed = false;
+    }
+
+    json.End();
+  }
+
+  if (gl_context != nullptr)
+    SDL_GL_DeleteContext(gl_context);
+  if (window != nullptr)
+    SDL_DestroyWindow(window);
+  SDL_Quit();
+  return passed ? 0 : 1;
+}
+
+#endif // EMSCRIPTEN
+
+static void BenchmarkCpu(const Options &options, JsonWriter &json,
+                         ParticleSize size) {
+  CpuSimulation simulation(size.width, size.height, options.threads);
+  simulation.SetDt(0.0004f);
+
+  for (int components : kComponentCounts) {
+    simulation.SetMixture(MakeMixture(components));
+    simulation.ResetParticles();
+    const double ms = TimePass(options, [&] { simulation.Update(); });
+    json.Record("CpuSimulation::Update", size, "RG32F", components, 0, ms);
+  }
+
+  const Viewport particleViewport = {{-1.0f, -1.0f}, {1.0f, 1.0f}};
+  std::vector<float> counts;
+  for (int resolution : kResolutions) {
+    const double ms = TimePass(options, [&] {
+      simulation.Histogram(particleViewport, resolution, resolution, 0,
+                           counts);
+    });
+    json.Record("CpuSimulation::Histogram", size, "RG32F", 4, resolution, ms);
+  }
+}
+
+// Times Update with 1, 2, 4, ... threads up to the configured count, on a
+// mixture whose components differ per ensemble member so that rows cost
+// unequal amounts and work stealing has something to even out.
+static void BenchmarkScaling(const Options &options, JsonWriter &json,
+                             ParticleSize size, int maxThreads) {
+  std::vector<MixtureOfGaussians> mixtures;
+  std::vector<EnsembleMember> members;
+  for (int components : kComponentCounts) {
+    EnsembleMember member;
+    member.mixture = static_cast<int>(mixtures.size());
+    member.dt = 0.0004f;
+    member.seed = static_cast<uint32_t>(members.size());
+    mixtures.push_back(MakeMixture(components));
+    members.push_back(member);
+  }
+
+  double msOneThread = 0.0;
+  for (int threads = 1;; threads = std::min(2 * threads, maxThreads)) {
+    CpuSimulation simulation(size.width, size.height, threads - 1);
+    simulation.SetEnsemble(mixtures, members);
+    const double ms = TimePass(options, [&] { simulation.Update(); });
+    if (threads == 1)
+      msOneThread = ms;
+    json.Scaling("CpuSimulation::Update", size, threads,
+                 simulation.Nodes(), ms, msOneThread);
+    if (threads == maxThreads)
+      break;
+  }
+}
+
+static int RunCpu(const Options &options, FILE *out) {
+  JsonWriter json(out);
+  int threads, nodes;
+  {
+    // Only used to report the thread count
+    CpuSimulation probe(2, 2, options.threads);
+    threads = probe.Threads();
+    nodes = probe.Nodes();
+    char renderer[64];
+    snprintf(renderer, sizeof(renderer), "CPU, threads=%d, nodes=%d", threads,
+             nodes);
+#ifdef EMSCRIPTEN
+    json.Begin(renderer, "wasm");
+#else
+    json.Begin(renderer, "native");
+#endif
+  }
+
+  const size_t numSizes = options.quick ? 2 : std::size(kParticleSizes);
+  for (size_t i = 0; i < numSizes; i++)
+    BenchmarkCpu(options, json, kParticleSizes[i]);
+  BenchmarkScaling(options, json, kParticleSizes[numSizes - 1], threads);
+
+  json.End();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+#ifdef LANGEVIN_DISTRIBUTED
+  // A crashed worker or coordinator must fail the write, not kill the bench
+  signal(SIGPIPE, SIG_IGN);
+  if (argc == 3 && !strcmp(argv[1], "--worker"))
+    return RunBenchWorker(atoi(argv[2]));
+#endif
+  Options options;
+  options.executable = argv[0];
+  if (!ParseOptions(argc, argv, options)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  FILE *out = stdout;
+  if (options.output != nullptr) {
+    out = fopen(options.output, "w");
+    if (out == nullptr) {
+      fprintf(stderr, "Error: cannot open %s\n", options.output);
+      return 1;
+    }
+  }
+
+  int status;
+  if (options.backend == Backend::Cpu) {
+    status = RunCpu(options, out);
+  } else {
+#ifdef EMSCRIPTEN
+    fprintf(stderr, "Error: the wasm build only has the CPU backend\n");
+    status = 1;
+#else
+    status = RunGpu(options, out);
+#endif
+  }
+
+  if (out != stdout)
+    fclose(out);
+  return status;
+}
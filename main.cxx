@@ -2,16 +2,43 @@
 #include <GL/glew.h>
 #endif
 #include <SDL.h>
+#include <algorithm>
+#include <cmath>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "capabilities.h"
+#include "cpu_simulation.h"
+#ifdef LANGEVIN_DISTRIBUTED
+#include "distributed.h"
+#endif
 #include "distribution_renderer.h"
 #include "estimated_distribution_renderer.h"
+#include "file_watcher.h"
+#include "frame_governor.h"
 #include "imgui.h"
 #include "imgui_impl_opengl3.h"
 #include "imgui_impl_sdl2.h"
+#include "image_writer.h"
 #include "mixture.h"
+#include "offscreen.h"
 #include "particle_renderer.h"
+#ifndef EMSCRIPTEN
+#include "recorder.h"
+#endif
+#include "scenario.h"
 #include "simulation.h"
+#include "simulation_thread.h"
+#include "target.h"
 
 #ifdef EMSCRIPTEN
 extern "C" {
@@ -19,42 +46,733 @@ void emscripten_set_main_loop_arg(void (*)(void *), void *, int, int);
 }
 #endif
 
+// What the left panel shows; the right one always shows the target density.
+enum class ViewMode { Estimated, Particles };
+// Panels of an exported image or recording; a single one fills it.
+enum class PanelSet { Both, Left, Right };
+
+// What the frame governor trades for frame time, cheapest first. Medium is
+// what the app ran before it had a governor.
+struct QualityLevel {
+  const char *name;
+  // GPU simulation substeps per frame, each advancing dt / stepsPerFrame
+  int stepsPerFrame;
+  // Histogram bins per side
+  int resolution;
+  // One in this many particles is accumulated
+  int accumulationStride;
+};
+static constexpr QualityLevel kQualityLevels[] = {
+    {"Minimum", 1, 100, 4},
+    {"Low", 1, 150, 2},
+    {"Medium", 1, 200, 1},
+    {"High", 2, 300, 1},
+    {"Ultra", 4, 400, 1},
+};
+static constexpr int kNumQualityLevels =
+    static_cast<int>(std::size(kQualityLevels));
+static constexpr int kDefaultQualityLevel = 2;
+
 struct AppState {
   SDL_Window *window = nullptr;
   SDL_GLContext gl_context = nullptr;
-  Simulation simulation;
+  // Exactly one of the two exists, see CreateSimulation
+  std::unique_ptr<Simulation> simulation;
+  std::unique_ptr<SimulationThread> cpuSimulation;
+  bool forceCpu;
   ParticleRenderer particleRenderer;
   DistributionRenderer distributionRenderer;
-  EstimatedDistributionRenderer estimatedDistributionRenderer;
+  std::unique_ptr<EstimatedDistributionRenderer> estimatedDistributionRenderer;
   MixtureOfGaussians mog;
+  // Grid targets picked in the UI tabulate `mog`
+  Target target;
   float dt;
   glm::vec2 viewCenter;
   float viewScale;
   bool running;
+  bool paused;
+  bool stepOnce;
+  int idleFrames;
+  // Holds the frame rate by picking from kQualityLevels
+  FrameGovernor governor{kNumQualityLevels, kDefaultQualityLevel};
+  int stepsPerFrame;
+  // Start of the last frame that did not wait for events, 0 if it waited
+  Uint64 frameStart;
+  int ensembleSize;
+  float dtSpread;
+  uint32_t seed;
+  int shownMember;
+  int particleFormat;
+  ViewMode viewMode;
+  bool velocityColoring;
+  float spriteSize;
+  // Frames between sorts, 0 disables
+  int sortInterval;
+  // Frames between mode statistics, 0 when not tracking modes
+  int modeInterval;
+  // Largest score table side, 0 for exact scores
+  int scoreTableSize;
+  MemberRanges visibleRanges;
+  bool culled;
+  bool hasStorageReport;
+  ParticleStorageReport storageReport;
+  // Given with --scenario and reloaded when the file changes. `scenario` is
+  // the last version applied, so reloads only touch fields the file changed.
+  std::string scenarioPath;
+  Scenario scenario;
+  std::unique_ptr<FileWatcher> scenarioWatcher;
+  std::string scenarioStatus;
+#ifndef EMSCRIPTEN
+  // Exported images and recordings
+  PanelSet outputPanels;
+  char exportPath[256];
+  int exportSize[2];
+  std::string exportStatus;
+  // Applied when recording starts
+  RecorderOptions recordOptions;
+  char recordPath[256];
+  std::unique_ptr<Recorder> recorder;
+  std::string recordStatus;
+#endif
+#ifdef LANGEVIN_DISTRIBUTED
+  // With --workers the left panel shows the workers' merged histograms
+  // instead of the local simulation, which stops stepping
+  std::unique_ptr<Coordinator> coordinator;
+  DistributedFrame distributed;
+  bool hasDistributed = false;
+  uint32_t workerResets = 0;
+#endif
 };
 
-static void InitDefaultState(AppState &s) {
-  s.mog.count = 4;
-  s.mog.g[0] = Gaussian{glm::vec2(-0.5f, -0.5f), glm::vec2(0.1f, 0.1f)};
-  s.mog.g[1] = Gaussian{glm::vec2(0.5f, 0.5f), glm::vec2(0.1f, 0.1f)};
-  s.mog.g[2] = Gaussian{glm::vec2(-0.5f, 0.5f), glm::vec2(0.1f, 0.1f)};
-  s.mog.g[3] = Gaussian{glm::vec2(0.5f, -0.5f), glm::vec2(0.1f, 0.1f)};
-  s.mog.UpdatePeak();
-  s.simulation.SetMixture(s.mog);
+// Member k runs with dt * dtSpread^k, all on the same mixture, split into
+// `substeps` steps.
+template <typename Sim>
+static void ApplyEnsemble(const AppState &s, Sim &simulation,
+                          int substeps = 1) {
+  std::vector<EnsembleMember> members(s.ensembleSize);
+  float dt = s.dt / static_cast<float>(substeps);
+  for (int k = 0; k < s.ensembleSize; ++k) {
+    members[k].mixture = 0;
+    members[k].dt = dt;
+    members[k].seed = s.seed + static_cast<uint32_t>(k);
+    dt *= s.dtSpread;
+  }
+  simulation.SetEnsemble({s.mog}, members);
+}
+
+// Only the GPU simulation takes substeps, see QualityLevel
+static void ApplyEnsemble(AppState &s) {
+  if (s.simulation)
+    ApplyEnsemble(s, *s.simulation, s.stepsPerFrame);
+  else
+    ApplyEnsemble(s, *s.cpuSimulation);
+}
+
+static void ApplyMixture(AppState &s) {
   s.distributionRenderer.SetMixture(s.mog);
-  s.estimatedDistributionRenderer.SetMixture(s.mog);
-  s.dt = 0.00004f;
-  s.viewCenter = glm::vec2(0.0f, 0.0f);
-  s.viewScale = 1.0f;
+  s.estimatedDistributionRenderer->SetPeak(TargetPeak(s.target, s.mog));
+}
+
+static void ApplyTarget(AppState &s) {
+  if (s.simulation)
+    s.simulation->SetTarget(s.target);
+  else
+    s.cpuSimulation->SetTarget(s.target);
+  s.distributionRenderer.SetTarget(s.target);
+  s.estimatedDistributionRenderer->SetPeak(TargetPeak(s.target, s.mog));
+  s.estimatedDistributionRenderer->Invalidate();
+}
+
+// Box and resolution of the Grid target tabulating the mixture
+static constexpr int kGridTargetSize = 128;
+static constexpr float kGridTargetBound = 2.0f;
+
+static Target TabulateMixture(const MixtureOfGaussians &mixture) {
+  return TabulateMixture(mixture, kGridTargetSize, kGridTargetSize,
+                         glm::vec2(-kGridTargetBound),
+                         glm::vec2(kGridTargetBound));
+}
+
+// The simulation counts its sort and mode intervals in steps; the UI sets
+// them in frames, so that substeps do not make the readbacks more frequent.
+static void ApplyIntervals(AppState &s) {
+  s.simulation->SetSortInterval(std::max(0, s.sortInterval) *
+                                s.stepsPerFrame);
+  s.simulation->SetModeTracking(std::max(0, s.modeInterval) *
+                                s.stepsPerFrame);
+}
+
+// Applies the governor's quality level; new substeps rescale the members'
+// dt and the intervals. Workers bin at a fixed resolution.
+static void ApplyQuality(AppState &s) {
+  const QualityLevel &quality = kQualityLevels[s.governor.Level()];
+  const bool substepsChanged = quality.stepsPerFrame != s.stepsPerFrame;
+  s.stepsPerFrame = quality.stepsPerFrame;
+  if (substepsChanged && s.simulation) {
+    ApplyEnsemble(s);
+    ApplyIntervals(s);
+  }
+  s.estimatedDistributionRenderer->SetAccumulationStride(
+      quality.accumulationStride);
+#ifdef LANGEVIN_DISTRIBUTED
+  if (s.coordinator)
+    return;
+#endif
+  s.estimatedDistributionRenderer->SetResolution(quality.resolution,
+                                                 quality.resolution);
+}
+
+// Stores particles in the most precise renderable format, see
+// PreferredParticleFormat, and falls back to CpuSimulation when the GPU path
+// still cannot be created or forceCpu is set. A zero size picks the
+// backend's default.
+static void CreateSimulation(AppState &s, size_t width, size_t height) {
+  s.simulation.reset();
+  s.cpuSimulation.reset();
+  try {
+    if (s.forceCpu)
+      throw std::runtime_error("--cpu");
+    const ParticleFormat format = PreferredParticleFormat();
+    s.simulation = width > 0 ? std::make_unique<Simulation>(width, height,
+                                                            format)
+                             : std::make_unique<Simulation>(1920, 1080, format);
+    s.particleRenderer.SetParticleFormat(format);
+    s.estimatedDistributionRenderer =
+        std::make_unique<EstimatedDistributionRenderer>();
+    s.estimatedDistributionRenderer->SetParticleFormat(format);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "GPU simulation unavailable (%s), using the CPU\n",
+            e.what());
+    s.simulation.reset();
+    s.cpuSimulation = std::make_unique<SimulationThread>(
+        width > 0 ? std::make_unique<CpuSimulation>(width, height)
+                  : std::make_unique<CpuSimulation>());
+    s.estimatedDistributionRenderer =
+        std::make_unique<EstimatedDistributionRenderer>(false);
+  }
+}
+
+static constexpr int kStorageReportSteps = 100;
+// Sorting stalls on a readback, while culling degrades as particles diffuse
+// away from their sorted cells; about once a second balances the two.
+static constexpr int kDefaultSortInterval = 60;
+
+// Runs the current ensemble from the initial state in both the selected
+// format and RG32F and compares the resulting particles.
+static void RunStorageReport(AppState &s) {
+  Simulation reference(s.simulation->Width(), s.simulation->Height());
+  ApplyEnsemble(s, reference, s.stepsPerFrame);
+  reference.SetTarget(s.target);
+  reference.SetScoreTable(s.scoreTableSize);
+
+  // Particles are compared one by one, so they must not be reordered
+  s.simulation->SetSortInterval(0);
+  s.simulation->ResetParticles();
+  for (int i = 0; i < kStorageReportSteps; ++i) {
+    reference.Update();
+    s.simulation->Update();
+  }
+  ApplyIntervals(s);
+
+  std::vector<glm::vec2> expected, actual;
+  reference.ReadParticles(expected);
+  s.simulation->ReadParticles(actual);
+  s.storageReport = CompareParticleStorage(expected, actual);
+  s.hasStorageReport = true;
+  s.estimatedDistributionRenderer->Invalidate();
+}
+
+// Applies the fields of `next` that differ from `previous`, or all of them
+// without one. Changing the particle count recreates the simulation.
+static void ApplyScenario(AppState &s, const Scenario &next,
+                          const Scenario *previous) {
+  const bool resize = !previous ||
+                      next.particlesWidth != previous->particlesWidth ||
+                      next.particlesHeight != previous->particlesHeight;
+  const bool mixtureChanged =
+      resize || !SameMixture(next.mixture, previous->mixture);
+  const bool targetChanged =
+      resize || !SameTarget(next.target, previous->target);
+  const bool ensembleChanged =
+      mixtureChanged || next.dt != previous->dt ||
+      next.ensembleSize != previous->ensembleSize ||
+      next.dtSpread != previous->dtSpread || next.seed != previous->seed;
+
+  if (resize) {
+    CreateSimulation(s, next.particlesWidth, next.particlesHeight);
+    s.particleFormat = static_cast<int>(
+        s.simulation ? s.simulation->Format() : ParticleFormat::RG32F);
+    s.hasStorageReport = false;
+    s.culled = false;
+    ApplyQuality(s);
+    if (s.simulation) {
+      ApplyIntervals(s);
+      s.simulation->SetScoreTable(s.scoreTableSize);
+    }
+  }
+  if (mixtureChanged) {
+    s.mog = next.mixture;
+    ApplyMixture(s);
+  }
+  if (targetChanged) {
+    s.target = next.target;
+    ApplyTarget(s);
+  }
+  if (ensembleChanged) {
+    s.dt = next.dt;
+    s.ensembleSize = next.ensembleSize;
+    s.dtSpread = next.dtSpread;
+    s.seed = next.seed;
+    s.shownMember = std::min(s.shownMember, s.ensembleSize - 1);
+    ApplyEnsemble(s);
+    s.estimatedDistributionRenderer->Invalidate();
+  }
+  if (!previous || next.viewCenter != previous->viewCenter ||
+      next.viewScale != previous->viewScale) {
+    s.viewCenter = next.viewCenter;
+    s.viewScale = next.viewScale;
+  }
+}
+
+static void ReloadScenario(AppState &s) {
+  try {
+    const Scenario next = LoadScenario(s.scenarioPath);
+    ApplyScenario(s, next, &s.scenario);
+    s.scenario = next;
+    s.scenarioStatus = "Reloaded";
+  } catch (const std::exception &e) {
+    // Keep running the last good version
+    fprintf(stderr, "Error: %s\n", e.what());
+    s.scenarioStatus = e.what();
+  }
+}
+
+#ifndef EMSCRIPTEN
+// 8K UHD
+static constexpr int kDefaultExportWidth = 7680;
+static constexpr int kDefaultExportHeight = 4320;
+static constexpr int kDefaultExportSteps = 1000;
+#endif
+
+static void InitDefaultState(AppState &s, bool forceCpu,
+                             const std::string &scenarioPath,
+                             const Scenario &scenario) {
+  s.forceCpu = forceCpu;
+  // Vsync holds frames to the display's rate, so aim for it
+  SDL_DisplayMode mode;
+  const int display = SDL_GetWindowDisplayIndex(s.window);
+  const bool known = display >= 0 &&
+                     SDL_GetCurrentDisplayMode(display, &mode) == 0 &&
+                     mode.refresh_rate > 0;
+  s.governor.SetTargetFps(known ? mode.refresh_rate : 60);
+  s.shownMember = 0;
+  s.hasStorageReport = false;
+  s.viewMode = ViewMode::Estimated;
+  s.velocityColoring = false;
+  s.spriteSize = 1.0f;
+  s.sortInterval = kDefaultSortInterval;
+  s.modeInterval = 0;
+  s.scoreTableSize = 0;
+  s.culled = false;
+  // Set before the ensemble so that the first ApplyQuality keeps it
+  s.stepsPerFrame = kQualityLevels[s.governor.Level()].stepsPerFrame;
+  ApplyScenario(s, scenario, nullptr);
+  s.scenario = scenario;
+  if (!scenarioPath.empty()) {
+    s.scenarioPath = scenarioPath;
+    s.scenarioWatcher = std::make_unique<FileWatcher>(scenarioPath);
+    s.scenarioStatus = "Loaded";
+  }
+#ifndef EMSCRIPTEN
+  s.outputPanels = PanelSet::Both;
+  std::snprintf(s.exportPath, sizeof(s.exportPath), "langevin.png");
+  s.exportSize[0] = kDefaultExportWidth;
+  s.exportSize[1] = kDefaultExportHeight;
+  std::snprintf(s.recordPath, sizeof(s.recordPath), "frames");
+#endif
   s.running = true;
+  s.paused = false;
+  s.stepOnce = false;
+  s.idleFrames = 0;
+  s.frameStart = 0;
+}
+
+// The part of a panel over the image pixels `panel`, showing
+// `particleViewport`, that falls in `tile`: the particles it shows and where
+// it goes in a framebuffer holding the tile. False if it misses the tile.
+static bool ClipPanel(Viewport particleViewport, Viewport panel, Viewport tile,
+                      Viewport &region, Viewport &pixels) {
+  const glm::vec2 pmin = glm::max(panel.pmin, tile.pmin);
+  const glm::vec2 pmax = glm::min(panel.pmax, tile.pmax);
+  if (pmin.x >= pmax.x || pmin.y >= pmax.y)
+    return false;
+  pixels = {pmin - tile.pmin, pmax - tile.pmin};
+  region = particleViewport;
+  if (pmin != panel.pmin || pmax != panel.pmax) {
+    const glm::vec2 scale =
+        glm::vec2(particleViewport.Width(), particleViewport.Height()) /
+        glm::vec2(panel.Width(), panel.Height());
+    region.pmin = particleViewport.pmin + (pmin - panel.pmin) * scale;
+    region.pmax = particleViewport.pmin + (pmax - panel.pmin) * scale;
+  }
+  return true;
+}
+
+// What a panel over the image pixels `panel` shows.
+static Viewport PanelViewport(const AppState &s, Viewport panel) {
+  return EnforceAspectRatio({s.viewCenter - glm::vec2(s.viewScale),
+                             s.viewCenter + glm::vec2(s.viewScale)},
+                            panel);
+}
+
+// Left panel over the image pixels `panel`, drawn as far as it falls in
+// `tile`, see RenderOffscreen. The histogram covers the whole panel, so
+// every tile draws from the same one.
+static void RenderLeftPanel(AppState &s, Viewport panel, Viewport tile) {
+  const Viewport particleViewport = PanelViewport(s, panel);
+  Viewport region, pixels;
+  if (!ClipPanel(particleViewport, panel, tile, region, pixels))
+    return;
+
+#ifdef LANGEVIN_DISTRIBUTED
+  if (s.coordinator) {
+    // Drawn where it was binned, which may lag the view by a step
+    if (s.hasDistributed) {
+      const int particles = static_cast<int>(std::min<uint64_t>(
+          s.distributed.particles, std::numeric_limits<int>::max()));
+      s.estimatedDistributionRenderer->DoRender(
+          s.distributed.viewport, pixels, particles, 0, &region);
+    }
+    return;
+  }
+#endif
+
+  s.culled = s.simulation &&
+             s.simulation->VisibleRanges(particleViewport, s.visibleRanges);
+
+  if (s.viewMode == ViewMode::Particles) {
+    // Steps are dominated by diffusion, of length sqrt(2 dt)
+    const float memberDt = s.dt * std::pow(s.dtSpread, (float)s.shownMember);
+    s.particleRenderer.SetVelocityColoring(s.velocityColoring,
+                                           std::sqrt(2.0f * memberDt));
+    s.particleRenderer.SetSpriteSize(s.spriteSize);
+    if (s.simulation) {
+      s.particleRenderer.Render(
+          region, pixels, s.simulation->Width(), s.simulation->Height(),
+          s.simulation->ParticlesTexture(),
+          s.simulation->PreviousParticlesTexture(),
+          s.simulation->EnsembleSize(), s.shownMember,
+          s.culled ? &s.visibleRanges[s.shownMember] : nullptr);
+    } else {
+      s.particleRenderer.Render(region, pixels, s.cpuSimulation->Frame(),
+                                s.shownMember);
+    }
+    return;
+  }
+
+  const Viewport *part = region != particleViewport ? &region : nullptr;
+  if (s.simulation) {
+    s.estimatedDistributionRenderer->Render(
+        particleViewport, pixels, s.simulation->Width(),
+        s.simulation->Height(), s.simulation->ParticlesTexture(),
+        s.simulation->EnsembleSize(), s.shownMember,
+        s.culled ? &s.visibleRanges : nullptr, part);
+  } else {
+    s.estimatedDistributionRenderer->Render(particleViewport, pixels,
+                                            s.cpuSimulation->Frame(),
+                                            s.shownMember, part);
+  }
+}
+
+// Right panel, see RenderLeftPanel.
+static void RenderRightPanel(AppState &s, Viewport panel, Viewport tile) {
+  const Viewport particleViewport = PanelViewport(s, panel);
+  Viewport region, pixels;
+  if (ClipPanel(particleViewport, panel, tile, region, pixels))
+    s.distributionRenderer.Render(region, pixels);
+}
+
+// `panels` of a `width` x `height` image, side by side, as far as they fall
+// in `tile`. The window is a single tile.
+static void RenderPanels(AppState &s, PanelSet panels, float width,
+                         float height, Viewport tile) {
+  const Viewport whole = {{0, 0}, {width, height}};
+  if (panels == PanelSet::Left) {
+    RenderLeftPanel(s, whole, tile);
+  } else if (panels == PanelSet::Right) {
+    RenderRightPanel(s, whole, tile);
+  } else {
+    RenderLeftPanel(s, {{0, 0}, {width / 2, height}}, tile);
+    RenderRightPanel(s, {{width / 2, 0}, {width, height}}, tile);
+  }
+}
+
+#ifdef LANGEVIN_DISTRIBUTED
+// The scenario's particle count, the ensemble and the shown member.
+static void SetWorkerSimulation(const AppState &s, WorkerConfig &config) {
+  if (s.scenario.particlesWidth > 0) {
+    config.particlesWidth = static_cast<uint32_t>(s.scenario.particlesWidth);
+    config.particlesHeight = static_cast<uint32_t>(s.scenario.particlesHeight);
+  }
+  config.mixture = s.mog;
+  config.dt = s.dt;
+  config.ensembleSize = static_cast<uint32_t>(s.ensembleSize);
+  config.dtSpread = s.dtSpread;
+  config.member = static_cast<uint32_t>(s.shownMember);
+  config.seed = s.seed;
+}
+
+// Sends the workers what they need of the local state when it changed.
+// Workers bin the window's left panel.
+static void UpdateWorkers(AppState &s, Viewport viewport) {
+  const WorkerConfig &current = s.coordinator->Config();
+  WorkerConfig config = current;
+  SetWorkerSimulation(s, config);
+  config.paused = s.paused ? 1 : 0;
+  config.viewport = viewport;
+  config.resets = s.workerResets;
+  const bool targetChanged =
+      !SameTarget(s.coordinator->CurrentTarget(), s.target);
+  if (!targetChanged && SameMixture(config.mixture, current.mixture) &&
+      config.particlesWidth == current.particlesWidth &&
+      config.particlesHeight == current.particlesHeight &&
+      config.dt == current.dt && config.ensembleSize == current.ensembleSize &&
+      config.dtSpread == current.dtSpread && config.member == current.member &&
+      config.seed == current.seed && config.paused == current.paused &&
+      config.viewport == current.viewport && config.resets == current.resets)
+    return;
+  if (targetChanged)
+    s.coordinator->Configure(config, s.target);
+  else
+    s.coordinator->Configure(config);
+}
+
+// --workers: every worker gets the scenario's particle count, the whole
+// ensemble and a share of the cores. Returns false after printing why the
+// workers did not start.
+static bool StartWorkers(AppState &s, const char *executable, int workers) {
+  WorkerConfig config;
+  SetWorkerSimulation(s, config);
+  const int cores = static_cast<int>(std::thread::hardware_concurrency());
+  config.threads = std::max(0, cores / std::max(1, workers) - 1);
+  try {
+    s.coordinator =
+        std::make_unique<Coordinator>(executable, workers, config, s.target);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return false;
+  }
+  s.estimatedDistributionRenderer->SetResolution(kWorkerHistogramSize,
+                                                 kWorkerHistogramSize);
+  // The local simulation no longer steps
+  if (s.cpuSimulation)
+    s.cpuSimulation->SetPaused(true);
+  return true;
+}
+
+// Picks up the newest merged histograms, returning false if none arrived.
+static bool MergeWorkers(AppState &s) {
+  if (!s.coordinator->Merge(s.distributed))
+    return false;
+  s.estimatedDistributionRenderer->UploadHistogram(0, s.distributed.counts);
+  s.hasDistributed = true;
+  return true;
+}
+
+// --worker: steps on the GPU in a hidden window's context, or on the CPU
+// when there is none.
+static int RunGpuWorker(int fd) {
+  if (SDL_Init(SDL_INIT_VIDEO) != 0)
+    return RunWorker(fd);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 0);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+  SDL_Window *window = SDL_CreateWindow(
+      "Langevin worker", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 64,
+      64, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+  SDL_GLContext gl_context =
+      window != nullptr ? SDL_GL_CreateContext(window) : nullptr;
+  bool gpu = gl_context != nullptr;
+  if (gpu) {
+    SDL_GL_MakeCurrent(window, gl_context);
+    // Headless EGL contexts report a missing GLX display once GLEW has
+    // loaded every entry point anyway
+    glewExperimental = GL_TRUE;
+    const GLenum err = glewInit();
+    gpu = err == GLEW_OK || err == GLEW_ERROR_NO_GLX_DISPLAY;
+  }
+  if (!gpu)
+    fprintf(stderr, "Worker: no GL context (%s), using the CPU\n",
+            SDL_GetError());
+
+  const int result = RunWorker(fd, gpu);
+  if (gl_context != nullptr)
+    SDL_GL_DeleteContext(gl_context);
+  if (window != nullptr)
+    SDL_DestroyWindow(window);
+  SDL_Quit();
+  return result;
+}
+#endif
+
+#ifndef EMSCRIPTEN
+static void StartRecording(AppState &s) {
+  s.recordOptions.path = s.recordPath;
+  try {
+    s.recorder = std::make_unique<Recorder>(s.recordOptions);
+    s.recordStatus.clear();
+  } catch (const std::exception &e) {
+    s.recordStatus = e.what();
+  }
+}
+
+// Drains the frames still in flight, so this can take a moment.
+static void StopRecording(AppState &s) {
+  const std::string error = s.recorder->Error();
+  const int written = s.recorder->FramesWritten();
+  s.recorder.reset();
+  if (error.empty()) {
+    s.recordStatus =
+        "Wrote " + std::to_string(written) + " frames to " + s.recordPath;
+  } else {
+    s.recordStatus = error;
+  }
+}
+
+// Renders the recorded panels into the recorder's framebuffer when the
+// simulation has advanced far enough since the last captured frame.
+static void CaptureFrame(AppState &s) {
+  uint32_t step =
+      s.simulation ? s.simulation->Step() : s.cpuSimulation->Frame().step;
+#ifdef LANGEVIN_DISTRIBUTED
+  if (s.coordinator)
+    step = s.distributed.step;
+#endif
+  if (!s.recorder->Due(step))
+    return;
+  const float width = static_cast<float>(s.recordOptions.width);
+  const float height = static_cast<float>(s.recordOptions.height);
+  s.recorder->Bind();
+  RenderPanels(s, s.outputPanels, width, height, {{0, 0}, {width, height}});
+  s.recorder->Capture(step);
 }
 
+// Renders `panels` at any size, in tiles past the GL limits, and saves them
+// as a PNG. Throws on failure.
+static void ExportImage(AppState &s, const std::string &path, int width,
+                        int height, PanelSet panels) {
+  std::vector<uint8_t> rgba;
+  RenderOffscreen(
+      width, height,
+      [&](Viewport tile) {
+        RenderPanels(s, panels, static_cast<float>(width),
+                     static_cast<float>(height), tile);
+      },
+      rgba);
+  WritePng(path, width, height, rgba.data());
+}
+
+static bool ParsePanelSet(const char *name, PanelSet &panels) {
+  if (std::strcmp(name, "both") == 0)
+    panels = PanelSet::Both;
+  else if (std::strcmp(name, "left") == 0)
+    panels = PanelSet::Left;
+  else if (std::strcmp(name, "right") == 0)
+    panels = PanelSet::Right;
+  else
+    return false;
+  return true;
+}
+
+// --export: runs `steps` steps, saves one image and returns the exit code.
+static int RunExport(AppState &s, const std::string &path, int width,
+                     int height, int steps, PanelSet panels) {
+  uint32_t step;
+#ifdef LANGEVIN_DISTRIBUTED
+  if (s.coordinator) {
+    // Workers stop at `steps`; wait until every one of them got there
+    WorkerConfig config = s.coordinator->Config();
+    config.maxSteps = static_cast<uint32_t>(std::max(steps, 0));
+    const float w = static_cast<float>(width);
+    const float h = static_cast<float>(height);
+    config.viewport = PanelViewport(
+        s, panels == PanelSet::Both ? Viewport{{0, 0}, {w / 2, h}}
+                                    : Viewport{{0, 0}, {w, h}});
+    s.coordinator->Configure(config);
+    while (!MergeWorkers(s) ||
+           s.distributed.workers < s.coordinator->Workers() ||
+           s.distributed.step < config.maxSteps) {
+      if (s.coordinator->Connected() < s.coordinator->Workers()) {
+        fprintf(stderr, "Error: a worker exited\n");
+        return 1;
+      }
+      SDL_Delay(1);
+    }
+    step = s.distributed.step;
+  } else
+#endif
+  if (s.simulation) {
+    for (int i = 0; i < steps; i++)
+      s.simulation->Update();
+    step = s.simulation->Step();
+  } else {
+    // Steps on its own thread; wait for a frame at least `steps` in
+    s.cpuSimulation->SetPaused(false);
+    bool published = false;
+    while (!published ||
+           s.cpuSimulation->Frame().step < static_cast<uint32_t>(steps)) {
+      if (s.cpuSimulation->Update())
+        published = true;
+      else
+        SDL_Delay(1);
+    }
+    s.cpuSimulation->SetPaused(true);
+    step = s.cpuSimulation->Frame().step;
+  }
+  s.estimatedDistributionRenderer->Invalidate();
+
+  try {
+    ExportImage(s, path, width, height, panels);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+  printf("Saved %s, %d x %d after %u steps\n", path.c_str(), width, height,
+         step);
+  return 0;
+}
+#endif
+
 static void Frame(void *arg) {
   AppState *s = static_cast<AppState *>(arg);
   ImGuiIO &io = ImGui::GetIO();
 
+#ifndef EMSCRIPTEN
+  // Nothing is animating, so sleep until the user does something instead of
+  // redrawing the same frame at display rate. A watched scenario, or workers
+  // still reporting, need an occasional look.
+  if (s->idleFrames >= 2) {
+    s->frameStart = 0;
+    bool watching = s->scenarioWatcher != nullptr;
+#ifdef LANGEVIN_DISTRIBUTED
+    watching |= s->coordinator != nullptr;
+#endif
+    if (watching)
+      SDL_WaitEventTimeout(nullptr, 250);
+    else
+      SDL_WaitEvent(nullptr);
+  }
+#endif
+
   SDL_Event event;
+  bool hadEvents = false;
+  if (s->scenarioWatcher && s->scenarioWatcher->Poll()) {
+    ReloadScenario(*s);
+    hadEvents = true;
+  }
   while (SDL_PollEvent(&event)) {
+    hadEvents = true;
     ImGui_ImplSDL2_ProcessEvent(&event);
     if (event.type == SDL_QUIT)
       s->running = false;
@@ -63,19 +781,93 @@ static void Frame(void *arg) {
         event.window.windowID == SDL_GetWindowID(s->window))
       s->running = false;
   }
-  if (SDL_GetWindowFlags(s->window) & SDL_WINDOW_MINIMIZED) {
+  if (SDL_GetWindowFlags(s->window) &
+      (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN)) {
+    s->frameStart = 0;
+#ifdef EMSCRIPTEN
     SDL_Delay(10);
+#else
+    SDL_WaitEvent(nullptr);
+#endif
     return;
   }
 
+  // Waits for events are not frame time
+  const Uint64 now = SDL_GetPerformanceCounter();
+  if (s->frameStart != 0 &&
+      s->governor.Update(double(now - s->frameStart) /
+                         SDL_GetPerformanceFrequency()))
+    ApplyQuality(*s);
+  s->frameStart = now;
+
   ImGui_ImplOpenGL3_NewFrame();
   ImGui_ImplSDL2_NewFrame();
   ImGui::NewFrame();
 
   bool mixture_changed = false;
+  bool ensemble_changed = false;
+  bool target_changed = false;
   ImGui::SetNextWindowSize(ImVec2(250.0f, 0.0f), ImGuiCond_Appearing);
   if (ImGui::Begin("Controls")) {
+    if (!s->scenarioPath.empty()) {
+      ImGui::SeparatorText("Scenario");
+      ImGui::TextWrapped("%s", s->scenarioPath.c_str());
+      ImGui::TextWrapped("%s", s->scenarioStatus.c_str());
+      if (ImGui::Button("Reload"))
+        ReloadScenario(*s);
+    }
+
+    ImGui::SeparatorText("Target");
+    {
+      int kind = static_cast<int>(s->target.kind);
+      const char *current = TargetName(s->target.kind);
+      if (ImGui::BeginCombo("Density", current)) {
+        for (int i = 0; i < kNumTargetKinds; ++i) {
+          const TargetKind k = static_cast<TargetKind>(i);
+          if (ImGui::Selectable(TargetName(k), kind == i) && kind != i) {
+            if (k == TargetKind::Rosenbrock)
+              s->target = RosenbrockTarget();
+            else if (k == TargetKind::DoubleWell)
+              s->target = DoubleWellTarget();
+            else if (k == TargetKind::Grid)
+              s->target = TabulateMixture(s->mog);
+            else
+              s->target = Target();
+            target_changed = true;
+          }
+        }
+        ImGui::EndCombo();
+      }
+    }
+    if (s->target.kind == TargetKind::Rosenbrock ||
+        s->target.kind == TargetKind::DoubleWell) {
+      const bool rosenbrock = s->target.kind == TargetKind::Rosenbrock;
+      glm::vec4 &p = s->target.params;
+      bool changed = false;
+      changed |= ImGui::SliderFloat(rosenbrock ? "a" : "w", &p.x, 0.05f, 2.0f,
+                                    "%.3f");
+      changed |= ImGui::SliderFloat(rosenbrock ? "b" : "h", &p.y, 0.1f, 50.0f,
+                                    "%.2f", ImGuiSliderFlags_Logarithmic);
+      changed |= ImGui::SliderFloat(rosenbrock ? "c" : "s", &p.z, 0.01f, 2.0f,
+                                    "%.3f", ImGuiSliderFlags_Logarithmic);
+      if (changed) {
+        s->target = rosenbrock ? RosenbrockTarget(p.x, p.y, p.z)
+                               : DoubleWellTarget(p.x, p.y, p.z);
+        target_changed = true;
+      }
+    } else if (s->target.kind == TargetKind::Grid) {
+      ImGui::Text("%d x %d log densities", s->target.gridWidth,
+                  s->target.gridHeight);
+      if (ImGui::Button("Tabulate mixture")) {
+        s->target = TabulateMixture(s->mog);
+        target_changed = true;
+      }
+    }
+
     ImGui::SeparatorText("Mixture");
+    // Rosenbrock and double well targets ignore the mixture
+    ImGui::BeginDisabled(s->target.kind == TargetKind::Rosenbrock ||
+                         s->target.kind == TargetKind::DoubleWell);
     if (ImGui::SliderInt("Count", &s->mog.count, 1, 10)) {
       if (s->mog.count < 1)
         s->mog.count = 1;
@@ -101,15 +893,218 @@ static void Frame(void *arg) {
           s->mog.g[i].sigma.y < 0.001f ? 0.001f : s->mog.g[i].sigma.y;
       ImGui::PopID();
     }
+    ImGui::EndDisabled();
 
     ImGui::SeparatorText("Simulation");
-    ImGui::SliderFloat("dt", &s->dt, 0.000001f, 0.01f, "%.6f",
-                       ImGuiSliderFlags_Logarithmic);
+    if (ImGui::SliderFloat("dt", &s->dt, 0.000001f, 0.01f, "%.6f",
+                           ImGuiSliderFlags_Logarithmic)) {
+      ensemble_changed = true;
+    }
+    ImGui::Checkbox("Pause", &s->paused);
+    ImGui::SameLine();
+    if (ImGui::Button("Step")) {
+      s->stepOnce = true;
+    }
     if (ImGui::Button("Reset Particles")) {
-      s->simulation.ResetParticles();
+#ifdef LANGEVIN_DISTRIBUTED
+      s->workerResets++;
+#endif
+      if (s->simulation)
+        s->simulation->ResetParticles();
+      else
+        s->cpuSimulation->ResetParticles();
+      s->estimatedDistributionRenderer->Invalidate();
+    }
+
+    if (s->cpuSimulation) {
+      ImGui::Text("CPU fallback, %d threads, %.0f steps/s",
+                  s->cpuSimulation->Threads(),
+                  s->cpuSimulation->StepsPerSecond());
+    } else {
+      // stepsPerFrame substeps per displayed frame
+      ImGui::Text("GPU, %.0f steps/s",
+                  s->paused ? 0.0f
+                            : ImGui::GetIO().Framerate * s->stepsPerFrame);
+      // Generic while the variant for this component count compiles
+      ImGui::Text("Program: %s", s->simulation->ShaderSpecialized()
+                                     ? "specialized"
+                                     : "generic");
+      {
+        static const int kSizes[] = {0, 128, 256, 512};
+        static const char *const kNames[] = {"Exact", "Table 128", "Table 256",
+                                             "Table 512"};
+        int current = 0;
+        for (int i = 0; i < 4; ++i) {
+          if (kSizes[i] == s->scoreTableSize)
+            current = i;
+        }
+        if (ImGui::Combo("Score", &current, kNames, 4)) {
+          s->scoreTableSize = kSizes[current];
+          s->simulation->SetScoreTable(s->scoreTableSize);
+        }
+        const std::vector<ScoreTable> &tables = s->simulation->ScoreTables();
+        if (!tables.empty()) {
+          // Sides adapt to the narrowest component, up to the chosen size
+          ImGui::Text("%d x %d, error max %.2g, rms %.2g", tables[0].size,
+                      tables[0].size, tables[0].maxError, tables[0].rmsError);
+        }
+      }
+      // Formats the context cannot render to are listed but disabled
+      const char *current =
+          GetParticleFormatInfo(s->simulation->Format()).name;
+      if (ImGui::BeginCombo("Storage", current)) {
+        for (int i = 0; i < kNumParticleFormats; ++i) {
+          const ParticleFormat format = static_cast<ParticleFormat>(i);
+          const ImGuiSelectableFlags flags =
+              IsParticleFormatSupported(format)
+                  ? ImGuiSelectableFlags_None
+                  : ImGuiSelectableFlags_Disabled;
+          if (ImGui::Selectable(GetParticleFormatInfo(format).name,
+                                s->particleFormat == i, flags) &&
+              s->particleFormat != i) {
+            s->particleFormat = i;
+            s->simulation->SetParticleFormat(format);
+            s->particleRenderer.SetParticleFormat(format);
+            s->estimatedDistributionRenderer->SetParticleFormat(format);
+            s->hasStorageReport = false;
+          }
+        }
+        ImGui::EndCombo();
+      }
+      {
+        const ParticleFormatInfo &info =
+            GetParticleFormatInfo(s->simulation->Format());
+        ImGui::Text("Traffic: %.1f MB/step, resolution %.1e",
+                    2.0 * info.bytesPerParticle *
+                        s->simulation->NumParticles() / (1024.0 * 1024.0),
+                    info.resolution);
+      }
+      if (s->estimatedDistributionRenderer->GpuAccumulation()) {
+        ImGui::Text("Histogram: %s",
+                    s->estimatedDistributionRenderer->HistogramFormat() ==
+                            GL_R32F
+                        ? "R32F"
+                        : "RG32F");
+      } else {
+        ImGui::Text("Histogram: CPU (no float blending)");
+      }
+      if (IsParticleFormatSupported(ParticleFormat::RG32F) &&
+          ImGui::Button("Compare with RG32F")) {
+        RunStorageReport(*s);
+      }
+      if (s->hasStorageReport) {
+        const ParticleStorageReport &r = s->storageReport;
+        ImGui::Text("After %d steps:", kStorageReportSteps);
+        ImGui::Text("  rms %.2e, max %.2e", r.rmsError, r.maxError);
+        ImGui::Text("  mean err (%.1e, %.1e)", r.meanError.x, r.meanError.y);
+        ImGui::Text("  var err (%.1e, %.1e)", r.varianceError.x,
+                    r.varianceError.y);
+      }
+    }
+
+#ifdef LANGEVIN_DISTRIBUTED
+    if (s->coordinator) {
+      ImGui::SeparatorText("Workers");
+      ImGui::Text("%d of %d connected, %.0f steps/s",
+                  s->coordinator->Connected(), s->coordinator->Workers(),
+                  s->coordinator->StepsPerSecond());
+      if (s->hasDistributed) {
+        const DistributedFrame &d = s->distributed;
+        const glm::vec2 mean = d.moments.Mean();
+        const glm::vec2 variance = d.moments.Variance();
+        ImGui::Text("Member %u: %.3g particles, step %u",
+                    s->coordinator->Config().member,
+                    static_cast<double>(d.particles), d.step);
+        ImGui::Text("Mean (%.3f, %.3f)", mean.x, mean.y);
+        ImGui::Text("Variance (%.3g, %.3g)", variance.x, variance.y);
+      }
+    }
+#endif
+
+    ImGui::SeparatorText("Ensemble");
+    if (ImGui::SliderInt("Members", &s->ensembleSize, 1,
+                         kMaxEnsembleMembers)) {
+      s->ensembleSize =
+          std::max(1, std::min(s->ensembleSize, kMaxEnsembleMembers));
+      ensemble_changed = true;
+    }
+    if (ImGui::SliderFloat("dt spread", &s->dtSpread, 1.0f, 10.0f, "%.2f",
+                           ImGuiSliderFlags_Logarithmic)) {
+      ensemble_changed = true;
+    }
+    s->shownMember = std::min(s->shownMember, s->ensembleSize - 1);
+    ImGui::SliderInt("Show member", &s->shownMember, 0, s->ensembleSize - 1);
+    ImGui::Text("Member dt: %.6f",
+                s->dt * std::pow(s->dtSpread, (float)s->shownMember));
+
+    if (s->simulation && s->target.kind == TargetKind::Mixture) {
+      ImGui::SeparatorText("Modes");
+      if (ImGui::SliderInt("Track every", &s->modeInterval, 0, 600,
+                           s->modeInterval > 0 ? "%d frames" : "off")) {
+        ApplyIntervals(*s);
+      }
+      const ModeStatistics &modes = s->simulation->Modes();
+      if (s->modeInterval > 0 && !modes.members.empty()) {
+        const MemberModeStatistics &member = modes.members[std::min<size_t>(
+            s->shownMember, modes.members.size() - 1)];
+        uint64_t particles = 0;
+        for (uint64_t count : member.occupancy)
+          particles += count;
+        particles = std::max<uint64_t>(particles, 1);
+        ImGui::Text("Step %u: %.2e hops per particle-step", modes.step,
+                    member.hopRate);
+        ImGui::Text("%.2f%% hopped in the last %u steps",
+                    100.0 * member.hoppers / particles, modes.windowSteps);
+        for (int i = 0; i < s->mog.count; ++i) {
+          char label[32];
+          std::snprintf(label, sizeof(label), "Gaussian %d: %.1f%%", i,
+                        100.0 * member.occupancy[i] / particles);
+          ImGui::ProgressBar(static_cast<float>(member.occupancy[i]) /
+                                 particles,
+                             ImVec2(-1.0f, 0.0f), label);
+        }
+        // Bin 0 holds particles that never hopped, bin b those with
+        // [2^(b-1), 2^b) hops
+        float hopCounts[kHopCountBins];
+        for (int b = 0; b < kHopCountBins; ++b)
+          hopCounts[b] = static_cast<float>(member.hopCounts[b]);
+        ImGui::PlotHistogram("Hops", hopCounts, kHopCountBins, 0,
+                             "particles by log2 hops", 0.0f, 3.4e38f,
+                             ImVec2(0.0f, 60.0f));
+      }
     }
 
     ImGui::SeparatorText("View");
+    {
+      const char *modes[] = {"Estimated density", "Particles"};
+      int mode = static_cast<int>(s->viewMode);
+      if (ImGui::Combo("Left panel", &mode, modes, IM_ARRAYSIZE(modes)))
+        s->viewMode = static_cast<ViewMode>(mode);
+    }
+    if (s->viewMode == ViewMode::Particles) {
+      ImGui::SliderFloat("Sprite size", &s->spriteSize, 1.0f, 8.0f, "%.1f px");
+      if (s->simulation)
+        ImGui::Checkbox("Color by velocity", &s->velocityColoring);
+      ImGui::Text("Drawing 1 in %d particles", s->particleRenderer.Stride());
+    }
+    if (s->simulation) {
+      if (ImGui::SliderInt("Sort every", &s->sortInterval, 0, 1000,
+                           "%d frames")) {
+        ApplyIntervals(*s);
+      }
+      if (s->culled) {
+        size_t visible = 0;
+        for (const ParticleRange &range : s->visibleRanges[s->shownMember])
+          visible += range.count;
+        ImGui::Text("Culling: %.1f%% of the member drawn",
+                    100.0 * visible * s->ensembleSize /
+                        s->simulation->NumParticles());
+      } else if (s->target.kind != TargetKind::Mixture) {
+        ImGui::Text("Culling: off, the drift has no bound");
+      } else {
+        ImGui::Text("Culling: waiting for a sort");
+      }
+    }
     ImGui::DragFloat2("Center", &s->viewCenter.x, 0.01f, -10.0f, 10.0f, "%.3f");
     ImGui::SliderFloat("Scale", &s->viewScale, 0.01f, 10.0f, "%.3f",
                        ImGuiSliderFlags_Logarithmic);
@@ -117,15 +1112,115 @@ static void Frame(void *arg) {
       s->viewCenter = glm::vec2(0.0f, 0.0f);
       s->viewScale = 1.0f;
     }
+
+    ImGui::SeparatorText("Performance");
+    {
+      FrameGovernor &governor = s->governor;
+      bool adaptive = governor.Enabled();
+      if (ImGui::Checkbox("Adapt quality", &adaptive))
+        governor.SetEnabled(adaptive);
+      if (adaptive) {
+        int fps = static_cast<int>(governor.TargetFps());
+        if (ImGui::SliderInt("Target FPS", &fps, 10, 240))
+          governor.SetTargetFps(fps);
+      } else {
+        int level = governor.Level();
+        if (ImGui::SliderInt("Quality", &level, 0, kNumQualityLevels - 1,
+                             kQualityLevels[level].name)) {
+          governor.SetLevel(level);
+          ApplyQuality(*s);
+        }
+      }
+      const QualityLevel &quality = kQualityLevels[governor.Level()];
+      ImGui::Text("%s: %.1f ms per frame", quality.name,
+                  governor.AverageMs());
+      // Only what the current backend applies: workers bin at a fixed
+      // resolution, and the CPU paths neither substep nor stride
+      bool local = true;
+      int resolution = quality.resolution;
+#ifdef LANGEVIN_DISTRIBUTED
+      if (s->coordinator) {
+        local = false;
+        resolution = kWorkerHistogramSize;
+      }
+#endif
+      ImGui::Text("%d x %d bins", resolution, resolution);
+      if (local && s->simulation && s->stepsPerFrame > 1)
+        ImGui::Text("%d substeps of dt / %d per frame", s->stepsPerFrame,
+                    s->stepsPerFrame);
+      else if (local && s->simulation)
+        ImGui::Text("1 step per frame");
+      if (local && s->estimatedDistributionRenderer->GpuAccumulation())
+        ImGui::Text("Binning 1 in %d particles",
+                    s->estimatedDistributionRenderer->AccumulationStride());
+    }
+
+#ifndef EMSCRIPTEN
+    ImGui::SeparatorText("Export");
+    {
+      const char *panels[] = {"Both", "Left", "Right"};
+      int current = static_cast<int>(s->outputPanels);
+      if (ImGui::Combo("Panels", &current, panels, IM_ARRAYSIZE(panels)))
+        s->outputPanels = static_cast<PanelSet>(current);
+    }
+    ImGui::InputText("Image", s->exportPath, sizeof(s->exportPath));
+    ImGui::InputInt2("Image size", s->exportSize);
+    if (ImGui::Button("Save image")) {
+      try {
+        ExportImage(*s, s->exportPath, s->exportSize[0], s->exportSize[1],
+                    s->outputPanels);
+        s->exportStatus = std::string("Saved ") + s->exportPath;
+      } catch (const std::exception &e) {
+        s->exportStatus = e.what();
+      }
+    }
+    if (!s->exportStatus.empty())
+      ImGui::TextWrapped("%s", s->exportStatus.c_str());
+
+    ImGui::SeparatorText("Recording");
+    if (s->recorder) {
+      ImGui::Text("%d frames captured, %d written",
+                  s->recorder->FramesCaptured(),
+                  s->recorder->FramesWritten());
+      if (ImGui::Button("Stop"))
+        StopRecording(*s);
+    } else {
+      RecorderOptions &o = s->recordOptions;
+      const char *outputs[] = {"PNG sequence", "ffmpeg"};
+      int output = static_cast<int>(o.output);
+      if (ImGui::Combo("Output", &output, outputs, IM_ARRAYSIZE(outputs)))
+        o.output = static_cast<RecorderOutput>(output);
+      ImGui::InputText(o.output == RecorderOutput::Ffmpeg ? "File"
+                                                          : "Directory",
+                       s->recordPath, sizeof(s->recordPath));
+      int size[2] = {o.width, o.height};
+      if (ImGui::InputInt2("Size", size)) {
+        o.width = size[0];
+        o.height = size[1];
+      }
+      ImGui::InputInt("Every", &o.stepInterval);
+      o.stepInterval = std::max(1, o.stepInterval);
+      if (o.output == RecorderOutput::Ffmpeg) {
+        ImGui::InputInt("FPS", &o.fps);
+        o.fps = std::max(1, o.fps);
+      }
+      if (ImGui::Button("Start"))
+        StartRecording(*s);
+    }
+    if (!s->recordStatus.empty())
+      ImGui::TextWrapped("%s", s->recordStatus.c_str());
+#endif
   }
   ImGui::End();
 
   if (mixture_changed) {
     s->mog.UpdatePeak();
-    s->simulation.SetMixture(s->mog);
-    s->distributionRenderer.SetMixture(s->mog);
-    s->estimatedDistributionRenderer.SetMixture(s->mog);
+    ApplyMixture(*s);
   }
+  if (target_changed)
+    ApplyTarget(*s);
+  if (mixture_changed || ensemble_changed)
+    ApplyEnsemble(*s);
 
   {
     const Viewport basePV = {s->viewCenter - glm::vec2(s->viewScale),
@@ -158,42 +1253,127 @@ static void Frame(void *arg) {
       s->viewScale = 10.0f;
   }
 
-  s->simulation.SetDt(s->dt);
-  s->simulation.Update();
-
-  glClearColor(0, 0, 0, 0);
-  glClear(GL_COLOR_BUFFER_BIT);
-
-  {
-    const Viewport particleViewport = {s->viewCenter - glm::vec2(s->viewScale),
-                                       s->viewCenter + glm::vec2(s->viewScale)};
-    const Viewport pixelViewport = {{0, 0},
-                                    {io.DisplaySize.x / 2, io.DisplaySize.y}};
-    const Viewport particleViewportCorretAspect =
-        EnforceAspectRatio(particleViewport, pixelViewport);
-
-    s->estimatedDistributionRenderer.Render(
-        particleViewportCorretAspect, pixelViewport, s->simulation.Width(),
-        s->simulation.Height(), s->simulation.ParticlesTexture());
+  // The CPU simulation steps on its own thread; frames only pick up its
+  // newest state.
+  bool simulationIdle = true;
+#ifdef LANGEVIN_DISTRIBUTED
+  if (s->coordinator) {
+    UpdateWorkers(*s, PanelViewport(*s, {{0, 0},
+                                         {io.DisplaySize.x / 2.0f,
+                                          io.DisplaySize.y}}));
+    // Paused workers still report once after a change
+    if (MergeWorkers(*s) || !s->paused)
+      simulationIdle = false;
+  } else
+#endif
+  if (s->simulation) {
+    if (!s->paused || s->stepOnce) {
+      // A step is a frame's worth of substeps
+      for (int i = 0; i < s->stepsPerFrame; ++i)
+        s->simulation->Update();
+      s->estimatedDistributionRenderer->Invalidate();
+    }
+  } else {
+    s->cpuSimulation->SetPaused(s->paused);
+    if (s->stepOnce)
+      s->cpuSimulation->StepOnce();
+    simulationIdle = s->cpuSimulation->Idle();
+    if (s->cpuSimulation->Update()) {
+      s->estimatedDistributionRenderer->Invalidate();
+      simulationIdle = false;
+    }
   }
+  s->stepOnce = false;
 
-  {
-    const Viewport particleViewport = {s->viewCenter - glm::vec2(s->viewScale),
-                                       s->viewCenter + glm::vec2(s->viewScale)};
-    const Viewport pixelViewport = {{io.DisplaySize.x / 2, 0},
-                                    {io.DisplaySize.x, io.DisplaySize.y}};
-    const Viewport particleViewportCorretAspect =
-        EnforceAspectRatio(particleViewport, pixelViewport);
+  if (s->paused && simulationIdle && !hadEvents)
+    s->idleFrames++;
+  else
+    s->idleFrames = 0;
 
-    s->distributionRenderer.Render(particleViewportCorretAspect, pixelViewport);
+#ifndef EMSCRIPTEN
+  if (s->recorder) {
+    // A failed writer has stopped, keep its error and the frames it wrote
+    if (!s->recorder->Error().empty())
+      StopRecording(*s);
+    else
+      CaptureFrame(*s);
   }
+#endif
+
+  glClearColor(0, 0, 0, 0);
+  glClear(GL_COLOR_BUFFER_BIT);
+  RenderPanels(*s, PanelSet::Both, io.DisplaySize.x, io.DisplaySize.y,
+               {{0, 0}, {io.DisplaySize.x, io.DisplaySize.y}});
 
   ImGui::Render();
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
   SDL_GL_SwapWindow(s->window);
 }
 // Main code
-int main(int, char **) {
+int main(int argc, char **argv) {
+#if !defined(_WIN32) && !defined(EMSCRIPTEN)
+  // A crashed ffmpeg or worker must fail the write, not kill the app
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  // --cpu skips the GPU simulation, e.g. to compare the two
+  bool forceCpu = false;
+  std::string scenarioPath;
+#ifndef EMSCRIPTEN
+  // --export FILE saves an image after --steps steps without showing the
+  // window, then exits
+  std::string exportPath;
+  int exportWidth = kDefaultExportWidth;
+  int exportHeight = kDefaultExportHeight;
+  int exportSteps = kDefaultExportSteps;
+  PanelSet exportPanels = PanelSet::Both;
+#endif
+#ifdef LANGEVIN_DISTRIBUTED
+  // --workers N moves the simulation into N processes, see Coordinator
+  int workers = 0;
+#endif
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--cpu") == 0) {
+      forceCpu = true;
+    } else if (std::strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+      scenarioPath = argv[++i];
+#ifndef EMSCRIPTEN
+    } else if (std::strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+      exportPath = argv[++i];
+    } else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc &&
+               std::sscanf(argv[++i], "%dx%d", &exportWidth,
+                           &exportHeight) == 2) {
+    } else if (std::strcmp(argv[i], "--steps") == 0 && i + 1 < argc &&
+               std::sscanf(argv[++i], "%d", &exportSteps) == 1) {
+    } else if (std::strcmp(argv[i], "--panels") == 0 && i + 1 < argc &&
+               ParsePanelSet(argv[++i], exportPanels)) {
+#endif
+#ifdef LANGEVIN_DISTRIBUTED
+    } else if (std::strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+      // Started by a Coordinator
+      return RunGpuWorker(std::atoi(argv[i + 1]));
+    } else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc &&
+               std::sscanf(argv[++i], "%d", &workers) == 1 && workers > 0) {
+#endif
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--cpu] [--scenario FILE] [--workers N] "
+              "[--export FILE.png [--size WxH] [--steps N] "
+              "[--panels both|left|right]]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  Scenario scenario = DefaultScenario();
+  if (!scenarioPath.empty()) {
+    try {
+      scenario = LoadScenario(scenarioPath);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+  }
+
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER) !=
       0) {
     printf("Error: %s\n", SDL_GetError());
@@ -221,6 +1401,11 @@ int main(int, char **) {
   SDL_WindowFlags window_flags =
       (SDL_WindowFlags)(SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE |
                         SDL_WINDOW_ALLOW_HIGHDPI);
+#ifndef EMSCRIPTEN
+  // Exports only need the context
+  if (!exportPath.empty())
+    window_flags = (SDL_WindowFlags)(window_flags | SDL_WINDOW_HIDDEN);
+#endif
   SDL_Window *window = SDL_CreateWindow(
       "Langevin", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
       (int)(1280 * main_scale), (int)(800 * main_scale), window_flags);
@@ -269,15 +1454,28 @@ int main(int, char **) {
 
   state.window = window;
   state.gl_context = gl_context;
-  InitDefaultState(state);
+  InitDefaultState(state, forceCpu, scenarioPath, scenario);
+#ifdef LANGEVIN_DISTRIBUTED
+  if (workers > 0 && !StartWorkers(state, argv[0], workers))
+    return 1;
+#endif
 
 #if EMSCRIPTEN
   emscripten_set_main_loop_arg(Frame, state_ptr, 0, true);
   return 0;
 #else
 
-  while (state.running) {
-    Frame(&state);
+  int result = 0;
+  if (!exportPath.empty()) {
+    result = RunExport(state, exportPath, exportWidth, exportHeight,
+                       exportSteps, exportPanels);
+  } else {
+    while (state.running) {
+      Frame(&state);
+    }
+    // Writes the frames still in flight, which needs the context
+    if (state.recorder)
+      StopRecording(state);
   }
 
   ImGui_ImplOpenGL3_Shutdown();
@@ -288,6 +1486,6 @@ int main(int, char **) {
   SDL_DestroyWindow(window);
   SDL_Quit();
 
-  return 0;
+  return result;
 #endif
 }
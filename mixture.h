@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <glm/glm.hpp>
 
@@ -15,6 +16,10 @@ struct alignas(16) Gaussian {
     const float denom = kTwoPi * sigma.x * sigma.y; // 2*pi*sx*sy
     return std::exp(-0.5f * q) / denom;
   }
+
+  inline glm::vec2 Score(const glm::vec2 &p) const {
+    return (mean - p) / (sigma * sigma);
+  }
 };
 
 struct MixtureOfGaussians {
@@ -22,6 +27,74 @@ struct MixtureOfGaussians {
   float peak;
   Gaussian g[10];
 
+  // Equally weighted, matches mixture_of_gaussians in distribution.frag
+  inline float Evaluate(const glm::vec2 &p) const {
+    if (count <= 0)
+      return 0.0f;
+
+    float sum = 0.0f;
+    for (int i = 0; i < count; ++i)
+      sum += g[i].Evaluate(p);
+    return sum / static_cast<float>(count);
+  }
+
+  // Gradient of the log density, evaluated like mixture_of_gaussian_score in
+  // simulation.frag (responsibilities relative to the largest exponent).
+  inline glm::vec2 Score(const glm::vec2 &p) const {
+    static constexpr float kTwoPi = 6.283185307179586f;
+
+    float max_e = -1e30f;
+    for (int i = 0; i < count; ++i) {
+      const glm::vec2 d = (p - g[i].mean) / g[i].sigma;
+      max_e = std::max(max_e, -0.5f * glm::dot(d, d));
+    }
+
+    float wsum = 0.0f;
+    glm::vec2 num(0.0f);
+    for (int i = 0; i < count; ++i) {
+      const glm::vec2 d = (p - g[i].mean) / g[i].sigma;
+      const float w = std::exp(-0.5f * glm::dot(d, d) - max_e) /
+                      (kTwoPi * g[i].sigma.x * g[i].sigma.y);
+      num += w * g[i].Score(p);
+      wsum += w;
+    }
+    return wsum > 0.0f ? num / wsum : glm::vec2(0.0f);
+  }
+
+  // Component of largest responsibility at p, computed like the label of
+  // MODE_TRACKING in target.glsl; -1 without components.
+  inline int Mode(const glm::vec2 &p) const {
+    static constexpr float kTwoPi = 6.283185307179586f;
+
+    float max_e = -1e30f;
+    for (int i = 0; i < count; ++i) {
+      const glm::vec2 d = (p - g[i].mean) / g[i].sigma;
+      max_e = std::max(max_e, -0.5f * glm::dot(d, d));
+    }
+
+    int mode = -1;
+    float max_w = -1.0f;
+    for (int i = 0; i < count; ++i) {
+      const glm::vec2 d = (p - g[i].mean) / g[i].sigma;
+      const float w = std::exp(-0.5f * glm::dot(d, d) - max_e) /
+                      (kTwoPi * g[i].sigma.x * g[i].sigma.y);
+      if (w > max_w) {
+        max_w = w;
+        mode = i;
+      }
+    }
+    return mode;
+  }
+
+  // Upper bound on |Score(p)|: the score is a convex combination of the
+  // component scores.
+  inline float ScoreBound(const glm::vec2 &p) const {
+    float bound = 0.0f;
+    for (int i = 0; i < count; ++i)
+      bound = std::max(bound, glm::length(g[i].Score(p)));
+    return bound;
+  }
+
   inline void UpdatePeak() {
     float max_val = 0.0f;
     if (count <= 0) {
@@ -29,15 +102,20 @@ struct MixtureOfGaussians {
       return;
     }
 
-    for (int i = 0; i < count; ++i) {
-      const glm::vec2 mu = g[i].mean;
-      float mixture_at_mu = 0.0f;
-      for (int j = 0; j < count; ++j) {
-        mixture_at_mu += g[j].Evaluate(mu);
-      }
-      mixture_at_mu /= static_cast<float>(count);
-      max_val = std::max(max_val, mixture_at_mu);
-    }
+    for (int i = 0; i < count; ++i)
+      max_val = std::max(max_val, Evaluate(g[i].mean));
     peak = max_val;
   }
 };
+
+// Same components; `peak` is derived from them.
+inline bool SameMixture(const MixtureOfGaussians &a,
+                        const MixtureOfGaussians &b) {
+  if (a.count != b.count)
+    return false;
+  for (int i = 0; i < a.count; i++) {
+    if (a.g[i].mean != b.g[i].mean || a.g[i].sigma != b.g[i].sigma)
+      return false;
+  }
+  return true;
+}
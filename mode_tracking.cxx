@@ -0,0 +1,53 @@
+#include "mode_tracking.h"
+
+#include "utils.h"
+
+// Bin of a particle that hopped `hops` times, see kHopCountBins
+static int HopCountBin(uint32_t hops) {
+  int bin = 0;
+  while (hops > 0 && bin < kHopCountBins - 1) {
+    hops >>= 1;
+    bin++;
+  }
+  return bin;
+}
+
+void ReduceModes(const std::vector<uint32_t> &texels, size_t width,
+                 size_t height, int ensembleSize, uint32_t step,
+                 const ModeStatistics &previous, ModeStatistics &statistics) {
+  const bool hasPrevious =
+      static_cast<int>(previous.members.size()) == ensembleSize &&
+      previous.step <= step;
+  const uint32_t windowStart = hasPrevious ? previous.step : 0;
+
+  statistics.step = step;
+  statistics.windowSteps = step - windowStart;
+  statistics.members.assign(ensembleSize, MemberModeStatistics());
+  for (int m = 0; m < ensembleSize; m++) {
+    int firstRow, numRows;
+    EnsembleRowRange(static_cast<int>(height), ensembleSize, m, firstRow,
+                     numRows);
+    MemberModeStatistics &member = statistics.members[m];
+    const size_t begin = static_cast<size_t>(firstRow) * width;
+    const size_t end = begin + static_cast<size_t>(numRows) * width;
+    for (size_t i = begin; i < end; i++) {
+      const uint32_t label = texels[4 * i] & kNoMode;
+      const uint32_t hops = texels[4 * i] >> kModeLabelBits;
+      const uint32_t lastHop = texels[4 * i + 1];
+      if (label < kMaxModes)
+        member.occupancy[label]++;
+      member.hops += hops;
+      member.hoppers += hops > 0 && lastHop > windowStart;
+      member.hopCounts[HopCountBin(hops)]++;
+    }
+
+    member.windowHops =
+        member.hops - (hasPrevious ? previous.members[m].hops : 0);
+    const size_t particles = end - begin;
+    if (particles > 0 && statistics.windowSteps > 0) {
+      member.hopRate = static_cast<double>(member.windowHops) /
+                       (static_cast<double>(particles) *
+                        statistics.windowSteps);
+    }
+  }
+}
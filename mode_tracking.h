@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Components a label can name, see MixtureOfGaussians::g
+static constexpr int kMaxModes = 10;
+
+// Mode channel of the simulation framebuffers, one RG32UI texel per
+// particle, written by shaders/simulation.frag. x holds the particle's
+// component of largest responsibility in its low 8 bits, kNoMode before the
+// first step, and its hops between components above them; y holds the step
+// of the last hop, 0 if none.
+static constexpr uint32_t kNoMode = 0xff;
+static constexpr int kModeLabelBits = 8;
+
+// ModeStatistics::hopCounts bins: no hops, then [2^(b-1), 2^b) hops in bin b
+static constexpr int kHopCountBins = 16;
+
+struct MemberModeStatistics {
+  // Particles labeled with each component
+  uint64_t occupancy[kMaxModes] = {};
+  // Since the particles were reset
+  uint64_t hops = 0;
+  // Within the window: hops, particles that hopped at least once, and hops
+  // per particle per step
+  uint64_t windowHops = 0;
+  uint64_t hoppers = 0;
+  double hopRate = 0.0;
+  // Particles by hops since the reset; divided by the step, hop rates
+  uint64_t hopCounts[kHopCountBins] = {};
+};
+
+struct ModeStatistics {
+  uint32_t step = 0;
+  // Steps since the previous reduction, or since the reset
+  uint32_t windowSteps = 0;
+  std::vector<MemberModeStatistics> members;
+};
+
+// Reduces mode texels read back as GL_RGBA_INTEGER, four per particle, over
+// the row bands of `ensembleSize` members (see EnsembleRowRange). The window
+// runs from `previous`, the last reduction since the reset, or from the
+// reset when it has no members.
+void ReduceModes(const std::vector<uint32_t> &texels, size_t width,
+                 size_t height, int ensembleSize, uint32_t step,
+                 const ModeStatistics &previous, ModeStatistics &statistics);
@@ -0,0 +1,77 @@
+#include "offscreen.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+int MaxTileSize() {
+  GLint renderbuffer = 0, texture = 0, viewport[2] = {0, 0};
+  glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &renderbuffer);
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &texture);
+  glGetIntegerv(GL_MAX_VIEWPORT_DIMS, viewport);
+  return std::min({renderbuffer, texture, viewport[0], viewport[1]});
+}
+
+namespace {
+// The tile framebuffer, left bound. Callers catch exceptions from draw and
+// keep reading pixels, so it also restores the pack row length and the
+// default framebuffer however RenderOffscreen returns.
+struct OffscreenTarget {
+  GLuint color = 0;
+  GLuint fbo = 0;
+
+  OffscreenTarget(int width, int height) {
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, color);
+  }
+  ~OffscreenTarget() {
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &color);
+  }
+
+  OffscreenTarget(const OffscreenTarget &) = delete;
+  OffscreenTarget &operator=(const OffscreenTarget &) = delete;
+};
+} // namespace
+
+void RenderOffscreen(int width, int height,
+                     const std::function<void(Viewport tile)> &draw,
+                     std::vector<uint8_t> &rgba, int maxTileSize) {
+  if (width <= 0 || height <= 0)
+    throw std::invalid_argument("Offscreen images need a positive size");
+  const int tileSize = maxTileSize > 0 ? std::min(maxTileSize, MaxTileSize())
+                                       : MaxTileSize();
+  const int tileWidth = std::min(width, tileSize);
+  const int tileHeight = std::min(height, tileSize);
+
+  OffscreenTarget target(tileWidth, tileHeight);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    throw std::runtime_error("Error creating offscreen framebuffer");
+
+  rgba.resize(static_cast<size_t>(width) * height * 4);
+  // Tiles are read straight into their place in the image
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glPixelStorei(GL_PACK_ROW_LENGTH, width);
+  for (int y = 0; y < height; y += tileHeight) {
+    for (int x = 0; x < width; x += tileWidth) {
+      const int w = std::min(tileWidth, width - x);
+      const int h = std::min(tileHeight, height - y);
+      glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+      glViewport(0, 0, w, h);
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+      draw({glm::vec2(x, y), glm::vec2(x + w, y + h)});
+
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+      glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE,
+                   rgba.data() + (static_cast<size_t>(y) * width + x) * 4);
+    }
+  }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#ifdef EMSCRIPTEN
+#include <GLES3/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "utils.h"
+
+// Largest tile RenderOffscreen can use: the smallest of the renderbuffer,
+// texture and viewport limits, since renderers may cache a tile-sized
+// texture.
+int MaxTileSize();
+
+// Renders a `width` x `height` image into `rgba` (8-bit, rows bottom-up like
+// glReadPixels), independent of the window. Images larger than
+// `maxTileSize` (MaxTileSize() if 0) are rendered in tiles: `draw` is called
+// once per tile with a framebuffer of the tile's size bound, and must draw
+// the image pixels `tile` covers so that tile.pmin lands at the framebuffer
+// origin. Throws std::invalid_argument for empty images and
+// std::runtime_error when the framebuffer cannot be created.
+void RenderOffscreen(int width, int height,
+                     const std::function<void(Viewport tile)> &draw,
+                     std::vector<uint8_t> &rgba, int maxTileSize = 0);
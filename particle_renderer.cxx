@@ -1,11 +1,31 @@
 #include "particle_renderer.h"
 
+#include "cpu_simulation.h"
 #include "particle.frag.h"
 #include "particle.vert.h"
 #include "utils.h"
+
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 
-ParticleRenderer::ParticleRenderer() {
+// Sprites drawn per panel pixel before subsampling starts. Beyond about one
+// per pixel extra sprites only add overdraw.
+static constexpr float kParticlesPerPixel = 1.0f;
+// Opacity of a single sprite when every particle is drawn
+static constexpr float kAlpha = 0.2f;
+// Particles start in, and mostly stay within, this box
+static constexpr float kDomainMin = -1.0f;
+static constexpr float kDomainMax = 1.0f;
+
+ParticleRenderer::ParticleRenderer()
+    : m_particleFormat(ParticleFormat::RG32F), m_velocityColoring(false),
+      m_typicalStep(0.0f), m_spriteSize(1.0f), m_stride(1),
+      m_uploadTexture(0), m_uploadWidth(0), m_uploadHeight(0) {
+  CreateProgram();
+}
+
+void ParticleRenderer::CreateProgram() {
   // Create VAO and VBO
   glGenVertexArrays(1, &m_vao);
   glBindVertexArray(m_vao);
@@ -13,9 +33,11 @@ ParticleRenderer::ParticleRenderer() {
   // Create shaders
   {
     m_vertShader = glCreateShader(GL_VERTEX_SHADER);
-    const GLchar *src = (const GLchar *)ParticleVert;
-    const GLsizei len = ParticleVert_len;
-    glShaderSource(m_vertShader, 1, &src, &len);
+    const std::string source =
+        ShaderSource(ParticleVert, ParticleVert_len,
+                     ParticleStoragePrelude(m_particleFormat));
+    const GLchar *src = source.c_str();
+    glShaderSource(m_vertShader, 1, &src, nullptr);
     glCompileShader(m_vertShader);
     CheckCompilationResult(m_vertShader, "particle.vert");
   }
@@ -35,23 +57,89 @@ ParticleRenderer::ParticleRenderer() {
   glLinkProgram(m_program);
 
   m_particlesUniform = glGetUniformLocation(m_program, "uParticles");
+  m_previousUniform = glGetUniformLocation(m_program, "uPrevious");
   m_particlesWidthUniform = glGetUniformLocation(m_program, "uParticlesWidth");
+  m_firstUniform = glGetUniformLocation(m_program, "uFirst");
+  m_countUniform = glGetUniformLocation(m_program, "uCount");
+  m_strideUniform = glGetUniformLocation(m_program, "uStride");
   m_minUniform = glGetUniformLocation(m_program, "uMin");
   m_maxUniform = glGetUniformLocation(m_program, "uMax");
+  m_spriteSizeUniform = glGetUniformLocation(m_program, "uSpriteSize");
+  m_alphaUniform = glGetUniformLocation(m_program, "uAlpha");
+  m_typicalStepUniform = glGetUniformLocation(m_program, "uTypicalStep");
+  m_roundUniform = glGetUniformLocation(m_program, "uRound");
 
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+void ParticleRenderer::SetParticleFormat(ParticleFormat format) {
+  if (format == m_particleFormat)
+    return;
+
+  glDeleteVertexArrays(1, &m_vao);
+  glDeleteProgram(m_program);
+  glDeleteShader(m_vertShader);
+  glDeleteShader(m_fragShader);
+
+  m_particleFormat = format;
+  CreateProgram();
+}
+
+void ParticleRenderer::SetVelocityColoring(bool enabled, float typicalStep) {
+  m_velocityColoring = enabled;
+  m_typicalStep = typicalStep;
+}
+
+void ParticleRenderer::SetSpriteSize(float pixels) {
+  m_spriteSize = std::max(1.0f, pixels);
+}
+
+int ParticleRenderer::Stride() { return m_stride; }
+
+// Share of the domain in view, which estimates the share of visible
+// particles when they are not culled.
+float ParticleRenderer::DomainCoverage(Viewport particleViewport) {
+  const float overlapX =
+      std::min(particleViewport.pmax.x, kDomainMax) -
+      std::max(particleViewport.pmin.x, kDomainMin);
+  const float overlapY =
+      std::min(particleViewport.pmax.y, kDomainMax) -
+      std::max(particleViewport.pmin.y, kDomainMin);
+  const float domainArea =
+      (kDomainMax - kDomainMin) * (kDomainMax - kDomainMin);
+  return std::max(overlapX, 0.0f) * std::max(overlapY, 0.0f) / domainArea;
+}
+
+int ParticleRenderer::ComputeStride(Viewport pixelViewport, float visible) {
+  // Larger sprites cover more pixels each, so fewer are needed
+  const float budget = kParticlesPerPixel * pixelViewport.Width() *
+                       pixelViewport.Height() / (m_spriteSize * m_spriteSize);
+  return std::max(1, static_cast<int>(visible / budget));
+}
+
 void ParticleRenderer::Render(Viewport particleViewport, Viewport pixelViewport,
                               int particlesWidth, int particlesHeight,
-                              GLuint particlesTexture) {
+                              GLuint particlesTexture, GLuint previousTexture,
+                              int ensembleSize, int member,
+                              const std::vector<ParticleRange> *ranges) {
+  int firstRow, numRows;
+  EnsembleRowRange(particlesHeight, ensembleSize, member, firstRow, numRows);
+  const std::vector<ParticleRange> band = {
+      {firstRow * particlesWidth, numRows * particlesWidth}};
+  const std::vector<ParticleRange> &draws = ranges ? *ranges : band;
+
+  int count = 0;
+  for (const ParticleRange &range : draws)
+    count += range.count;
+  // Culled ranges are close to the visible particles already
+  m_stride = ComputeStride(pixelViewport,
+                           ranges ? count
+                                  : count * DomainCoverage(particleViewport));
+
   glViewport(pixelViewport.pmin.x, pixelViewport.pmin.y, pixelViewport.Width(),
              pixelViewport.Height());
 
-#ifndef EMSCRIPTEN
-  glEnable(GL_PROGRAM_POINT_SIZE);
-#endif
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
@@ -61,14 +149,70 @@ void ParticleRenderer::Render(Viewport particleViewport, Viewport pixelViewport,
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_2D, particlesTexture);
   glUniform1i(m_particlesUniform, 0);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, previousTexture);
+  glUniform1i(m_previousUniform, 1);
 
   glUniform1i(m_particlesWidthUniform, particlesWidth);
+  glUniform1i(m_strideUniform, m_stride);
   glUniform2f(m_minUniform, particleViewport.pmin.x, particleViewport.pmin.y);
   glUniform2f(m_maxUniform, particleViewport.pmax.x, particleViewport.pmax.y);
+  glUniform2f(m_spriteSizeUniform,
+              2.0f * m_spriteSize / pixelViewport.Width(),
+              2.0f * m_spriteSize / pixelViewport.Height());
+  // A sprite stands for m_stride overlapping ones
+  glUniform1f(m_alphaUniform, 1.0f - std::pow(1.0f - kAlpha, m_stride));
+  glUniform1f(m_typicalStepUniform, m_velocityColoring ? m_typicalStep : 0.0f);
+  glUniform1i(m_roundUniform, m_spriteSize > 1.5f);
 
-  glDrawArrays(GL_POINTS, 0, particlesWidth * particlesHeight);
+  for (const ParticleRange &range : draws) {
+    glUniform1i(m_firstUniform, range.first);
+    glUniform1i(m_countUniform, range.count);
+    const int instances = (range.count + m_stride - 1) / m_stride;
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instances);
+  }
 
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_2D, 0);
   glBindVertexArray(0);
   glUseProgram(0);
 }
+
+void ParticleRenderer::Render(Viewport particleViewport, Viewport pixelViewport,
+                              const ParticleFrame &frame, int member) {
+  const int width = static_cast<int>(frame.width);
+  const int height = static_cast<int>(frame.height);
+  SetParticleFormat(ParticleFormat::RG32F);
+
+  if (width != m_uploadWidth || height != m_uploadHeight) {
+    const ParticleFormatInfo &info =
+        GetParticleFormatInfo(ParticleFormat::RG32F);
+    glDeleteTextures(1, &m_uploadTexture);
+    glGenTextures(1, &m_uploadTexture);
+    glBindTexture(GL_TEXTURE_2D, m_uploadTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, info.internalFormat, width, height, 0,
+                 info.format, info.type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    m_uploadWidth = width;
+    m_uploadHeight = height;
+  }
+  UploadParticles(ParticleFormat::RG32F, m_uploadTexture, width, height,
+                  frame.particles);
+
+  const bool velocityColoring = m_velocityColoring;
+  m_velocityColoring = false;
+  Render(particleViewport, pixelViewport, width, height, m_uploadTexture,
+         m_uploadTexture, frame.ensembleSize, member);
+  m_velocityColoring = velocityColoring;
+}
+
+ParticleRenderer::~ParticleRenderer() {
+  glDeleteVertexArrays(1, &m_vao);
+  glDeleteProgram(m_program);
+  glDeleteShader(m_vertShader);
+  glDeleteShader(m_fragShader);
+  glDeleteTextures(1, &m_uploadTexture);
+}
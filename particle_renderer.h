@@ -2,24 +2,77 @@
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
+#include <vector>
 
+#include "particle_storage.h"
+#include "spatial_index.h"
 #include "utils.h"
 
+struct ParticleFrame;
+
+// Draws particles as instanced sprites. When they far outnumber the pixels
+// of the panel a stratified subset is drawn instead, with alpha raised so the
+// panel looks the same, and the cost follows the panel size rather than the
+// particle count.
 class ParticleRenderer {
 public:
   ParticleRenderer();
+  ~ParticleRenderer();
+
+  // Must match the format of the particles texture passed to Render.
+  void SetParticleFormat(ParticleFormat format);
+  // Colors sprites by how far they moved in the last step, relative to
+  // `typicalStep` (e.g. the diffusion length sqrt(2 dt)).
+  void SetVelocityColoring(bool enabled, float typicalStep);
+  // Sprite diameter in pixels.
+  void SetSpriteSize(float pixels);
 
+  // Draws the particles of one ensemble member, or only `ranges` of them
+  // (see Simulation::VisibleRanges). `previousTexture` holds the positions
+  // one step earlier and is only read for velocity coloring.
   void Render(Viewport particleViewport, Viewport pixelViewport,
-              int particlesWidth, int particlesHeight, GLuint particlesTexture);
+              int particlesWidth, int particlesHeight, GLuint particlesTexture,
+              GLuint previousTexture, int ensembleSize, int member,
+              const std::vector<ParticleRange> *ranges = nullptr);
+  // Same, uploading the positions first; no velocity coloring.
+  void Render(Viewport particleViewport, Viewport pixelViewport,
+              const ParticleFrame &frame, int member);
+
+  // One in Stride() particles was drawn by the last Render.
+  int Stride();
 
 private:
+  void CreateProgram();
+  float DomainCoverage(Viewport particleViewport);
+  int ComputeStride(Viewport pixelViewport, float visible);
+
+private:
+  ParticleFormat m_particleFormat;
+  bool m_velocityColoring;
+  float m_typicalStep;
+  float m_spriteSize;
+  int m_stride;
+
   GLuint m_vao;
   GLuint m_vertShader;
   GLuint m_fragShader;
   GLuint m_program;
 
+  // RG32F copy of a ParticleFrame
+  GLuint m_uploadTexture;
+  int m_uploadWidth;
+  int m_uploadHeight;
+
   GLint m_particlesUniform;
+  GLint m_previousUniform;
   GLint m_particlesWidthUniform;
+  GLint m_firstUniform;
+  GLint m_countUniform;
+  GLint m_strideUniform;
   GLint m_minUniform;
   GLint m_maxUniform;
+  GLint m_spriteSizeUniform;
+  GLint m_alphaUniform;
+  GLint m_typicalStepUniform;
+  GLint m_roundUniform;
 };
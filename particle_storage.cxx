@@ -0,0 +1,179 @@
+#include "particle_storage.h"
+
+#include "particle_storage.glsl.h"
+#include "particle_store.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+static constexpr float kFixed16Step = 2.0f * kParticleBound / 65535.0f;
+
+static const ParticleFormatInfo kFormats[kNumParticleFormats] = {
+    {"RG32F", GL_RG32F, GL_RG, GL_FLOAT, 8, 5.96e-8f},
+    // Half floats have 11 significant bits; the error grows with |x| and is
+    // 2^-11 relative, i.e. ~1e-3 at the edge of the unit box.
+    {"RG16F", GL_RG16F, GL_RG, GL_FLOAT, 4, 4.88e-4f},
+    {"Fixed16", GL_RG16UI, GL_RG_INTEGER, GL_UNSIGNED_SHORT, 4, kFixed16Step},
+    {"RGBA8 packed", GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4, kFixed16Step},
+};
+
+static const char *kDefines[kNumParticleFormats] = {
+    "#define PARTICLES_RG32F\n",
+    "#define PARTICLES_RG16F\n",
+    "#define PARTICLES_FIXED16\n",
+    "#define PARTICLES_RGBA8\n",
+};
+
+// Same quantization as encode_particle without the stochastic rounding
+static uint16_t QuantizeFixed16(float x) {
+  const float q = (x + kParticleBound) / kFixed16Step;
+  return static_cast<uint16_t>(std::clamp(std::round(q), 0.0f, 65535.0f));
+}
+
+const ParticleFormatInfo &GetParticleFormatInfo(ParticleFormat format) {
+  return kFormats[static_cast<int>(format)];
+}
+
+std::string ParticleStoragePrelude(ParticleFormat format) {
+  return std::string(kDefines[static_cast<int>(format)]) +
+         std::string(reinterpret_cast<const char *>(ParticleStorageGlsl),
+                     ParticleStorageGlsl_len);
+}
+
+// Converts positions to the texel layout of `format`; get(i) returns the
+// position of particle i.
+template <typename Get>
+static void EncodeParticles(ParticleFormat format, size_t count, Get get,
+                            std::vector<uint8_t> &staging) {
+  if (format == ParticleFormat::Fixed16) {
+    staging.resize(2 * sizeof(uint16_t) * count);
+    uint16_t *fixed = reinterpret_cast<uint16_t *>(staging.data());
+    for (size_t i = 0; i < count; i++) {
+      const glm::vec2 p = get(i);
+      for (int c = 0; c < 2; c++)
+        fixed[2 * i + c] = QuantizeFixed16(p[c]);
+    }
+  } else if (format == ParticleFormat::RGBA8Packed) {
+    // (x high, x low, y high, y low), see decode_particle
+    staging.resize(4 * count);
+    uint8_t *bytes = staging.data();
+    for (size_t i = 0; i < count; i++) {
+      const glm::vec2 p = get(i);
+      for (int c = 0; c < 2; c++) {
+        const uint16_t q = QuantizeFixed16(p[c]);
+        bytes[4 * i + 2 * c] = static_cast<uint8_t>(q >> 8);
+        bytes[4 * i + 2 * c + 1] = static_cast<uint8_t>(q & 0xff);
+      }
+    }
+  } else {
+    staging.resize(sizeof(glm::vec2) * count);
+    glm::vec2 *positions = reinterpret_cast<glm::vec2 *>(staging.data());
+    for (size_t i = 0; i < count; i++)
+      positions[i] = get(i);
+  }
+}
+
+static void UploadTexels(ParticleFormat format, GLuint texture, size_t width,
+                         size_t height, const void *texels) {
+  const ParticleFormatInfo &info = GetParticleFormatInfo(format);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, info.format,
+                  info.type, texels);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void UploadParticles(ParticleFormat format, GLuint texture, size_t width,
+                     size_t height, const std::vector<glm::vec2> &particles) {
+  if (format == ParticleFormat::RG32F || format == ParticleFormat::RG16F) {
+    UploadTexels(format, texture, width, height, particles.data());
+    return;
+  }
+
+  std::vector<uint8_t> staging;
+  EncodeParticles(
+      format, width * height, [&](size_t i) { return particles[i]; },
+      staging);
+  UploadTexels(format, texture, width, height, staging.data());
+}
+
+void EncodeParticles(ParticleFormat format, const ParticleStore &particles,
+                     std::vector<uint8_t> &texels) {
+  const float *x = particles.X();
+  const float *y = particles.Y();
+  EncodeParticles(
+      format, particles.Size(), [&](size_t i) { return glm::vec2(x[i], y[i]); },
+      texels);
+}
+
+void UploadTexels(ParticleFormat format, GLuint texture, size_t width,
+                  size_t height, const std::vector<uint8_t> &texels) {
+  UploadTexels(format, texture, width, height, texels.data());
+}
+
+void ReadParticles(ParticleFormat format, GLuint fbo, size_t width,
+                   size_t height, std::vector<glm::vec2> &particles,
+                   size_t firstRow) {
+  particles.resize(width * height);
+
+  // RGBA reads are the combinations every GLES3 implementation supports
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  if (format == ParticleFormat::Fixed16) {
+    std::vector<uint32_t> texels(4 * width * height);
+    glReadPixels(0, firstRow, width, height, GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+                 texels.data());
+    for (size_t i = 0; i < width * height; i++) {
+      particles[i] = glm::vec2(texels[4 * i], texels[4 * i + 1]) *
+                         kFixed16Step -
+                     kParticleBound;
+    }
+  } else if (format == ParticleFormat::RGBA8Packed) {
+    std::vector<uint8_t> bytes(4 * width * height);
+    glReadPixels(0, firstRow, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+                 bytes.data());
+    for (size_t i = 0; i < width * height; i++) {
+      const glm::vec2 q(bytes[4 * i] * 256 + bytes[4 * i + 1],
+                        bytes[4 * i + 2] * 256 + bytes[4 * i + 3]);
+      particles[i] = q * kFixed16Step - kParticleBound;
+    }
+  } else {
+    std::vector<float> texels(4 * width * height);
+    glReadPixels(0, firstRow, width, height, GL_RGBA, GL_FLOAT, texels.data());
+    for (size_t i = 0; i < width * height; i++)
+      particles[i] = glm::vec2(texels[4 * i], texels[4 * i + 1]);
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+ParticleStorageReport
+CompareParticleStorage(const std::vector<glm::vec2> &reference,
+                       const std::vector<glm::vec2> &compact) {
+  if (reference.size() != compact.size() || reference.empty())
+    throw std::invalid_argument("Particle sets differ in size");
+
+  const double n = static_cast<double>(reference.size());
+  double sumSq = 0.0, maxError = 0.0;
+  glm::dvec2 sumRef(0.0), sumRefSq(0.0), sumCmp(0.0), sumCmpSq(0.0);
+  for (size_t i = 0; i < reference.size(); i++) {
+    const glm::dvec2 r(reference[i]);
+    const glm::dvec2 c(compact[i]);
+    const double e = glm::length(c - r);
+    sumSq += e * e;
+    maxError = std::max(maxError, e);
+    sumRef += r;
+    sumRefSq += r * r;
+    sumCmp += c;
+    sumCmpSq += c * c;
+  }
+
+  const glm::dvec2 meanRef = sumRef / n;
+  const glm::dvec2 meanCmp = sumCmp / n;
+  ParticleStorageReport report;
+  report.rmsError = std::sqrt(sumSq / n);
+  report.maxError = maxError;
+  report.meanError = meanCmp - meanRef;
+  report.varianceError =
+      (sumCmpSq / n - meanCmp * meanCmp) - (sumRefSq / n - meanRef * meanRef);
+  return report;
+}
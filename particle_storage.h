@@ -0,0 +1,73 @@
+#pragma once
+
+#ifdef EMSCRIPTEN
+#include <GLES3/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ParticleStore;
+
+// How particle positions are stored in the simulation textures.
+enum class ParticleFormat {
+  RG32F,   // 8 bytes per particle, the reference format
+  RG16F,   // 4 bytes, half floats with stochastic rounding
+  Fixed16, // 4 bytes, 16-bit fixed point over [-kParticleBound, kParticleBound]
+  RGBA8Packed, // 4 bytes, Fixed16 split into bytes; renderable everywhere
+};
+
+static constexpr int kNumParticleFormats = 4;
+
+// Half extent of the box fixed-point formats can represent. Particles leaving
+// the box are clamped to its border.
+static constexpr float kParticleBound = 4.0f;
+
+struct ParticleFormatInfo {
+  const char *name;
+  GLenum internalFormat;
+  GLenum format;
+  GLenum type;
+  size_t bytesPerParticle;
+  // Largest rounding error a single write can introduce near the origin
+  float resolution;
+};
+
+const ParticleFormatInfo &GetParticleFormatInfo(ParticleFormat format);
+
+// GLSL inserted after the #version line of every shader that reads or writes
+// particles; provides PARTICLE_SAMPLER, decode_particle and encode_particle.
+std::string ParticleStoragePrelude(ParticleFormat format);
+
+// Uploads positions into a texture allocated with the format's layout.
+void UploadParticles(ParticleFormat format, GLuint texture, size_t width,
+                     size_t height, const std::vector<glm::vec2> &particles);
+// Interleaves a store into the texel layout of `format`. Callers keep
+// `texels` to upload the same positions again without converting them.
+void EncodeParticles(ParticleFormat format, const ParticleStore &particles,
+                     std::vector<uint8_t> &texels);
+// Uploads texels from EncodeParticles into a texture of the same format.
+void UploadTexels(ParticleFormat format, GLuint texture, size_t width,
+                  size_t height, const std::vector<uint8_t> &texels);
+// Reads back positions from a framebuffer whose first color attachment holds
+// particles in the given format: `height` rows from `firstRow` on.
+void ReadParticles(ParticleFormat format, GLuint fbo, size_t width,
+                   size_t height, std::vector<glm::vec2> &particles,
+                   size_t firstRow = 0);
+
+// Deviation of a compact run from an RG32F run of the same ensemble.
+struct ParticleStorageReport {
+  double rmsError;
+  double maxError;
+  glm::dvec2 meanError;     // Difference of the ensemble means
+  glm::dvec2 varianceError; // Difference of the ensemble variances
+};
+
+ParticleStorageReport
+CompareParticleStorage(const std::vector<glm::vec2> &reference,
+                       const std::vector<glm::vec2> &compact);
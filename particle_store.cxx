@@ -0,0 +1,79 @@
+#include "particle_store.h"
+
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+static constexpr size_t kAlignment = 64;
+// Transparent huge page size on x86-64 and most arm64 kernels
+static constexpr size_t kHugePage = 2 << 20;
+
+static size_t RoundUp(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+ParticleStore::ParticleStore()
+    : m_arena(nullptr), m_arenaBytes(0), m_x(nullptr), m_y(nullptr),
+      m_width(0), m_height(0) {}
+
+ParticleStore::~ParticleStore() { FreeArena(); }
+
+void ParticleStore::Resize(size_t width, size_t height) {
+  const size_t arrayBytes = RoundUp(width * height * sizeof(float), kAlignment);
+  const size_t bytes = 2 * arrayBytes;
+
+  if (bytes > m_arenaBytes) {
+    FreeArena();
+#ifdef __linux__
+    const size_t mapped = RoundUp(bytes, kHugePage);
+    void *arena = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED)
+      throw std::bad_alloc();
+    // Only a hint; fails harmlessly where THP is disabled
+    madvise(arena, mapped, MADV_HUGEPAGE);
+#else
+    const size_t mapped = bytes;
+    void *arena = ::operator new(mapped, std::align_val_t(kAlignment));
+#endif
+    m_arena = arena;
+    m_arenaBytes = mapped;
+  }
+
+  m_x = static_cast<float *>(m_arena);
+  m_y = reinterpret_cast<float *>(static_cast<char *>(m_arena) + arrayBytes);
+  m_width = width;
+  m_height = height;
+}
+
+void ParticleStore::FreeArena() {
+  if (m_arena == nullptr)
+    return;
+#ifdef __linux__
+  munmap(m_arena, m_arenaBytes);
+#else
+  ::operator delete(m_arena, std::align_val_t(kAlignment));
+#endif
+  m_arena = nullptr;
+  m_arenaBytes = 0;
+}
+
+void ParticleStore::FillGrid(size_t firstRow, size_t endRow) {
+  for (size_t j = firstRow; j < endRow; j++) {
+    const float y = 2.0 * (static_cast<float>(j) / (m_height - 1.0)) - 1.0;
+    float *xs = m_x + j * m_width;
+    float *ys = m_y + j * m_width;
+    for (size_t i = 0; i < m_width; i++) {
+      xs[i] = 2.0 * (static_cast<float>(i) / (m_width - 1.0)) - 1.0;
+      ys[i] = y;
+    }
+  }
+}
+
+void ParticleStore::Read(std::vector<glm::vec2> &particles) const {
+  particles.resize(Size());
+  for (size_t i = 0; i < Size(); i++)
+    particles[i] = glm::vec2(m_x[i], m_y[i]);
+}
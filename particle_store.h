@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Particle positions as separate x and y arrays, each 64-byte aligned, in
+// the row-major order of the simulation textures: particle (i, j) is at
+// index j * width + i.
+//
+// Both arrays live in one arena. On Linux it is an anonymous mapping with
+// transparent huge pages requested; its pages are only touched by the first
+// write, see CpuSimulation::ResetParticles.
+class ParticleStore {
+public:
+  ParticleStore();
+  ~ParticleStore();
+
+  ParticleStore(const ParticleStore &) = delete;
+  ParticleStore &operator=(const ParticleStore &) = delete;
+
+  // Contents are unspecified afterwards.
+  void Resize(size_t width, size_t height);
+
+  // Sets rows [firstRow, endRow) to the initial grid over [-1, 1]^2.
+  void FillGrid(size_t firstRow, size_t endRow);
+  // Copies into interleaved positions.
+  void Read(std::vector<glm::vec2> &particles) const;
+
+  float *X() { return m_x; }
+  float *Y() { return m_y; }
+  const float *X() const { return m_x; }
+  const float *Y() const { return m_y; }
+
+  size_t Width() const { return m_width; }
+  size_t Height() const { return m_height; }
+  size_t Size() const { return m_width * m_height; }
+
+private:
+  void FreeArena();
+
+private:
+  void *m_arena;
+  size_t m_arenaBytes;
+  float *m_x;
+  float *m_y;
+  size_t m_width;
+  size_t m_height;
+};
@@ -0,0 +1,327 @@
+#include "recorder.h"
+
+#include "image_writer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#else
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+// Per wait on a readback fence; waits repeat until it signals
+static constexpr GLuint64 kFenceTimeoutNs = 100000000;
+
+Recorder::Recorder(const RecorderOptions &options)
+    : m_options(options), m_fbo(0), m_color(0), m_oldest(0), m_pending(0),
+      m_lastStep(0), m_hasCaptured(false), m_captured(0), m_pipe(nullptr),
+      m_ffmpeg(-1), m_stop(false), m_written(0) {
+  GLint maxSize = 0;
+  glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxSize);
+  if (options.width <= 0 || options.height <= 0 ||
+      options.width > maxSize || options.height > maxSize)
+    throw std::invalid_argument("Capture size must be between 1 and " +
+                                std::to_string(maxSize));
+  if (options.stepInterval < 1 || options.fps < 1)
+    throw std::invalid_argument("Step interval and fps must be positive");
+  if (options.path.empty())
+    throw std::invalid_argument("No output path given");
+  m_frameBytes = static_cast<size_t>(options.width) * options.height * 4;
+
+  if (options.output == RecorderOutput::PngSequence) {
+    std::filesystem::create_directories(options.path);
+  } else {
+    // yuv420p, which players expect, halves the chroma resolution
+    if (options.width % 2 != 0 || options.height % 2 != 0)
+      throw std::invalid_argument("Video sizes must be even");
+    StartFfmpeg();
+  }
+
+  glGenRenderbuffers(1, &m_color);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, options.width,
+                        options.height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &m_fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, m_color);
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    glDeleteFramebuffers(1, &m_fbo);
+    glDeleteRenderbuffers(1, &m_color);
+    CloseFfmpeg();
+    throw std::runtime_error("Error creating capture framebuffer");
+  }
+
+  for (Slot &slot : m_ring) {
+    glGenBuffers(1, &slot.pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, m_frameBytes, nullptr, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  m_thread = std::thread(&Recorder::Run, this);
+}
+
+Recorder::~Recorder() {
+  while (m_pending > 0)
+    Collect(true);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_one();
+  m_thread.join();
+  CloseFfmpeg();
+
+  for (Slot &slot : m_ring)
+    glDeleteBuffers(1, &slot.pbo);
+  glDeleteFramebuffers(1, &m_fbo);
+  glDeleteRenderbuffers(1, &m_color);
+}
+
+void Recorder::StartFfmpeg() {
+  const std::string size =
+      std::to_string(m_options.width) + "x" + std::to_string(m_options.height);
+  const std::string fps = std::to_string(m_options.fps);
+  // Frames arrive bottom-up, as glReadPixels returns them
+  const char *args[] = {"ffmpeg", "-loglevel", "error", "-y", "-f",
+                        "rawvideo", "-pixel_format", "rgba", "-video_size",
+                        size.c_str(), "-framerate", fps.c_str(), "-i", "-",
+                        "-vf", "vflip", "-pix_fmt", "yuv420p",
+                        m_options.path.c_str()};
+#ifdef _WIN32
+  // cmd.exe expands %VAR% even inside quotes
+  if (m_options.path.find_first_of("\"%") != std::string::npos)
+    throw std::invalid_argument("Video paths cannot contain \" or %");
+  std::string command;
+  for (const char *arg : args)
+    command += std::string(command.empty() ? "" : " ") + "\"" + arg + "\"";
+  m_pipe = popen(command.c_str(), "wb");
+  if (m_pipe == nullptr)
+    throw std::runtime_error("Cannot start ffmpeg: " +
+                             std::string(std::strerror(errno)));
+#else
+  // No shell, so the path reaches ffmpeg as typed
+  std::vector<char *> argv;
+  for (const char *arg : args)
+    argv.push_back(const_cast<char *>(arg));
+  argv.push_back(nullptr);
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    throw std::runtime_error("Cannot create pipe: " +
+                             std::string(std::strerror(errno)));
+  // ffmpeg must not inherit the write end, or it never sees the end of input
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+  pid_t pid;
+  const int error =
+      posix_spawnp(&pid, "ffmpeg", &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[0]);
+  if (error != 0) {
+    close(fds[1]);
+    throw std::runtime_error("Cannot start ffmpeg: " +
+                             std::string(std::strerror(error)));
+  }
+  m_ffmpeg = pid;
+  m_pipe = fdopen(fds[1], "w");
+  if (m_pipe == nullptr) {
+    close(fds[1]);
+    CloseFfmpeg();
+    throw std::runtime_error("Cannot open the pipe to ffmpeg");
+  }
+#endif
+}
+
+void Recorder::CloseFfmpeg() {
+  if (m_pipe != nullptr) {
+#ifdef _WIN32
+    pclose(m_pipe);
+#else
+    fclose(m_pipe);
+#endif
+    m_pipe = nullptr;
+  }
+#ifndef _WIN32
+  // Closing its input lets ffmpeg finish the file and exit
+  if (m_ffmpeg > 0)
+    waitpid(m_ffmpeg, nullptr, 0);
+  m_ffmpeg = -1;
+#endif
+}
+
+bool Recorder::Due(uint32_t step) {
+  const uint32_t interval = m_options.stepInterval;
+  return !m_hasCaptured || step / interval != m_lastStep / interval;
+}
+
+void Recorder::Bind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+  glViewport(0, 0, m_options.width, m_options.height);
+  glClearColor(0, 0, 0, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+}
+
+void Recorder::Capture(uint32_t step) {
+  m_lastStep = step;
+  m_hasCaptured = true;
+
+  // Only when readbacks take longer than kRingSize frames
+  if (m_pending == kRingSize)
+    Collect(true);
+
+  Slot &slot = m_ring[(m_oldest + m_pending) % kRingSize];
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, m_options.width, m_options.height, GL_RGBA,
+               GL_UNSIGNED_BYTE, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  m_pending++;
+  m_captured++;
+
+  // Earlier readbacks that completed meanwhile
+  while (m_pending > 0 && Collect(false)) {
+  }
+}
+
+bool Recorder::Collect(bool wait) {
+  Slot &slot = m_ring[m_oldest];
+  GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  while (wait && status == GL_TIMEOUT_EXPIRED) {
+    status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                              kFenceTimeoutNs);
+  }
+  if (status == GL_TIMEOUT_EXPIRED)
+    return false;
+  glDeleteSync(slot.fence);
+  slot.fence = nullptr;
+  if (status == GL_WAIT_FAILED) {
+    // The slot is dropped, the app stops recording on the error
+    Fail("Waiting for a frame readback failed");
+    m_oldest = (m_oldest + 1) % kRingSize;
+    m_pending--;
+    return true;
+  }
+
+  std::vector<uint8_t> frame;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_drained.wait(lock, [this] {
+      return m_queue.size() < kMaxQueued || !m_error.empty();
+    });
+    if (!m_free.empty()) {
+      frame = std::move(m_free.back());
+      m_free.pop_back();
+    }
+  }
+  frame.resize(m_frameBytes);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  const void *pixels =
+      glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, m_frameBytes, GL_MAP_READ_BIT);
+  if (pixels != nullptr) {
+    std::memcpy(frame.data(), pixels, m_frameBytes);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    Fail("Cannot map a frame readback");
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error.empty())
+      m_queue.push_back(std::move(frame));
+  }
+  m_wake.notify_one();
+
+  m_oldest = (m_oldest + 1) % kRingSize;
+  m_pending--;
+  return true;
+}
+
+void Recorder::Run() {
+  for (;;) {
+    std::vector<uint8_t> frame;
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+      if (m_queue.empty())
+        return;
+      frame = std::move(m_queue.front());
+      m_queue.pop_front();
+      index = m_written;
+    }
+
+    try {
+      Write(frame, index);
+    } catch (const std::exception &e) {
+      Fail(e.what());
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_written++;
+      m_free.push_back(std::move(frame));
+    }
+    m_drained.notify_all();
+  }
+}
+
+void Recorder::Fail(const std::string &error) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error.empty())
+      m_error = error;
+    m_queue.clear();
+  }
+  m_drained.notify_all();
+}
+
+void Recorder::Write(const std::vector<uint8_t> &frame, int index) {
+  if (m_options.output == RecorderOutput::PngSequence) {
+    char name[32];
+    snprintf(name, sizeof(name), "frame_%06d.png", index);
+    WritePng((std::filesystem::path(m_options.path) / name).string(),
+             m_options.width, m_options.height, frame.data());
+  } else if (fwrite(frame.data(), 1, frame.size(), m_pipe) != frame.size()) {
+    throw std::runtime_error("ffmpeg stopped accepting frames");
+  }
+}
+
+const RecorderOptions &Recorder::Options() { return m_options; }
+
+int Recorder::FramesCaptured() { return m_captured; }
+
+int Recorder::FramesWritten() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_written;
+}
+
+std::string Recorder::Error() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_error;
+}
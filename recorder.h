@@ -0,0 +1,112 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class RecorderOutput { PngSequence, Ffmpeg };
+
+struct RecorderOptions {
+  RecorderOutput output = RecorderOutput::PngSequence;
+  // PngSequence: directory for frame_000000.png, ...; created if missing.
+  // Ffmpeg: the video file, its container picked by ffmpeg from the name.
+  std::string path;
+  // Capture size, independent of the window
+  int width = 1920;
+  int height = 1080;
+  // Captures when the simulation step reaches a multiple of this
+  int stepInterval = 1;
+  // Ffmpeg only
+  int fps = 30;
+};
+
+// Records frames rendered into its own framebuffer. Frames are read back
+// through a ring of pixel buffers, so the render loop never waits for the
+// GPU, and encoded on a writer thread: PNG files, or raw RGBA piped into a
+// local ffmpeg process. When the writer falls behind by kMaxQueued frames
+// Capture waits for it rather than dropping frames.
+//
+// Desktop only: the web build has neither files nor processes. On POSIX the
+// process must ignore SIGPIPE, or an ffmpeg that exits early kills it.
+class Recorder {
+public:
+  // Throws std::invalid_argument for bad options and std::runtime_error when
+  // the output cannot be opened.
+  explicit Recorder(const RecorderOptions &options);
+  // Writes every captured frame before returning.
+  ~Recorder();
+
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Whether `step` crossed a multiple of the step interval since the last
+  // captured frame. Frames published by the CPU simulation can skip steps.
+  bool Due(uint32_t step);
+  // Binds the capture framebuffer, cleared, as the draw framebuffer.
+  void Bind();
+  // Reads back what was rendered since Bind and rebinds framebuffer 0.
+  void Capture(uint32_t step);
+
+  const RecorderOptions &Options();
+  int FramesCaptured();
+  int FramesWritten();
+  // The writer's first error, after which it stops; empty if none.
+  std::string Error();
+
+private:
+  struct Slot {
+    GLuint pbo = 0;
+    GLsync fence = nullptr;
+  };
+  static constexpr int kRingSize = 3;
+  static constexpr size_t kMaxQueued = 8;
+
+  // Hands the oldest pending readback to the writer, waiting for it if
+  // `wait`. Returns false if it is not ready.
+  bool Collect(bool wait);
+  // Starts ffmpeg reading raw frames from m_pipe. Throws like the
+  // constructor.
+  void StartFfmpeg();
+  // Closes m_pipe and waits for ffmpeg to exit.
+  void CloseFfmpeg();
+  void Run();
+  // Keeps the first error and drops the queued frames.
+  void Fail(const std::string &error);
+  void Write(const std::vector<uint8_t> &frame, int index);
+
+private:
+  RecorderOptions m_options;
+  size_t m_frameBytes;
+
+  GLuint m_fbo;
+  GLuint m_color;
+  Slot m_ring[kRingSize];
+  // Ring slots are used in order; m_pending of them, starting at m_oldest,
+  // hold readbacks not yet collected
+  int m_oldest;
+  int m_pending;
+  uint32_t m_lastStep;
+  bool m_hasCaptured;
+  int m_captured;
+
+  FILE *m_pipe;
+  // ffmpeg's process id, -1 without one; unused on Windows, which popens it
+  int m_ffmpeg;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_drained;
+  std::deque<std::vector<uint8_t>> m_queue;
+  // Buffers handed back by the writer, reused for later frames
+  std::vector<std::vector<uint8_t>> m_free;
+  bool m_stop;
+  int m_written;
+  std::string m_error;
+  std::thread m_thread;
+};
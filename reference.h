@@ -0,0 +1,168 @@
+#pragma once
+
+// CPU reference of the math in the shaders, bit-compatible where the shaders
+// use integer arithmetic (the random number generator) and following the
+// same formulas where they use floating point. Used to validate the GPU
+// passes and by CpuSimulation.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "mixture.h"
+#include "utils.h"
+
+// Box-Muller transform of two uniforms in [0, 1), as sample_gaussian in
+// simulation.frag
+inline glm::vec2 ReferenceGaussian(float ux, float uy) {
+  const float a = std::sqrt(-2.0f * std::log(1.0f - ux));
+  const float b = 6.283185307179586f * uy;
+  return glm::vec2(std::cos(b), std::sin(b)) * a;
+}
+
+// Mirrors the generator in simulation.frag
+struct ReferenceRng {
+  uint32_t state = 0;
+
+  static uint32_t MurmurHash3Mix(uint32_t hash, uint32_t k) {
+    k *= 0xcc9e2d51u;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593u;
+
+    hash ^= k;
+    hash = ((hash << 13) | (hash >> 19)) * 5u + 0xe6546b64u;
+    return hash;
+  }
+
+  static uint32_t MurmurHash3Finalize(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+  }
+
+  // Seed of the particle at texel (x, y) of a `width` wide particle texture
+  void Seed(uint32_t x, uint32_t y, uint32_t width, uint32_t frameId,
+            uint32_t memberSeed) {
+    state = MurmurHash3Mix(0u, x + y * width);
+    state = MurmurHash3Mix(state, frameId);
+    state = MurmurHash3Mix(state, memberSeed);
+    state = MurmurHash3Finalize(state);
+  }
+
+  uint32_t Next() {
+    state = state * 1664525u + 1013904223u;
+    return state;
+  }
+
+  // Top 24 bits scaled by 2^-24, exactly like ldexp in lcg_randomf
+  float NextFloat() {
+    return static_cast<float>(Next() >> 8) * (1.0f / 16777216.0f);
+  }
+
+  glm::vec2 NextGaussian() {
+    const float ux = NextFloat();
+    const float uy = NextFloat();
+    return ReferenceGaussian(ux, uy);
+  }
+};
+
+// One Euler-Maruyama step of the particle at texel (x, y), as simulation.frag
+// computes it for RG32F storage. `density` is a mixture or one of the
+// densities in target.h.
+template <typename Density>
+inline glm::vec2 ReferenceStep(const Density &density, float dt,
+                               glm::vec2 pos, uint32_t x, uint32_t y,
+                               uint32_t width, uint32_t frameId,
+                               uint32_t memberSeed) {
+  ReferenceRng rng;
+  rng.Seed(x, y, width, frameId, memberSeed);
+  const glm::vec2 w = rng.NextGaussian();
+  return pos + dt * density.Score(pos) + std::sqrt(2.0f * dt) * w;
+}
+
+// Bins particles like the accumulator pass: a 1px point lands in the pixel
+// containing its window position.
+inline void ReferenceHistogram(const glm::vec2 *particles, size_t count,
+                               Viewport viewport, int width, int height,
+                               std::vector<float> &counts) {
+  counts.assign(static_cast<size_t>(width) * height, 0.0f);
+  for (size_t i = 0; i < count; i++) {
+    const glm::vec2 &p = particles[i];
+    const glm::vec2 ndc =
+        2.0f * (p - viewport.pmin) / (viewport.pmax - viewport.pmin) - 1.0f;
+    const float wx = (ndc.x + 1.0f) * 0.5f * width;
+    const float wy = (ndc.y + 1.0f) * 0.5f * height;
+    if (!(wx >= 0.0f && wx < width && wy >= 0.0f && wy < height))
+      continue;
+    counts[static_cast<size_t>(wy) * width + static_cast<size_t>(wx)] += 1.0f;
+  }
+}
+
+inline void ReferenceHistogram(const std::vector<glm::vec2> &particles,
+                               Viewport viewport, int width, int height,
+                               std::vector<float> &counts) {
+  ReferenceHistogram(particles.data(), particles.size(), viewport, width,
+                     height, counts);
+}
+
+// The particles of `particles` the accumulator pass draws with a stride, see
+// EstimatedDistributionRenderer::SetAccumulationStride: one per run of
+// `stride`, at an offset hashed from the run.
+inline void ReferenceStridedSubset(const std::vector<glm::vec2> &particles,
+                                   int stride, std::vector<glm::vec2> &subset) {
+  subset.clear();
+  for (size_t run = 0; run * stride < particles.size(); run++) {
+    const size_t index =
+        run * stride + ReferenceRng::MurmurHash3Finalize(
+                           static_cast<uint32_t>(run)) % stride;
+    if (index < particles.size())
+      subset.push_back(particles[index]);
+  }
+}
+
+// Bounds of the accumulator histogram allowing for the rasterizer snapping
+// window positions to its subpixel grid: a particle within `snap` pixels of a
+// bin edge may be counted on either side of it.
+inline void ReferenceHistogramBounds(const std::vector<glm::vec2> &particles,
+                                     Viewport viewport, int width, int height,
+                                     float snap, std::vector<float> &lower,
+                                     std::vector<float> &upper) {
+  lower.assign(static_cast<size_t>(width) * height, 0.0f);
+  upper.assign(static_cast<size_t>(width) * height, 0.0f);
+  for (const glm::vec2 &p : particles) {
+    const glm::vec2 ndc =
+        2.0f * (p - viewport.pmin) / (viewport.pmax - viewport.pmin) - 1.0f;
+    const float wx = (ndc.x + 1.0f) * 0.5f * width;
+    const float wy = (ndc.y + 1.0f) * 0.5f * height;
+
+    const int x0 = static_cast<int>(std::floor(wx - snap));
+    const int x1 = static_cast<int>(std::floor(wx + snap));
+    const int y0 = static_cast<int>(std::floor(wy - snap));
+    const int y1 = static_cast<int>(std::floor(wy + snap));
+    for (int y = std::max(y0, 0); y <= std::min(y1, height - 1); y++) {
+      for (int x = std::max(x0, 0); x <= std::min(x1, width - 1); x++)
+        upper[static_cast<size_t>(y) * width + x] += 1.0f;
+    }
+    if (x0 == x1 && y0 == y1 && x0 >= 0 && x0 < width && y0 >= 0 &&
+        y0 < height)
+      lower[static_cast<size_t>(y0) * width + x0] += 1.0f;
+  }
+}
+
+// The colormap shared by distribution.frag and estimated_distribution.frag
+inline glm::vec3 ReferenceColormap(float x) {
+  x = std::min(std::max(x, 0.0f), 1.0f);
+  const float x2 = x * x, x3 = x2 * x, x4 = x2 * x2, x5 = x4 * x;
+  const float r = 0.13572138f + 4.61539260f * x - 42.66032258f * x2 +
+                  132.13108234f * x3 - 152.94239396f * x4 + 59.28637943f * x5;
+  const float g = 0.09140261f + 2.19418839f * x + 4.84296658f * x2 -
+                  14.18503333f * x3 + 4.27729857f * x4 + 2.82956604f * x5;
+  const float b = 0.10667330f + 12.64194608f * x - 60.58204836f * x2 +
+                  110.36276771f * x3 - 89.90310912f * x4 + 27.34824973f * x5;
+  return glm::vec3(r, g, b);
+}
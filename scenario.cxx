@@ -0,0 +1,487 @@
+#include "scenario.h"
+
+#include "utils.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+static constexpr int kMaxComponents =
+    static_cast<int>(sizeof(MixtureOfGaussians::g) / sizeof(Gaussian));
+// Beyond any texture size limit; keeps a typo from allocating gigabytes
+static constexpr size_t kMaxParticlesSide = 16384;
+// Grid targets are written out in the file, so they stay small
+static constexpr long long kMaxGridSide = 1024;
+// Target::params in order, see target.h
+static const char *const kRosenbrockParams[] = {"a", "b", "c"};
+static const char *const kDoubleWellParams[] = {"w", "h", "s"};
+
+namespace {
+
+struct JsonValue {
+  enum Type { Null, Bool, Number, String, Array, Object };
+
+  Type type = Null;
+  bool boolean = false;
+  double number = 0.0;
+  std::string string;
+  std::vector<JsonValue> array;
+  // In file order, so errors list fields as written
+  std::vector<std::pair<std::string, JsonValue>> object;
+};
+
+// Recursive descent over the whole of RFC 8259 except \u escapes beyond
+// ASCII, which scenario files have no use for.
+class JsonParser {
+public:
+  explicit JsonParser(const std::string &text)
+      : m_text(text), m_pos(0), m_line(1) {}
+
+  JsonValue Parse() {
+    JsonValue value = ParseValue(0);
+    SkipSpace();
+    if (m_pos != m_text.size())
+      Fail("trailing characters");
+    return value;
+  }
+
+private:
+  // Scenario files nest three levels; this only guards the stack
+  static constexpr int kMaxDepth = 64;
+
+  [[noreturn]] void Fail(const char *what) {
+    char message[128];
+    snprintf(message, sizeof(message), "line %d: %s", m_line, what);
+    throw std::runtime_error(message);
+  }
+
+  void SkipSpace() {
+    while (m_pos < m_text.size()) {
+      const char c = m_text[m_pos];
+      if (c == '\n')
+        m_line++;
+      else if (c != ' ' && c != '\t' && c != '\r')
+        return;
+      m_pos++;
+    }
+  }
+
+  bool Consume(char c) {
+    SkipSpace();
+    if (m_pos < m_text.size() && m_text[m_pos] == c) {
+      m_pos++;
+      return true;
+    }
+    return false;
+  }
+
+  void Expect(char c) {
+    if (!Consume(c)) {
+      char what[32];
+      snprintf(what, sizeof(what), "expected '%c'", c);
+      Fail(what);
+    }
+  }
+
+  bool ConsumeWord(const char *word) {
+    const size_t n = strlen(word);
+    if (m_text.compare(m_pos, n, word) != 0)
+      return false;
+    m_pos += n;
+    return true;
+  }
+
+  JsonValue ParseValue(int depth) {
+    if (depth > kMaxDepth)
+      Fail("nested too deeply");
+
+    SkipSpace();
+    if (m_pos >= m_text.size())
+      Fail("unexpected end of file");
+
+    JsonValue value;
+    const char c = m_text[m_pos];
+    if (c == '{') {
+      m_pos++;
+      value.type = JsonValue::Object;
+      if (Consume('}'))
+        return value;
+      do {
+        SkipSpace();
+        if (m_pos >= m_text.size() || m_text[m_pos] != '"')
+          Fail("expected a field name");
+        std::string key = ParseString();
+        Expect(':');
+        value.object.emplace_back(std::move(key), ParseValue(depth + 1));
+      } while (Consume(','));
+      Expect('}');
+    } else if (c == '[') {
+      m_pos++;
+      value.type = JsonValue::Array;
+      if (Consume(']'))
+        return value;
+      do {
+        value.array.push_back(ParseValue(depth + 1));
+      } while (Consume(','));
+      Expect(']');
+    } else if (c == '"') {
+      value.type = JsonValue::String;
+      value.string = ParseString();
+    } else if (ConsumeWord("true")) {
+      value.type = JsonValue::Bool;
+      value.boolean = true;
+    } else if (ConsumeWord("false")) {
+      value.type = JsonValue::Bool;
+    } else if (ConsumeWord("null")) {
+      value.type = JsonValue::Null;
+    } else {
+      value.type = JsonValue::Number;
+      const char *begin = m_text.c_str() + m_pos;
+      char *end;
+      value.number = strtod(begin, &end);
+      if (end == begin)
+        Fail("expected a value");
+      m_pos += end - begin;
+    }
+    return value;
+  }
+
+  std::string ParseString() {
+    m_pos++; // Opening quote
+    std::string s;
+    for (;;) {
+      if (m_pos >= m_text.size())
+        Fail("unterminated string");
+      const char c = m_text[m_pos++];
+      if (c == '"')
+        return s;
+      if (c == '\n')
+        Fail("newline in string");
+      if (c != '\\') {
+        s += c;
+        continue;
+      }
+      if (m_pos >= m_text.size())
+        Fail("unterminated string");
+      const char e = m_text[m_pos++];
+      switch (e) {
+      case 'n':
+        s += '\n';
+        break;
+      case 't':
+        s += '\t';
+        break;
+      case 'r':
+        s += '\r';
+        break;
+      case 'b':
+        s += '\b';
+        break;
+      case 'f':
+        s += '\f';
+        break;
+      case 'u': {
+        if (m_pos + 4 > m_text.size())
+          Fail("bad \\u escape");
+        const unsigned code =
+            strtoul(m_text.substr(m_pos, 4).c_str(), nullptr, 16);
+        if (code > 0x7f)
+          Fail("only ASCII \\u escapes are supported");
+        s += static_cast<char>(code);
+        m_pos += 4;
+        break;
+      }
+      default:
+        s += e; // \" \\ \/
+      }
+    }
+  }
+
+private:
+  const std::string &m_text;
+  size_t m_pos;
+  int m_line;
+};
+
+[[noreturn]] void FieldError(const std::string &field, const char *what) {
+  throw std::runtime_error(field + ": " + what);
+}
+
+double GetNumber(const JsonValue &v, const std::string &field) {
+  if (v.type != JsonValue::Number)
+    FieldError(field, "expected a number");
+  return v.number;
+}
+
+double GetPositive(const JsonValue &v, const std::string &field) {
+  const double x = GetNumber(v, field);
+  if (!(x > 0.0) || !std::isfinite(x))
+    FieldError(field, "must be positive");
+  return x;
+}
+
+long long GetInteger(const JsonValue &v, const std::string &field,
+                     long long min, long long max) {
+  const double x = GetNumber(v, field);
+  if (x != std::floor(x) || x < min || x > max) {
+    char what[96];
+    snprintf(what, sizeof(what), "expected an integer in [%lld, %lld]", min,
+             max);
+    FieldError(field, what);
+  }
+  return static_cast<long long>(x);
+}
+
+glm::vec2 GetVec2(const JsonValue &v, const std::string &field) {
+  if (v.type != JsonValue::Array || v.array.size() != 2)
+    FieldError(field, "expected [x, y]");
+  return glm::vec2(GetNumber(v.array[0], field + "[0]"),
+                   GetNumber(v.array[1], field + "[1]"));
+}
+
+const JsonValue &GetObject(const JsonValue &v, const std::string &field) {
+  if (v.type != JsonValue::Object)
+    FieldError(field, "expected an object");
+  return v;
+}
+
+void UnknownField(const std::string &field) {
+  FieldError(field, "unknown field");
+}
+
+void ParseMixture(const JsonValue &v, MixtureOfGaussians &mixture) {
+  if (v.type != JsonValue::Array || v.array.empty())
+    FieldError("mixture", "expected a non-empty array of components");
+  if (v.array.size() > static_cast<size_t>(kMaxComponents)) {
+    char what[64];
+    snprintf(what, sizeof(what), "at most %d components", kMaxComponents);
+    FieldError("mixture", what);
+  }
+
+  mixture = {};
+  mixture.count = static_cast<int>(v.array.size());
+  double weight = -1.0;
+  for (size_t i = 0; i < v.array.size(); i++) {
+    const std::string prefix = "mixture[" + std::to_string(i) + "]";
+    Gaussian &g = mixture.g[i];
+    bool hasMean = false, hasSigma = false;
+    for (const auto &[key, value] : GetObject(v.array[i], prefix).object) {
+      const std::string field = prefix + "." + key;
+      if (key == "mean") {
+        g.mean = GetVec2(value, field);
+        hasMean = true;
+      } else if (key == "sigma") {
+        if (value.type == JsonValue::Number) {
+          g.sigma = glm::vec2(GetPositive(value, field));
+        } else {
+          g.sigma = GetVec2(value, field);
+          if (!(g.sigma.x > 0.0f && g.sigma.y > 0.0f))
+            FieldError(field, "must be positive");
+        }
+        hasSigma = true;
+      } else if (key == "weight") {
+        const double w = GetPositive(value, field);
+        if (weight >= 0.0 && w != weight)
+          FieldError(field, "components are equally weighted");
+        weight = w;
+      } else {
+        UnknownField(field);
+      }
+    }
+    if (!hasMean || !hasSigma)
+      FieldError(prefix, "needs a mean and a sigma");
+  }
+}
+
+// Fields other than "type" are parameters of the kind, defaulting to those of
+// RosenbrockTarget and DoubleWellTarget.
+Target ParseTarget(const JsonValue &v) {
+  const JsonValue &object = GetObject(v, "target");
+  const JsonValue *type = nullptr;
+  for (const auto &[key, value] : object.object) {
+    if (key == "type")
+      type = &value;
+  }
+  if (type == nullptr || type->type != JsonValue::String)
+    FieldError("target.type", "expected a string");
+
+  if (type->string == "mixture") {
+    for (const auto &[key, value] : object.object) {
+      if (key != "type")
+        UnknownField("target." + key);
+    }
+    return Target();
+  }
+
+  if (type->string == "rosenbrock" || type->string == "double-well") {
+    const bool rosenbrock = type->string == "rosenbrock";
+    const Target defaults =
+        rosenbrock ? RosenbrockTarget() : DoubleWellTarget();
+    const char *const *names =
+        rosenbrock ? kRosenbrockParams : kDoubleWellParams;
+    float params[3] = {defaults.params.x, defaults.params.y, defaults.params.z};
+    for (const auto &[key, value] : object.object) {
+      const std::string field = "target." + key;
+      int i = 0;
+      while (i < 3 && key != names[i])
+        i++;
+      if (i < 3)
+        params[i] = static_cast<float>(GetPositive(value, field));
+      else if (key != "type")
+        UnknownField(field);
+    }
+    return rosenbrock ? RosenbrockTarget(params[0], params[1], params[2])
+                      : DoubleWellTarget(params[0], params[1], params[2]);
+  }
+
+  if (type->string == "grid") {
+    long long width = 0, height = 0;
+    glm::vec2 min(0.0f), max(0.0f);
+    bool hasMin = false, hasMax = false;
+    const JsonValue *values = nullptr;
+    for (const auto &[key, value] : object.object) {
+      const std::string field = "target." + key;
+      if (key == "size") {
+        if (value.type != JsonValue::Array || value.array.size() != 2)
+          FieldError(field, "expected [width, height]");
+        width = GetInteger(value.array[0], field + "[0]", 2, kMaxGridSide);
+        height = GetInteger(value.array[1], field + "[1]", 2, kMaxGridSide);
+      } else if (key == "min") {
+        min = GetVec2(value, field);
+        hasMin = true;
+      } else if (key == "max") {
+        max = GetVec2(value, field);
+        hasMax = true;
+      } else if (key == "log_density") {
+        values = &value;
+      } else if (key != "type") {
+        UnknownField(field);
+      }
+    }
+    if (width == 0 || !hasMin || !hasMax || values == nullptr)
+      FieldError("target", "a grid needs a size, min, max and log_density");
+    if (values->type != JsonValue::Array ||
+        values->array.size() != static_cast<size_t>(width * height))
+      FieldError("target.log_density", "expected width * height numbers");
+
+    std::vector<float> logDensity(values->array.size());
+    for (size_t i = 0; i < logDensity.size(); i++) {
+      logDensity[i] = static_cast<float>(GetNumber(
+          values->array[i], "target.log_density[" + std::to_string(i) + "]"));
+    }
+    try {
+      return GridTarget(static_cast<int>(width), static_cast<int>(height), min,
+                        max, std::move(logDensity));
+    } catch (const std::invalid_argument &e) {
+      FieldError("target", e.what());
+    }
+  }
+
+  FieldError("target.type",
+             "expected \"mixture\", \"rosenbrock\", \"double-well\" or "
+             "\"grid\"");
+}
+
+} // namespace
+
+Scenario DefaultScenario() {
+  Scenario s;
+  s.mixture = {};
+  s.mixture.count = 4;
+  s.mixture.g[0] = Gaussian{glm::vec2(-0.5f, -0.5f), glm::vec2(0.1f, 0.1f)};
+  s.mixture.g[1] = Gaussian{glm::vec2(0.5f, 0.5f), glm::vec2(0.1f, 0.1f)};
+  s.mixture.g[2] = Gaussian{glm::vec2(-0.5f, 0.5f), glm::vec2(0.1f, 0.1f)};
+  s.mixture.g[3] = Gaussian{glm::vec2(0.5f, -0.5f), glm::vec2(0.1f, 0.1f)};
+  s.mixture.UpdatePeak();
+  s.dt = 0.00004f;
+  s.ensembleSize = 1;
+  s.dtSpread = 2.0f;
+  s.seed = 0;
+  s.particlesWidth = 0;
+  s.particlesHeight = 0;
+  s.viewCenter = glm::vec2(0.0f, 0.0f);
+  s.viewScale = 1.0f;
+  s.target = Target();
+  return s;
+}
+
+Scenario ParseScenario(const std::string &text) {
+  const JsonValue root = JsonParser(text).Parse();
+  if (root.type != JsonValue::Object)
+    throw std::runtime_error("a scenario must be a JSON object");
+
+  Scenario s = DefaultScenario();
+  for (const auto &[key, value] : root.object) {
+    if (key == "mixture") {
+      ParseMixture(value, s.mixture);
+      s.mixture.UpdatePeak();
+    } else if (key == "dt") {
+      s.dt = static_cast<float>(GetPositive(value, key));
+    } else if (key == "ensemble") {
+      for (const auto &[k, v] : GetObject(value, key).object) {
+        const std::string field = key + "." + k;
+        if (k == "members")
+          s.ensembleSize =
+              static_cast<int>(GetInteger(v, field, 1, kMaxEnsembleMembers));
+        else if (k == "dt_spread")
+          s.dtSpread = static_cast<float>(GetPositive(v, field));
+        else
+          UnknownField(field);
+      }
+    } else if (key == "seed") {
+      s.seed = static_cast<uint32_t>(GetInteger(value, key, 0, UINT32_MAX));
+    } else if (key == "particles") {
+      if (value.type != JsonValue::Array || value.array.size() != 2)
+        FieldError(key, "expected [width, height]");
+      // The initial grid needs two particles per side
+      s.particlesWidth = GetInteger(value.array[0], key + "[0]", 2,
+                                    static_cast<long long>(kMaxParticlesSide));
+      s.particlesHeight = GetInteger(value.array[1], key + "[1]", 2,
+                                     static_cast<long long>(kMaxParticlesSide));
+    } else if (key == "integrator") {
+      if (value.type != JsonValue::String)
+        FieldError(key, "expected a string");
+      // The only scheme of simulation.frag and CpuSimulation
+      if (value.string != "euler-maruyama")
+        FieldError(key, "only \"euler-maruyama\" is implemented");
+    } else if (key == "target") {
+      s.target = ParseTarget(value);
+    } else if (key == "view") {
+      for (const auto &[k, v] : GetObject(value, key).object) {
+        const std::string field = key + "." + k;
+        if (k == "center")
+          s.viewCenter = GetVec2(v, field);
+        else if (k == "scale")
+          s.viewScale = static_cast<float>(GetPositive(v, field));
+        else
+          UnknownField(field);
+      }
+    } else {
+      UnknownField(key);
+    }
+  }
+  return s;
+}
+
+Scenario LoadScenario(const std::string &path) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr)
+    throw std::runtime_error("cannot open " + path);
+
+  std::string text;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    text.append(buffer, n);
+  fclose(file);
+
+  try {
+    return ParseScenario(text);
+  } catch (const std::runtime_error &e) {
+    throw std::runtime_error(path + ": " + e.what());
+  }
+}
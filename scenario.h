@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <string>
+
+#include "mixture.h"
+#include "target.h"
+
+// Everything a scenario file sets. A file is a JSON object; fields it omits
+// keep the values of DefaultScenario():
+//
+//   {
+//     "mixture": [{"mean": [-0.5, -0.5], "sigma": [0.1, 0.1]}, ...],
+//     "dt": 4e-5,
+//     "ensemble": {"members": 1, "dt_spread": 2},
+//     "seed": 0,
+//     "particles": [1920, 1080],
+//     "integrator": "euler-maruyama",
+//     "target": {"type": "mixture"},
+//     "view": {"center": [0, 0], "scale": 1}
+//   }
+//
+// "sigma" may also be a single number. Components are equally weighted, so a
+// "weight" is accepted only if all components give the same one.
+//
+// Other targets, see target.h, replace the mixture:
+//
+//   {"type": "rosenbrock", "a": 0.4, "b": 5, "c": 0.1}
+//   {"type": "double-well", "w": 0.5, "h": 4, "s": 0.2}
+//   {"type": "grid", "size": [w, h], "min": [x, y], "max": [x, y],
+//    "log_density": [w * h values, row-major from min]}
+struct Scenario {
+  MixtureOfGaussians mixture;
+  float dt;
+  int ensembleSize;
+  float dtSpread;
+  // Seed of the first ensemble member; member k uses seed + k
+  uint32_t seed;
+  // Particle grid, 0 x 0 for the backend's default
+  size_t particlesWidth;
+  size_t particlesHeight;
+  glm::vec2 viewCenter;
+  float viewScale;
+  Target target;
+};
+
+Scenario DefaultScenario();
+// Throws std::runtime_error naming the line or field at fault.
+Scenario ParseScenario(const std::string &text);
+Scenario LoadScenario(const std::string &path);
@@ -0,0 +1,135 @@
+#include "score_table.h"
+
+#include "capabilities.h"
+
+#include <cmath>
+#include <stdexcept>
+
+// PARTICLE_BOUND in particle_storage.glsl
+static constexpr float kBound = 4.0f;
+// The box covers every component this many standard deviations out, and
+// the initial particle grid over [-1, 1]^2
+static constexpr float kBoxSigmas = 6.0f;
+// Node spacing across the narrowest component
+static constexpr float kNodesPerSigma = 4.0f;
+static constexpr int kMinSize = 16;
+// Cell centers probed per side for the error estimate
+static constexpr int kErrorProbes = 128;
+// Largest finite half float
+static constexpr float kHalfMax = 65504.0f;
+
+static void Box(const MixtureOfGaussians &mixture, glm::vec2 &min,
+                glm::vec2 &max) {
+  min = glm::vec2(-1.0f);
+  max = glm::vec2(1.0f);
+  for (int i = 0; i < mixture.count; i++) {
+    const Gaussian &g = mixture.g[i];
+    min = glm::min(min, g.mean - kBoxSigmas * g.sigma);
+    max = glm::max(max, g.mean + kBoxSigmas * g.sigma);
+  }
+  min = glm::max(min, glm::vec2(-kBound));
+  max = glm::min(max, glm::vec2(kBound));
+}
+
+static float MinSigma(const MixtureOfGaussians &mixture) {
+  float sigma = INFINITY;
+  for (int i = 0; i < mixture.count; i++)
+    sigma = std::min({sigma, mixture.g[i].sigma.x, mixture.g[i].sigma.y});
+  return sigma;
+}
+
+// Round to nearest with the 11 significant bits of a half float
+static float RoundToHalf(float x) {
+  x = glm::clamp(x, -kHalfMax, kHalfMax);
+  if (x == 0.0f)
+    return x;
+  int e;
+  const float m = std::frexp(x, &e);
+  return std::ldexp(std::round(std::ldexp(m, 11)), e - 11);
+}
+
+GLenum ScoreTableFormat() {
+  return GetCapabilities().floatLinear ? GL_RG32F : GL_RG16F;
+}
+
+int ScoreTableSize(const std::vector<MixtureOfGaussians> &mixtures,
+                   int maxSize) {
+  int size = kMinSize;
+  for (const MixtureOfGaussians &mixture : mixtures) {
+    if (mixture.count <= 0)
+      continue;
+    glm::vec2 min, max;
+    Box(mixture, min, max);
+    const float extent = std::max(max.x - min.x, max.y - min.y);
+    const float cells = std::ceil(extent * kNodesPerSigma / MinSigma(mixture));
+    size = std::max(size, static_cast<int>(std::min(cells, 1e6f)) + 1);
+  }
+  return std::min(size, maxSize);
+}
+
+ScoreTable TabulateScore(const MixtureOfGaussians &mixture, int size,
+                         GLenum format) {
+  if (size < 2)
+    throw std::invalid_argument("Score tables need at least 2 x 2 nodes");
+
+  ScoreTable table;
+  table.size = size;
+  Box(mixture, table.min, table.max);
+  const glm::vec2 cells(size - 1);
+  const glm::vec2 cell = (table.max - table.min) / cells;
+
+  table.scores.resize(static_cast<size_t>(size) * size);
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      const glm::vec2 p =
+          glm::mix(table.min, table.max, glm::vec2(i, j) / cells);
+      glm::vec2 s = mixture.Score(p);
+      if (format == GL_RG16F)
+        s = glm::vec2(RoundToHalf(s.x), RoundToHalf(s.y));
+      table.scores[static_cast<size_t>(j) * size + i] = s;
+    }
+  }
+
+  const int stride = std::max(1, (size - 1) / kErrorProbes);
+  double weighted = 0.0, weights = 0.0;
+  for (int j = 0; j < size - 1; j += stride) {
+    for (int i = 0; i < size - 1; i += stride) {
+      const glm::vec2 p = table.min + (glm::vec2(i, j) + 0.5f) * cell;
+      const float error = glm::length(table.Lookup(p) - mixture.Score(p));
+      const double w = mixture.Evaluate(p);
+      table.maxError = std::max(table.maxError, error);
+      weighted += w * error * error;
+      weights += w;
+    }
+  }
+  table.rmsError =
+      weights > 0.0 ? static_cast<float>(std::sqrt(weighted / weights)) : 0.0f;
+
+  // Interpolation mixes node scores, each within ScoreBound at its node,
+  // and component scores change by at most 1 / sigma^2 per unit distance
+  const float sigma = MinSigma(mixture);
+  table.boundSlack = glm::length(cell) / (sigma * sigma);
+  return table;
+}
+
+void UploadScoreTables(GLuint texture, const std::vector<ScoreTable> &tables,
+                       GLenum format) {
+  const int size = tables.empty() ? 0 : tables[0].size;
+  const int layers = static_cast<int>(tables.size());
+
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, size, size, layers, 0, GL_RG,
+               GL_FLOAT, nullptr);
+  for (int layer = 0; layer < layers; layer++) {
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, size, size, 1, GL_RG,
+                    GL_FLOAT, tables[layer].scores.data());
+  }
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
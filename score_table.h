@@ -0,0 +1,66 @@
+#pragma once
+
+#ifdef EMSCRIPTEN
+#include <GLES3/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "mixture.h"
+
+// A mixture's score sampled at size x size nodes spanning a box around its
+// components, for Simulation::SetScoreTable. The shader filters it
+// bilinearly in hardware, so a step costs one texture lookup whatever the
+// component count; positions outside the box use the exact score.
+struct ScoreTable {
+  int size = 0;
+  glm::vec2 min = glm::vec2(0.0f);
+  glm::vec2 max = glm::vec2(0.0f);
+  // Row-major from the min corner, rounded to the texture's precision
+  std::vector<glm::vec2> scores;
+
+  // Against the exact score at cell centers, where bilinear interpolation
+  // is furthest from the nodes: the largest error and the error weighted
+  // by the density, the one particles mostly see.
+  float maxError = 0.0f;
+  float rmsError = 0.0f;
+  // How much further the interpolated score can get from zero than
+  // MixtureOfGaussians::ScoreBound at the same position
+  float boundSlack = 0.0f;
+
+  bool Contains(glm::vec2 p) const {
+    return p.x >= min.x && p.y >= min.y && p.x <= max.x && p.y <= max.y;
+  }
+
+  // Bilinear in the nodes, like target_score in shaders/target.glsl. Only
+  // valid for positions the table contains.
+  glm::vec2 Lookup(glm::vec2 p) const {
+    const glm::vec2 u = (p - min) / (max - min) * static_cast<float>(size - 1);
+    const int cx = std::min(static_cast<int>(u.x), size - 2);
+    const int cy = std::min(static_cast<int>(u.y), size - 2);
+    const glm::vec2 f = u - glm::vec2(cx, cy);
+    const glm::vec2 *row = &scores[static_cast<size_t>(cy) * size + cx];
+    return glm::mix(glm::mix(row[0], row[1], f.x),
+                    glm::mix(row[size], row[size + 1], f.x), f.y);
+  }
+};
+
+// RG32F where float textures can be filtered, RG16F otherwise.
+GLenum ScoreTableFormat();
+
+// Nodes per side for the mixtures, enough to resolve their narrowest
+// component but at most maxSize.
+int ScoreTableSize(const std::vector<MixtureOfGaussians> &mixtures,
+                   int maxSize);
+
+// Throws std::invalid_argument for sizes below 2.
+ScoreTable TabulateScore(const MixtureOfGaussians &mixture, int size,
+                         GLenum format);
+
+// One texture array layer per table, all of the same size, filtered
+// linearly.
+void UploadScoreTables(GLuint texture, const std::vector<ScoreTable> &tables,
+                       GLenum format);
@@ -0,0 +1,88 @@
+#include "shader_variants.h"
+
+#include "capabilities.h"
+#include "utils.h"
+
+// Part of KHR_parallel_shader_compile, which the GLES3 headers lack; the ARB
+// extension shares the value.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+ShaderVariants::ShaderVariants(const char *name, const unsigned char *vert,
+                               unsigned int vertLen, const unsigned char *frag,
+                               unsigned int fragLen)
+    : m_name(name), m_frag(frag), m_fragLen(fragLen) {
+  // Shared by every variant
+  m_vertShader = glCreateShader(GL_VERTEX_SHADER);
+  const GLchar *src = (const GLchar *)vert;
+  const GLsizei len = vertLen;
+  glShaderSource(m_vertShader, 1, &src, &len);
+  glCompileShader(m_vertShader);
+  CheckCompilationResult(m_vertShader, name);
+}
+
+ShaderVariants::~ShaderVariants() {
+  for (auto &[prelude, variant] : m_variants) {
+    glDeleteProgram(variant.program);
+    glDeleteShader(variant.fragShader);
+  }
+  glDeleteShader(m_vertShader);
+}
+
+ShaderVariants::Variant &ShaderVariants::Find(const std::string &prelude) {
+  auto [it, inserted] = m_variants.try_emplace(prelude);
+  Variant &variant = it->second;
+  if (!inserted)
+    return variant;
+
+  // Issue the compile and link without querying their status, which would
+  // wait for them
+  variant.fragShader = glCreateShader(GL_FRAGMENT_SHADER);
+  const std::string source = ShaderSource(m_frag, m_fragLen, prelude);
+  const GLchar *src = source.c_str();
+  glShaderSource(variant.fragShader, 1, &src, nullptr);
+  glCompileShader(variant.fragShader);
+
+  variant.program = glCreateProgram();
+  glAttachShader(variant.program, m_vertShader);
+  glAttachShader(variant.program, variant.fragShader);
+  glLinkProgram(variant.program);
+  return variant;
+}
+
+void ShaderVariants::Finish(const std::string &prelude, Variant &variant) {
+  try {
+    CheckCompilationResult(variant.fragShader, m_name);
+    CheckLinkResult(variant.program, m_name);
+  } catch (...) {
+    // Leave nothing half-built behind for the next lookup to return
+    glDeleteProgram(variant.program);
+    glDeleteShader(variant.fragShader);
+    m_variants.erase(prelude);
+    throw;
+  }
+  variant.linked = true;
+}
+
+GLuint ShaderVariants::Get(const std::string &prelude) {
+  Variant &variant = Find(prelude);
+  if (!variant.linked)
+    Finish(prelude, variant);
+  return variant.program;
+}
+
+GLuint ShaderVariants::Poll(const std::string &prelude) {
+  Variant &variant = Find(prelude);
+  if (variant.linked)
+    return variant.program;
+
+  if (GetCapabilities().parallelShaderCompile) {
+    GLint done = GL_FALSE;
+    glGetProgramiv(variant.program, GL_COMPLETION_STATUS_KHR, &done);
+    if (done != GL_TRUE)
+      return 0;
+  }
+  Finish(prelude, variant);
+  return variant.program;
+}
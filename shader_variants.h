@@ -0,0 +1,53 @@
+#pragma once
+
+#ifdef EMSCRIPTEN
+#include <GLES3/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+#include <string>
+#include <unordered_map>
+
+// Programs built from one embedded vertex shader and one embedded fragment
+// shader, keyed by the prelude spliced into the fragment shader (see
+// ShaderSource in utils.h). Every variant is compiled once and kept until
+// the cache is destroyed.
+//
+// Poll compiles in the background where the driver supports
+// KHR_parallel_shader_compile, so callers can keep drawing with a program
+// they already have until the variant is ready. Compile and link errors
+// throw std::runtime_error from whichever call finds the variant finished.
+class ShaderVariants {
+public:
+  ShaderVariants(const char *name, const unsigned char *vert,
+                 unsigned int vertLen, const unsigned char *frag,
+                 unsigned int fragLen);
+  ~ShaderVariants();
+
+  ShaderVariants(const ShaderVariants &) = delete;
+  ShaderVariants &operator=(const ShaderVariants &) = delete;
+
+  // The linked program, compiling it now if needed.
+  GLuint Get(const std::string &prelude);
+  // Starts compiling the variant if needed and returns it once linked, 0
+  // until then. Without the extension it compiles now, like Get.
+  GLuint Poll(const std::string &prelude);
+
+private:
+  struct Variant {
+    GLuint fragShader = 0;
+    GLuint program = 0;
+    bool linked = false;
+  };
+
+  Variant &Find(const std::string &prelude);
+  void Finish(const std::string &prelude, Variant &variant);
+
+private:
+  const char *m_name;
+  const unsigned char *m_frag;
+  unsigned int m_fragLen;
+
+  GLuint m_vertShader;
+  std::unordered_map<std::string, Variant> m_variants;
+};
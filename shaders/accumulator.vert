@@ -1,20 +1,46 @@
 #version 300 es
 precision highp float;
+precision highp int;
 
-uniform sampler2D uParticles;
+uniform PARTICLE_SAMPLER uParticles;
 uniform int uParticlesWidth;
 
+// The drawn particles are [uFirst, uFirst + uCount); one in every uStride is
+// accumulated.
+uniform int uFirst;
+uniform int uCount;
+uniform int uStride;
+
 // Viewport
 uniform vec2 uMin;
 uniform vec2 uMax;
 
+uint hash(uint x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
 void main() {
-  ivec2 pixel =
-      ivec2(gl_VertexID % uParticlesWidth, gl_VertexID / uParticlesWidth);
+  gl_PointSize = 1.0;
+
+  // One particle per run of uStride at a fixed pseudo-random offset, as in
+  // particle.vert; a short last run may have none, which keeps the expected
+  // count at uCount / uStride.
+  int offset = int(hash(uint(gl_VertexID)) % uint(uStride));
+  int index = gl_VertexID * uStride + offset;
+  if (index >= uCount) {
+    gl_Position = vec4(2.0, 2.0, 2.0, 1.0); // Clipped
+    return;
+  }
+  index += uFirst;
+  ivec2 pixel = ivec2(index % uParticlesWidth, index / uParticlesWidth);
 
-  vec2 pos = texelFetch(uParticles, pixel, 0).xy;
+  vec2 pos = decode_particle(texelFetch(uParticles, pixel, 0));
   pos = 2.0 * (pos - uMin) / (uMax - uMin) - 1.0;
 
-  gl_PointSize = 1.0;
   gl_Position = vec4(pos, 0.0, 1.0);
 }
@@ -1,17 +1,13 @@
 #version 300 es
 precision highp float;
+precision highp int;
 
 layout(location = 0) out vec4 FragColor;
 in vec2 aXY;
 
-#define TWO_PI 6.283185307179586
-
-struct Gaussian { vec2 mean; vec2 sigma; };
-layout(std140) uniform MixtureBlock {
-  int uCount;
-  float uPeak;
-  Gaussian uGaussians[10];
-};
+// Density at the top of the colormap; target_density comes from the target
+// prelude
+uniform float uPeak;
 
 vec3 colormap(float x) {
   vec4 kRedVec4 = vec4(0.13572138, 4.61539260, -42.66032258, 132.13108234);
@@ -31,25 +27,9 @@ vec3 colormap(float x) {
   );
 }
 
-float gaussian(vec2 pos, vec2 mean, vec2 sigma) {
-  vec2 d = pos - mean;
-  vec2 s2 = sigma * sigma;
-  float expo = -0.5 * (d.x * d.x / s2.x + d.y * d.y / s2.y);
-  return exp(expo) / (TWO_PI * sigma.x * sigma.y);
-}
-
-float mixture_of_gaussians(vec2 pos) {
-  if (uCount <= 0) return 0.0;
-  float sum = 0.0;
-  for (int i = 0; i < uCount; ++i) {
-    sum += gaussian(pos, uGaussians[i].mean, uGaussians[i].sigma);
-  }
-  return sum / float(uCount);
-}
-
 void main() {
   float peak = uPeak;
-  float prob = mixture_of_gaussians(aXY);
+  float prob = target_density(aXY, 0);
 
   // Gamma correction style
   float t = pow(prob / max(peak, 1e-8), 0.5);
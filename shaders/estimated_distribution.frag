@@ -1,10 +1,13 @@
 #version 300 es
 precision highp float;
+precision highp int;
 
 layout(location = 0) out vec4 FragColor;
 in vec2 aUV;
 
 uniform sampler2D uAccum;
+uniform ivec2 uAccumSize;
+uniform int uMember;
 uniform int uNumParticles;
 uniform float uArea;
 uniform float uPeak;
@@ -29,7 +32,15 @@ vec3 colormap(float x) {
 
 
 void main() {
-  float numParticles = texture(uAccum, aUV).r;
+  // Each ensemble member has its own uAccumSize band in the accumulator
+  ivec2 texel =
+      clamp(ivec2(aUV * vec2(uAccumSize)), ivec2(0), uAccumSize - 1);
+  texel.y += uMember * uAccumSize.y;
+  float numParticles = texelFetch(uAccum, texel, 0).r;
+  // Drawn regions may reach past the histogram, e.g. a histogram merged from
+  // workers that have not caught up with the view yet
+  if (any(lessThan(aUV, vec2(0.0))) || any(greaterThan(aUV, vec2(1.0))))
+    numParticles = 0.0;
   float prob = numParticles / (float(uNumParticles) * uArea);
 
   // Gamma correction style
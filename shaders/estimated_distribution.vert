@@ -6,8 +6,11 @@ out vec2 aUV;
 
 uniform vec2 uMin;
 uniform vec2 uMax;
+// Part of the histogram drawn, as a fraction of the accumulated viewport
+uniform vec2 uUVMin;
+uniform vec2 uUVMax;
 
 void main() {
-  aUV = (aPos + 1.0) / 2.0;
+  aUV = mix(uUVMin, uUVMax, (aPos + 1.0) / 2.0);
   gl_Position = vec4(aPos, 0.0, 1.0);
 }
@@ -3,6 +3,14 @@ precision highp float;
 
 layout(location = 0) out vec4 FragColor;
 
+in vec2 vCorner;
+in vec4 vColor;
+
+// Sprites larger than a pixel are drawn as discs
+uniform bool uRound;
+
 void main() {
-  FragColor = vec4(1.0, 0.0, 0.0, 0.2);
+  if (uRound && dot(vCorner, vCorner) > 1.0)
+    discard;
+  FragColor = vColor;
 }
@@ -1,20 +1,56 @@
 #version 300 es
 precision highp float;
+precision highp int;
 
-uniform sampler2D uParticles;
+uniform PARTICLE_SAMPLER uParticles;
+uniform PARTICLE_SAMPLER uPrevious;
 uniform int uParticlesWidth;
 
+// The member's particles are [uFirst, uFirst + uCount); every uStride-th is
+// drawn.
+uniform int uFirst;
+uniform int uCount;
+uniform int uStride;
+
 // Viewport
 uniform vec2 uMin;
 uniform vec2 uMax;
 
-void main() {
-    ivec2 pixel = ivec2(gl_VertexID % uParticlesWidth, gl_VertexID / uParticlesWidth);
+uniform vec2 uSpriteSize; // In clip space
+uniform float uAlpha;
+// Length of a typical step, 0 disables velocity coloring
+uniform float uTypicalStep;
 
-    vec2 pos = texelFetch(uParticles, pixel, 0).xy;
-    pos = 2.0 * (pos - uMin) / (uMax - uMin) - 1.0;
+out vec2 vCorner;
+out vec4 vColor;
 
-    gl_PointSize = 1.0;
-    gl_Position = vec4(pos, 0.0, 1.0);
+uint hash(uint x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
 }
 
+void main() {
+  // One particle per run of uStride, at a fixed pseudo-random offset: the
+  // subset is stratified over the grid and does not flicker between frames.
+  int offset = int(hash(uint(gl_InstanceID)) % uint(uStride));
+  int index = uFirst + min(gl_InstanceID * uStride + offset, uCount - 1);
+  ivec2 texel = ivec2(index % uParticlesWidth, index / uParticlesWidth);
+
+  vec2 pos = decode_particle(texelFetch(uParticles, texel, 0));
+
+  vColor = vec4(1.0, 0.0, 0.0, uAlpha);
+  if (uTypicalStep > 0.0) {
+    vec2 step = pos - decode_particle(texelFetch(uPrevious, texel, 0));
+    float speed = clamp(length(step) / (2.0 * uTypicalStep), 0.0, 1.0);
+    vColor.rgb = mix(vec3(0.2, 0.4, 1.0), vec3(1.0, 0.9, 0.2), speed);
+  }
+
+  // Triangle strip over the sprite's corners
+  vCorner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+  pos = 2.0 * (pos - uMin) / (uMax - uMin) - 1.0;
+  gl_Position = vec4(pos + 0.5 * vCorner * uSpriteSize, 0.0, 1.0);
+}
@@ -0,0 +1,57 @@
+// Particle storage codec, one of PARTICLES_RG32F, PARTICLES_RG16F,
+// PARTICLES_FIXED16 or PARTICLES_RGBA8 is defined by the host.
+precision highp float;
+precision highp int;
+
+#define PARTICLE_BOUND 4.0
+#define PARTICLE_STEP (2.0 * PARTICLE_BOUND / 65535.0)
+
+#if defined(PARTICLES_FIXED16)
+precision highp usampler2D;
+#define PARTICLE_SAMPLER usampler2D
+#define PARTICLE_FETCH uvec4
+#define PARTICLE_TEXEL uvec2
+#elif defined(PARTICLES_RGBA8)
+#define PARTICLE_SAMPLER sampler2D
+#define PARTICLE_FETCH vec4
+#define PARTICLE_TEXEL vec4
+#else
+#define PARTICLE_SAMPLER sampler2D
+#define PARTICLE_FETCH vec4
+#define PARTICLE_TEXEL vec2
+#endif
+
+// Takes the texelFetch result of a particle texture.
+vec2 decode_particle(PARTICLE_FETCH t) {
+#if defined(PARTICLES_FIXED16)
+  return vec2(t.xy) * PARTICLE_STEP - PARTICLE_BOUND;
+#elif defined(PARTICLES_RGBA8)
+  // 16-bit fixed point as (x high, x low, y high, y low) bytes
+  vec4 b = round(t * 255.0);
+  return (b.xz * 256.0 + b.yw) * PARTICLE_STEP - PARTICLE_BOUND;
+#else
+  return t.xy;
+#endif
+}
+
+// u is uniform in [0, 1) and makes the rounding stochastic, so the small
+// per-step increments survive on average instead of being rounded away.
+PARTICLE_TEXEL encode_particle(vec2 pos, vec2 u) {
+#if defined(PARTICLES_FIXED16)
+  vec2 q = floor((pos + PARTICLE_BOUND) / PARTICLE_STEP + u);
+  return uvec2(clamp(q, 0.0, 65535.0));
+#elif defined(PARTICLES_RGBA8)
+  vec2 q = clamp(floor((pos + PARTICLE_BOUND) / PARTICLE_STEP + u), 0.0,
+                 65535.0);
+  vec2 high = floor(q / 256.0);
+  return vec4(high.x, q.x - 256.0 * high.x, high.y, q.y - 256.0 * high.y) /
+         255.0;
+#elif defined(PARTICLES_RG16F)
+  // Spacing of half floats around pos; subnormals share the 2^-24 spacing
+  vec2 e = max(floor(log2(max(abs(pos), vec2(1e-30)))), vec2(-14.0));
+  vec2 ulp = exp2(e - 10.0);
+  return floor(pos / ulp + u) * ulp;
+#else
+  return pos;
+#endif
+}
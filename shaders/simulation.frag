@@ -1,22 +1,30 @@
 #version 300 es
 precision highp float;
+precision highp int;
 
-layout(location = 0) out vec2 ParticlePosition;
+layout(location = 0) out PARTICLE_TEXEL ParticlePosition;
 
-uniform sampler2D uParticles;
+uniform PARTICLE_SAMPLER uParticles;
 uniform uint uFrameId;
-uniform float uDt;
 
-#define TWO_PI 6.283185307179586
-
-struct Gaussian {
-  vec2 mean;
-  vec2 sigma;
+#ifdef MODE_TRACKING
+// Mode channel, see mode_tracking.h
+layout(location = 1) out uvec2 ParticleMode;
+uniform highp usampler2D uModes;
+#define NO_MODE 255u
+#define MODE_LABEL_BITS 8
+#endif
+
+// TWO_PI, MAX_MEMBERS and target_score come from the target prelude, see
+// TargetPrelude in target.h
+struct Member {
+  float dt;
+  uint seed;
+  int mixture;
 };
-layout(std140) uniform MixtureBlock {
-  int uCount;
-  float uPeak;
-  Gaussian uGaussians[10];
+layout(std140) uniform EnsembleBlock {
+  int uMemberCount;
+  Member uMembers[MAX_MEMBERS];
 };
 
 uint rng = 0u;
@@ -58,17 +66,26 @@ uint lcg_random() {
 
 float ldexp(float x, int exp) { return x * exp2(float(exp)); }
 
-float lcg_randomf() { return ldexp(float(lcg_random()), -32); }
+// Only the top 24 bits fit in a float; using more can round up to 1.0
+float lcg_randomf() { return ldexp(float(lcg_random() >> 8u), -24); }
 
-void seed(uint frame_id) {
+void seed(uint frame_id, uint member_seed) {
   uvec2 pixel = uvec2(gl_FragCoord);
-  uvec2 dims = uvec2(1920u, 1080u);
+  uvec2 dims = uvec2(textureSize(uParticles, 0));
 
   rng = murmur_hash3_mix(0u, uint(pixel.x + pixel.y * dims.x));
   rng = murmur_hash3_mix(rng, frame_id);
+  rng = murmur_hash3_mix(rng, member_seed);
   rng = murmur_hash3_finalize(rng);
 }
 
+// Members own contiguous row bands, see EnsembleRowRange in utils.h
+int ensemble_member() {
+  int row = int(gl_FragCoord.y);
+  int height = textureSize(uParticles, 0).y;
+  return ((row + 1) * uMemberCount - 1) / height;
+}
+
 vec2 sample_gaussian(vec2 u, float mean, float standardDeviation) {
   float a = standardDeviation * sqrt(-2.0 * log(1.0 - u.x));
   float b = TWO_PI * u.y;
@@ -76,44 +93,35 @@ vec2 sample_gaussian(vec2 u, float mean, float standardDeviation) {
   return vec2(cos(b), sin(b)) * a + mean;
 }
 
-vec2 gaussian_score(vec2 pos, vec2 mean, vec2 sigma) {
-  return (mean - pos) / (sigma * sigma);
-}
-
-float gaussian(vec2 pos, vec2 mean, vec2 sigma, float exponent_offset) {
-  vec2 d = (pos - mean) / sigma;
-  return exp(-0.5 * dot(d, d) + exponent_offset) / (TWO_PI * sigma.x * sigma.y);
-}
-
-vec2 mixture_of_gaussian_score(vec2 pos) {
-  float wsum = 0.0;
-  vec2 num = vec2(0.0);
-
-  float max_e = -1e30;
-  for (int i = 0; i < uCount; ++i) {
-    vec2 d = (pos - uGaussians[i].mean) / uGaussians[i].sigma;
-    float e = -0.5 * dot(d, d);
-    max_e = max(max_e, e);
-  }
-
-  for (int i = 0; i < uCount; ++i) {
-    float w = gaussian(pos, uGaussians[i].mean, uGaussians[i].sigma, -max_e);
-    num += w * gaussian_score(pos, uGaussians[i].mean, uGaussians[i].sigma);
-    wsum += w;
-  }
-  return (wsum > 0.0) ? num / wsum : vec2(0.0);
-}
-
 void main() {
-  seed(uFrameId);
+  Member member = uMembers[ensemble_member()];
+  seed(uFrameId, member.seed);
 
-  vec2 pos = texelFetch(uParticles, ivec2(gl_FragCoord.xy), 0).xy;
+  vec2 pos =
+      decode_particle(texelFetch(uParticles, ivec2(gl_FragCoord.xy), 0));
 
-  float dt = uDt;
+  float dt = member.dt;
 
   vec2 u = vec2(lcg_randomf(), lcg_randomf());
   vec2 w = sample_gaussian(u, 0.0, 1.0);
 
-  ParticlePosition =
-      pos + dt * mixture_of_gaussian_score(pos) + sqrt(2.0 * dt) * w;
+  pos += dt * target_score(pos, member.mixture) + sqrt(2.0 * dt) * w;
+
+#ifdef MODE_TRACKING
+  // Labels the position read this step, which target_score just scored
+  uvec2 mode = texelFetch(uModes, ivec2(gl_FragCoord.xy), 0).xy;
+  uint previous = mode.x & NO_MODE;
+  uint label = uint(score_mode);
+  if (previous != NO_MODE && previous != label) {
+    mode.x += 1u << MODE_LABEL_BITS;
+    mode.y = uFrameId;
+  }
+  ParticleMode = uvec2((mode.x & ~NO_MODE) | label, mode.y);
+#endif
+
+#ifdef PARTICLES_RG32F
+  ParticlePosition = pos;
+#else
+  ParticlePosition = encode_particle(pos, vec2(lcg_randomf(), lcg_randomf()));
+#endif
 }
@@ -0,0 +1,252 @@
+// Target density, one of TARGET_MIXTURE, TARGET_ROSENBROCK,
+// TARGET_DOUBLE_WELL or TARGET_GRID is defined by the host. Every target
+// provides
+//
+//   vec2 target_score(vec2 pos, int m)         gradient of log p
+//   float target_log_density(vec2 pos, int m)  log p, up to a constant
+//   float target_density(vec2 pos, int m)      p, normalized
+//
+// where m selects the ensemble member's mixture and is ignored by the other
+// targets. Matches the densities in target.h. Mixtures may also define
+// SCORE_TABLE to look their score up in a table instead, and MODE_TRACKING
+// to have target_score set score_mode.
+precision highp float;
+precision highp int;
+
+#define TWO_PI 6.283185307179586
+#define MAX_MEMBERS 8
+
+#if defined(TARGET_MIXTURE)
+
+struct Gaussian {
+  vec2 mean;
+  vec2 sigma;
+};
+struct Mixture {
+  int count;
+  float peak;
+  Gaussian gaussians[10];
+};
+layout(std140) uniform MixtureBlock { Mixture uMixtures[MAX_MEMBERS]; };
+
+// Variants specialized by TargetPrelude define NUM_COMPONENTS, which every
+// mixture then has. The loops get a constant trip count the compiler can
+// unroll, and the exponents are computed once into registers.
+#ifdef NUM_COMPONENTS
+#define MIXTURE_COUNT(m) NUM_COMPONENTS
+#else
+#define MIXTURE_COUNT(m) uMixtures[m].count
+#endif
+
+// Exponent of component i at pos
+float component_exponent(vec2 pos, Gaussian g) {
+  vec2 d = (pos - g.mean) / g.sigma;
+  return -0.5 * dot(d, d);
+}
+
+#ifdef MODE_TRACKING
+// Component of largest responsibility at the position of the last
+// target_score, see MixtureOfGaussians::Mode
+int score_mode = 0;
+#endif
+
+vec2 mixture_score(vec2 pos, int m) {
+  float wsum = 0.0;
+  vec2 num = vec2(0.0);
+
+  // Responsibilities relative to the largest exponent
+  float max_e = -1e30;
+#ifdef NUM_COMPONENTS
+  float e[NUM_COMPONENTS];
+  for (int i = 0; i < NUM_COMPONENTS; ++i) {
+    e[i] = component_exponent(pos, uMixtures[m].gaussians[i]);
+    max_e = max(max_e, e[i]);
+  }
+#else
+  for (int i = 0; i < MIXTURE_COUNT(m); ++i)
+    max_e = max(max_e, component_exponent(pos, uMixtures[m].gaussians[i]));
+#endif
+
+#ifdef MODE_TRACKING
+  float max_w = -1.0;
+#endif
+  for (int i = 0; i < MIXTURE_COUNT(m); ++i) {
+    Gaussian g = uMixtures[m].gaussians[i];
+#ifdef NUM_COMPONENTS
+    float e_i = e[i];
+#else
+    float e_i = component_exponent(pos, g);
+#endif
+    float w = exp(e_i - max_e) / (TWO_PI * g.sigma.x * g.sigma.y);
+    num += w * (g.mean - pos) / (g.sigma * g.sigma);
+    wsum += w;
+#ifdef MODE_TRACKING
+    // The responsibilities are at hand, so labeling is a compare
+    if (w > max_w) {
+      max_w = w;
+      score_mode = i;
+    }
+#endif
+  }
+  return (wsum > 0.0) ? num / wsum : vec2(0.0);
+}
+
+#ifdef SCORE_TABLE
+
+// Scores tabulated by TabulateScore in score_table.h, one layer per mixture,
+// with nodes at texel centers spanning the box from uScoreTableBoxes[m].xy to
+// .zw. The hardware interpolates; outside the box the score is exact.
+uniform highp sampler2DArray uScoreTable;
+uniform vec4 uScoreTableBoxes[MAX_MEMBERS];
+
+#ifdef MODE_TRACKING
+// The table holds no responsibilities, so labels cost a pass over the
+// components after all
+int mixture_mode(vec2 pos, int m) {
+  int mode = 0;
+  float best = -1e30;
+  for (int i = 0; i < MIXTURE_COUNT(m); ++i) {
+    Gaussian g = uMixtures[m].gaussians[i];
+    float log_w = component_exponent(pos, g) - log(g.sigma.x * g.sigma.y);
+    if (log_w > best) {
+      best = log_w;
+      mode = i;
+    }
+  }
+  return mode;
+}
+#endif
+
+vec2 target_score(vec2 pos, int m) {
+  vec4 box = uScoreTableBoxes[m];
+  vec2 u = (pos - box.xy) / (box.zw - box.xy);
+  if (any(lessThan(u, vec2(0.0))) || any(greaterThan(u, vec2(1.0))))
+    return mixture_score(pos, m);
+#ifdef MODE_TRACKING
+  score_mode = mixture_mode(pos, m);
+#endif
+  vec2 size = vec2(textureSize(uScoreTable, 0).xy);
+  vec2 uv = (u * (size - 1.0) + 0.5) / size;
+  return texture(uScoreTable, vec3(uv, float(m))).rg;
+}
+
+#else
+
+vec2 target_score(vec2 pos, int m) { return mixture_score(pos, m); }
+
+#endif
+
+float target_density(vec2 pos, int m) {
+  if (MIXTURE_COUNT(m) <= 0)
+    return 0.0;
+  float sum = 0.0;
+  for (int i = 0; i < MIXTURE_COUNT(m); ++i) {
+    Gaussian g = uMixtures[m].gaussians[i];
+    sum += exp(component_exponent(pos, g)) / (TWO_PI * g.sigma.x * g.sigma.y);
+  }
+  return sum / float(MIXTURE_COUNT(m));
+}
+
+float target_log_density(vec2 pos, int m) {
+  return log(target_density(pos, m));
+}
+
+#else
+
+// See Target::params in target.h
+uniform vec4 uTargetParams;
+// log of the integral of exp(target_log_density), from NormalizeTarget
+uniform float uTargetLogNormalizer;
+
+#if defined(TARGET_ROSENBROCK)
+
+// log p = -((a - x)^2 + b (y - x^2)^2) / c
+float target_log_density(vec2 pos, int m) {
+  float a = uTargetParams.x, b = uTargetParams.y, c = uTargetParams.z;
+  float u = a - pos.x;
+  float v = pos.y - pos.x * pos.x;
+  return -(u * u + b * v * v) / c;
+}
+
+vec2 target_score(vec2 pos, int m) {
+  float a = uTargetParams.x, b = uTargetParams.y, c = uTargetParams.z;
+  float u = a - pos.x;
+  float v = pos.y - pos.x * pos.x;
+  return vec2(2.0 * u + 4.0 * b * pos.x * v, -2.0 * b * v) / c;
+}
+
+#elif defined(TARGET_DOUBLE_WELL)
+
+// log p = -h ((x / w)^2 - 1)^2 - y^2 / (2 s^2)
+float target_log_density(vec2 pos, int m) {
+  float w = uTargetParams.x, h = uTargetParams.y, s = uTargetParams.z;
+  float q = (pos.x * pos.x) / (w * w) - 1.0;
+  return -h * q * q - 0.5 * pos.y * pos.y / (s * s);
+}
+
+vec2 target_score(vec2 pos, int m) {
+  float w = uTargetParams.x, h = uTargetParams.y, s = uTargetParams.z;
+  float q = (pos.x * pos.x) / (w * w) - 1.0;
+  return vec2(-4.0 * h * q * pos.x / (w * w), -pos.y / (s * s));
+}
+
+#elif defined(TARGET_GRID)
+
+// Row-major R32F log densities at nodes spanning the box from
+// uTargetParams.xy to uTargetParams.zw, interpolated bilinearly. Outside the
+// box the edge value continues with a quadratic wall of stiffness
+// TARGET_GRID_WALL, so particles cannot escape the table.
+uniform sampler2D uTargetGrid;
+#define TARGET_GRID_WALL 100.0
+
+float grid_node(ivec2 c) { return texelFetch(uTargetGrid, c, 0).r; }
+
+// Bilinear log density and its gradient, both including the wall
+void grid_sample(vec2 pos, out float log_p, out vec2 grad) {
+  vec2 lo = uTargetParams.xy;
+  vec2 hi = uTargetParams.zw;
+  ivec2 size = textureSize(uTargetGrid, 0);
+  vec2 cells = vec2(size - 1);
+
+  vec2 inside = clamp(pos, lo, hi);
+  vec2 u = (inside - lo) / (hi - lo) * cells;
+  ivec2 c = min(ivec2(u), size - 2);
+  vec2 f = u - vec2(c);
+
+  float v00 = grid_node(c);
+  float v10 = grid_node(c + ivec2(1, 0));
+  float v01 = grid_node(c + ivec2(0, 1));
+  float v11 = grid_node(c + ivec2(1, 1));
+
+  log_p = mix(mix(v00, v10, f.x), mix(v01, v11, f.x), f.y);
+  grad = vec2(mix(v10 - v00, v11 - v01, f.y), mix(v01 - v00, v11 - v10, f.x)) *
+         cells / (hi - lo);
+  // The table is flat across its edges
+  grad *= vec2(equal(inside, pos));
+
+  vec2 outside = pos - inside;
+  log_p -= 0.5 * TARGET_GRID_WALL * dot(outside, outside);
+  grad -= TARGET_GRID_WALL * outside;
+}
+
+float target_log_density(vec2 pos, int m) {
+  float log_p;
+  vec2 grad;
+  grid_sample(pos, log_p, grad);
+  return log_p;
+}
+
+vec2 target_score(vec2 pos, int m) {
+  float log_p;
+  vec2 grad;
+  grid_sample(pos, log_p, grad);
+  return grad;
+}
+
+#endif
+
+float target_density(vec2 pos, int m) {
+  return exp(target_log_density(pos, m) - uTargetLogNormalizer);
+}
+
+#endif
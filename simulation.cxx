@@ -1,20 +1,55 @@
 #include "simulation.h"
 
 #include "mixture.h"
+#include "particle_store.h"
+#include "particle_storage.h"
 #include "simulation.frag.h"
 #include "simulation.vert.h"
+#include "target.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <stdexcept>
-
-#include <glm/gtc/type_ptr.hpp>
-
-static constexpr size_t kWidth = 1920;
-static constexpr size_t kHeight = 1080;
-static constexpr size_t kNumParticles = kWidth * kHeight;
-
-Simulation::Simulation() : m_step(0), m_dt(0.00004f) {
+#include <utility>
+
+// std140 mirror of EnsembleBlock in simulation.frag
+namespace {
+struct alignas(16) GpuMember {
+  float dt;
+  uint32_t seed;
+  int mixture;
+};
+
+struct GpuEnsemble {
+  alignas(16) int memberCount;
+  GpuMember members[kMaxEnsembleMembers];
+};
+} // namespace
+
+// Texture units of the simulation program
+static constexpr int kParticlesUnit = 0;
+static constexpr int kTargetGridUnit = 1;
+static constexpr int kScoreTableUnit = 2;
+static constexpr int kModesUnit = 3;
+
+// Noise displacements beyond this many standard deviations are taken as
+// impossible when culling.
+static constexpr float kCullSigmas = 5.0f;
+
+Simulation::Simulation(size_t width, size_t height, ParticleFormat format)
+    : m_width(width), m_height(height),
+      m_variants("simulation", SimulationVert, SimulationVert_len,
+                 SimulationFrag, SimulationFrag_len),
+      m_program(0), m_specialized(false), m_specialize(true), m_fbos{0, 0},
+      m_colors{0, 0}, m_step(0),
+      m_format(format),
+      m_mixtures(1, MixtureOfGaussians{}), m_members(1), m_scoreTableSize(0),
+      m_sortInterval(0),
+      m_stepsSinceSort(0), m_timeSinceSort(0.0f), m_scoreBound(0.0f),
+      m_modeInterval(0),
+      m_stepsSinceModes(0), m_modes{0, 0}, m_modesUniform(-1) {
   // Create VAO and VBO
   glGenVertexArrays(1, &m_quadVAO);
   glBindVertexArray(m_quadVAO);
@@ -34,52 +69,121 @@ Simulation::Simulation() : m_step(0), m_dt(0.00004f) {
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
   glEnableVertexAttribArray(0);
 
-  // Create shaders
-  {
-    m_vertShader = glCreateShader(GL_VERTEX_SHADER);
-    const GLchar *src = (const GLchar *)SimulationVert;
-    const GLsizei len = SimulationVert_len;
-    glShaderSource(m_vertShader, 1, &src, &len);
-    glCompileShader(m_vertShader);
-    CheckCompilationResult(m_vertShader, "simulation.vert");
+  // Create Ensemble UBO
+  glGenBuffers(1, &m_ensembleUBO);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ensembleUBO);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(GpuEnsemble), nullptr,
+               GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_ensembleUBO);
+
+  // Create Mixture UBO, read through the mixture target's MixtureBlock
+  glGenBuffers(1, &m_mixtureUBO);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_mixtureUBO);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(GpuMixtures), nullptr,
+               GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  UploadEnsemble();
+
+  glGenTextures(1, &m_targetGrid);
+  glGenTextures(1, &m_scoreTableTexture);
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  try {
+    SelectProgram();
+    CreateTextures();
+  } catch (...) {
+    // The destructor does not run when the constructor throws
+    DeleteObjects();
+    throw;
   }
+}
+
+std::string Simulation::Prelude(int components) {
+  return std::string(m_scoreTables.empty() ? "" : "#define SCORE_TABLE\n") +
+         (TracksModes() ? "#define MODE_TRACKING\n" : "") +
+         ParticleStoragePrelude(m_format) +
+         TargetPrelude(m_target.kind, components);
+}
 
-  {
-    m_fragShader = glCreateShader(GL_FRAGMENT_SHADER);
-    const GLchar *src = (const GLchar *)SimulationFrag;
-    const GLsizei len = SimulationFrag_len;
-    glShaderSource(m_fragShader, 1, &src, &len);
-    glCompileShader(m_fragShader);
-    CheckCompilationResult(m_fragShader, "simulation.frag");
+// The component count of every member's mixture, 0 when they differ
+static int SharedComponentCount(const std::vector<MixtureOfGaussians> &mixtures,
+                                const std::vector<EnsembleMember> &members) {
+  const int count = mixtures[members[0].mixture].count;
+  for (const EnsembleMember &member : members) {
+    if (mixtures[member.mixture].count != count)
+      return 0;
   }
+  return count;
+}
 
-  m_program = glCreateProgram();
-  glAttachShader(m_program, m_vertShader);
-  glAttachShader(m_program, m_fragShader);
-  glLinkProgram(m_program);
+void Simulation::SelectProgram() {
+  // Tabulated scores rarely run the component loops
+  const int components = m_specialize &&
+                                 m_target.kind == TargetKind::Mixture &&
+                                 m_scoreTables.empty()
+                             ? SharedComponentCount(m_mixtures, m_members)
+                             : 0;
+
+  m_pendingPrelude.clear();
+  if (components > 0) {
+    std::string prelude = Prelude(components);
+    if (const GLuint program = m_variants.Poll(prelude)) {
+      UseProgram(program, true);
+      return;
+    }
+    m_pendingPrelude = std::move(prelude);
+  }
+  // The generic program handles any mixture, so it also runs while the
+  // variant compiles
+  UseProgram(m_variants.Get(Prelude(0)), false);
+}
+
+void Simulation::UseProgram(GLuint program, bool specialized) {
+  m_specialized = specialized;
+  if (program == m_program)
+    return;
+  m_program = program;
 
   m_frameIdUniform = glGetUniformLocation(m_program, "uFrameId");
   m_particlesUniform = glGetUniformLocation(m_program, "uParticles");
-  m_dtUniform = glGetUniformLocation(m_program, "uDt");
 
   // Bind uniform block index to binding 0
-  GLuint blockIdx = glGetUniformBlockIndex(m_program, "MixtureBlock");
+  GLuint blockIdx = glGetUniformBlockIndex(m_program, "EnsembleBlock");
   if (blockIdx != GL_INVALID_INDEX) {
     glUniformBlockBinding(m_program, blockIdx, 0);
   }
+  blockIdx = glGetUniformBlockIndex(m_program, "MixtureBlock");
+  if (blockIdx != GL_INVALID_INDEX) {
+    glUniformBlockBinding(m_program, blockIdx, kMixtureBlockBinding);
+  }
 
-  // Create Mixture UBO
-  glGenBuffers(1, &m_mogUBO);
-  glBindBuffer(GL_UNIFORM_BUFFER, m_mogUBO);
-  glBufferData(GL_UNIFORM_BUFFER, sizeof(MixtureOfGaussians), nullptr,
-               GL_DYNAMIC_DRAW);
-  glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_mogUBO);
-  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  m_targetUniforms.Locate(m_program);
+  m_scoreTableUniform = glGetUniformLocation(m_program, "uScoreTable");
+  m_scoreTableBoxesUniform =
+      glGetUniformLocation(m_program, "uScoreTableBoxes");
+  m_modesUniform = glGetUniformLocation(m_program, "uModes");
+}
 
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
+void Simulation::SetShaderSpecialization(bool enabled) {
+  if (enabled == m_specialize)
+    return;
+  m_specialize = enabled;
+  SelectProgram();
+}
+
+bool Simulation::ShaderSpecialized() { return m_specialized; }
+
+void Simulation::FinishShaders() {
+  if (m_pendingPrelude.empty())
+    return;
+  UseProgram(m_variants.Get(m_pendingPrelude), true);
+  m_pendingPrelude.clear();
+}
 
-  InitializeParticles();
+void Simulation::CreateTextures() {
+  const ParticleFormatInfo &info = GetParticleFormatInfo(m_format);
 
   // Create framebuffers
   glGenFramebuffers(2, m_fbos);
@@ -87,8 +191,8 @@ Simulation::Simulation() : m_step(0), m_dt(0.00004f) {
 
   for (int i = 0; i < 2; i++) {
     glBindTexture(GL_TEXTURE_2D, m_colors[i]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, kWidth, kHeight, 0, GL_RG,
-                 GL_FLOAT, glm::value_ptr(m_particles[0]));
+    glTexImage2D(GL_TEXTURE_2D, 0, info.internalFormat, m_width, m_height, 0,
+                 info.format, info.type, nullptr);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -105,32 +209,242 @@ Simulation::Simulation() : m_step(0), m_dt(0.00004f) {
     glDrawBuffers(1, bufs);
 
     GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (status != GL_FRAMEBUFFER_COMPLETE)
-      throw std::runtime_error("Error creating framebuffer");
-
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+      DestroyTextures();
+      throw std::runtime_error(std::string("Error creating framebuffer: ") +
+                               info.name + " is not color-renderable");
+    }
+  }
+
+  // The grid is cheap to refill, so only its encoding is kept
+  ParticleStore initial;
+  initial.Resize(m_width, m_height);
+  initial.FillGrid(0, m_height);
+  EncodeParticles(m_format, initial, m_initialTexels);
+  UpdateModeChannel();
+  ResetParticles();
+}
+
+void Simulation::DestroyTextures() {
+  glDeleteFramebuffers(2, m_fbos);
+  glDeleteTextures(2, m_colors);
+  m_fbos[0] = m_fbos[1] = 0;
+  m_colors[0] = m_colors[1] = 0;
+  if (m_modes[0] != 0) {
+    glDeleteTextures(2, m_modes);
+    m_modes[0] = m_modes[1] = 0;
   }
 }
 
-void Simulation::InitializeParticles() {
-  m_particles.reserve(kNumParticles);
+// Labels name mixture components, which the other targets lack
+bool Simulation::TracksModes() {
+  return m_modeInterval > 0 && m_target.kind == TargetKind::Mixture;
+}
 
-  for (int i = 0; i < kWidth; i++) {
-    const float x = 2.0 * (static_cast<float>(i) / (kWidth - 1.0)) - 1.0;
-    for (int j = 0; j < kHeight; j++) {
-      const float y = 2.0 * (static_cast<float>(j) / (kHeight - 1.0)) - 1.0;
-      m_particles.push_back({x, y});
+void Simulation::UpdateModeChannel() {
+  const bool track = TracksModes();
+  if (track == (m_modes[0] != 0))
+    return;
+
+  if (track) {
+    glGenTextures(2, m_modes);
+    for (int i = 0; i < 2; i++) {
+      glBindTexture(GL_TEXTURE_2D, m_modes[i]);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, m_width, m_height, 0,
+                   GL_RG_INTEGER, GL_UNSIGNED_INT, nullptr);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
     }
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+  const GLenum bufs[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+  for (int i = 0; i < 2; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbos[i]);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                           m_modes[i], 0);
+    glDrawBuffers(track ? 2 : 1, bufs);
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (track) {
+    ClearModes();
+  } else {
+    glDeleteTextures(2, m_modes);
+    m_modes[0] = m_modes[1] = 0;
+  }
+}
+
+void Simulation::ClearModes() {
+  m_modeStatistics = ModeStatistics();
+  m_stepsSinceModes = 0;
+  if (m_modes[0] == 0)
+    return;
+  const GLuint unlabeled[] = {kNoMode, 0, 0, 0};
+  for (int i = 0; i < 2; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbos[i]);
+    glClearBufferuiv(GL_COLOR, 1, unlabeled);
   }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Simulation::ReadModes(GLuint fbo) {
+  // RGBA reads are the integer reads every GLES3 implementation supports
+  m_modeTexels.resize(4 * m_width * m_height);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glReadBuffer(GL_COLOR_ATTACHMENT1);
+  glReadPixels(0, 0, m_width, m_height, GL_RGBA_INTEGER, GL_UNSIGNED_INT,
+               m_modeTexels.data());
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+void Simulation::ReduceModes() {
+  const int bing = m_step % 2;
+  const int bong = 1 - bing;
+
+  ReadModes(m_fbos[bong]);
+  const ModeStatistics previous = std::move(m_modeStatistics);
+  ::ReduceModes(m_modeTexels, m_width, m_height, EnsembleSize(), Step(),
+                previous, m_modeStatistics);
+  m_stepsSinceModes = 0;
+}
+
+void Simulation::SetModeTracking(int steps) {
+  m_modeInterval = std::max(0, steps);
+  UpdateModeChannel();
+  SelectProgram();
+}
+
+const ModeStatistics &Simulation::Modes() { return m_modeStatistics; }
+
+void Simulation::SetParticleFormat(ParticleFormat format) {
+  if (format == m_format)
+    return;
+
+  DestroyTextures();
+  m_format = format;
+  SelectProgram();
+  CreateTextures();
 }
 
 void Simulation::SetMixture(const MixtureOfGaussians &m) {
-  glBindBuffer(GL_UNIFORM_BUFFER, m_mogUBO);
-  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MixtureOfGaussians), &m);
-  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  m_mixtures.assign(1, m);
+  for (EnsembleMember &member : m_members)
+    member.mixture = 0;
+  UploadEnsemble();
+  BuildScoreTables();
+  SelectProgram();
+  m_index.Clear();
+}
+
+void Simulation::SetDt(float dt) {
+  bool changed = false;
+  for (EnsembleMember &member : m_members) {
+    changed |= member.dt != dt;
+    member.dt = dt;
+  }
+  if (changed)
+    UploadEnsemble();
+}
+
+void ValidateEnsemble(const std::vector<MixtureOfGaussians> &mixtures,
+                      const std::vector<EnsembleMember> &members) {
+  if (mixtures.empty() || mixtures.size() > kMaxEnsembleMembers)
+    throw std::invalid_argument("Invalid number of ensemble mixtures");
+  if (members.empty() || members.size() > kMaxEnsembleMembers)
+    throw std::invalid_argument("Invalid number of ensemble members");
+  for (const EnsembleMember &member : members) {
+    if (member.mixture < 0 || member.mixture >= (int)mixtures.size())
+      throw std::invalid_argument("Ensemble member mixture out of range");
+  }
+}
+
+void Simulation::SetEnsemble(const std::vector<MixtureOfGaussians> &mixtures,
+                             const std::vector<EnsembleMember> &members) {
+  ValidateEnsemble(mixtures, members);
+
+  // dt and seed changes, e.g. from the dt slider, only need the upload
+  const bool mixturesChanged =
+      mixtures.size() != m_mixtures.size() ||
+      !std::equal(mixtures.begin(), mixtures.end(), m_mixtures.begin(),
+                  SameMixture);
+  // The sort's bands and score bound follow the members' mixtures; dt only
+  // enters VisibleRanges through m_timeSinceSort
+  bool bandsChanged = members.size() != m_members.size();
+  for (size_t k = 0; !bandsChanged && k < members.size(); k++)
+    bandsChanged = members[k].mixture != m_members[k].mixture;
+  m_mixtures = mixtures;
+  m_members = members;
+  UploadEnsemble();
+  if (mixturesChanged)
+    BuildScoreTables();
+  SelectProgram();
+  if (mixturesChanged || bandsChanged)
+    m_index.Clear();
+}
+
+void Simulation::SetTarget(const Target &target) {
+  const bool recompile = target.kind != m_target.kind;
+  m_target = target;
+  if (recompile) {
+    BuildScoreTables();
+    UpdateModeChannel();
+    SelectProgram();
+  }
+  UploadTargetGrid(m_targetGrid, m_target);
+  m_index.Clear();
 }
 
-void Simulation::SetDt(float dt) { m_dt = dt; }
+void Simulation::SetScoreTable(int maxSize) {
+  if (maxSize == m_scoreTableSize)
+    return;
+  m_scoreTableSize = maxSize;
+  BuildScoreTables();
+  SelectProgram();
+  // The sort's score bound includes the tables' slack
+  m_index.Clear();
+}
+
+const std::vector<ScoreTable> &Simulation::ScoreTables() {
+  return m_scoreTables;
+}
+
+void Simulation::BuildScoreTables() {
+  m_scoreTables.clear();
+  m_scoreTableBoxes.clear();
+  if (m_scoreTableSize <= 0 || m_target.kind != TargetKind::Mixture)
+    return;
+
+  const GLenum format = ScoreTableFormat();
+  const int size = ScoreTableSize(m_mixtures, m_scoreTableSize);
+  for (const MixtureOfGaussians &mixture : m_mixtures) {
+    m_scoreTables.push_back(TabulateScore(mixture, size, format));
+    const ScoreTable &table = m_scoreTables.back();
+    m_scoreTableBoxes.push_back(glm::vec4(table.min, table.max));
+  }
+  UploadScoreTables(m_scoreTableTexture, m_scoreTables, format);
+}
+
+void Simulation::UploadEnsemble() {
+  GpuEnsemble block = {};
+  block.memberCount = static_cast<int>(m_members.size());
+  for (size_t i = 0; i < m_members.size(); i++) {
+    block.members[i].dt = m_members[i].dt;
+    block.members[i].seed = m_members[i].seed;
+    block.members[i].mixture = m_members[i].mixture;
+  }
+  GpuMixtures mixtures = {};
+  for (size_t i = 0; i < m_mixtures.size(); i++)
+    mixtures.mixtures[i] = m_mixtures[i];
+
+  glBindBuffer(GL_UNIFORM_BUFFER, m_ensembleUBO);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(GpuEnsemble), &block);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_mixtureUBO);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(GpuMixtures), &mixtures);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
 void Simulation::Update() {
   m_step++;
@@ -138,20 +452,43 @@ void Simulation::Update() {
   const int bing = m_step % 2;
   const int bong = 1 - bing;
 
-  glViewport(0, 0, kWidth, kHeight);
+  if (!m_pendingPrelude.empty()) {
+    if (const GLuint program = m_variants.Poll(m_pendingPrelude)) {
+      UseProgram(program, true);
+      m_pendingPrelude.clear();
+    }
+  }
+
+  glViewport(0, 0, m_width, m_height);
   glDisable(GL_BLEND);
   glBindVertexArray(m_quadVAO);
   glUseProgram(m_program);
 
-  glActiveTexture(GL_TEXTURE0);
+  glActiveTexture(GL_TEXTURE0 + kParticlesUnit);
   glBindTexture(GL_TEXTURE_2D, m_colors[bing]);
-  glUniform1i(m_particlesUniform, 0);
+  glUniform1i(m_particlesUniform, kParticlesUnit);
 
   glUniform1ui(m_frameIdUniform, m_step);
-  glUniform1f(m_dtUniform, m_dt);
+  m_targetUniforms.Apply(m_target, m_targetGrid, kTargetGridUnit);
+  if (!m_scoreTables.empty()) {
+    glActiveTexture(GL_TEXTURE0 + kScoreTableUnit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_scoreTableTexture);
+    glUniform1i(m_scoreTableUniform, kScoreTableUnit);
+    glUniform4fv(m_scoreTableBoxesUniform,
+                 static_cast<GLsizei>(m_scoreTableBoxes.size()),
+                 &m_scoreTableBoxes[0].x);
+    glActiveTexture(GL_TEXTURE0);
+  }
+  if (m_modes[0] != 0) {
+    glActiveTexture(GL_TEXTURE0 + kModesUnit);
+    glBindTexture(GL_TEXTURE_2D, m_modes[bing]);
+    glUniform1i(m_modesUniform, kModesUnit);
+    glActiveTexture(GL_TEXTURE0);
+  }
 
-  // Bind mixture UBO at binding=0
-  glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_mogUBO);
+  // Bind ensemble UBO at binding=0
+  glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_ensembleUBO);
+  glBindBufferBase(GL_UNIFORM_BUFFER, kMixtureBlockBinding, m_mixtureUBO);
 
   glBindFramebuffer(GL_FRAMEBUFFER, m_fbos[bong]);
   glDrawArrays(GL_TRIANGLES, 0, 6);
@@ -160,37 +497,137 @@ void Simulation::Update() {
   glBindTexture(GL_TEXTURE_2D, 0);
   glBindVertexArray(0);
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  m_stepsSinceModes++;
+  if (m_modes[0] != 0 && m_stepsSinceModes >= m_modeInterval)
+    ReduceModes();
+
+  m_stepsSinceSort++;
+  float dt = 0.0f;
+  for (const EnsembleMember &member : m_members)
+    dt = std::max(dt, member.dt);
+  m_timeSinceSort += dt;
+  if (m_sortInterval > 0 && m_stepsSinceSort >= m_sortInterval)
+    Sort();
+}
+
+void Simulation::SetSortInterval(int steps) { m_sortInterval = steps; }
+
+void Simulation::Sort() {
+  const int bing = m_step % 2;
+  const int bong = 1 - bing;
+
+  // The previous positions get the same order, so both textures keep
+  // describing the same particles.
+  ::ReadParticles(m_format, m_fbos[bong], m_width, m_height, m_sortCurrent);
+  ::ReadParticles(m_format, m_fbos[bing], m_width, m_height, m_sortPrevious);
+  m_index.Build(m_width, m_height, m_members.size(), m_sortCurrent,
+                m_sortPrevious);
+  UploadParticles(m_format, m_colors[bong], m_width, m_height, m_sortCurrent);
+  UploadParticles(m_format, m_colors[bing], m_width, m_height,
+                  m_sortPrevious);
+  // Only the current labels are read by the next step
+  if (m_modes[0] != 0) {
+    ReadModes(m_fbos[bong]);
+    std::vector<glm::uvec2> modes(m_width * m_height);
+    for (size_t i = 0; i < modes.size(); i++)
+      modes[i] = glm::uvec2(m_modeTexels[4 * i], m_modeTexels[4 * i + 1]);
+    m_index.Reorder(modes);
+    glBindTexture(GL_TEXTURE_2D, m_modes[bong]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_height, GL_RG_INTEGER,
+                    GL_UNSIGNED_INT, modes.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  // Only mixtures have a bound, see VisibleRanges
+  m_scoreBound = 0.0f;
+  const size_t boundedMembers =
+      m_target.kind == TargetKind::Mixture ? m_members.size() : 0;
+  for (size_t k = 0; k < boundedMembers; k++) {
+    int firstRow, numRows;
+    EnsembleRowRange(m_height, m_members.size(), k, firstRow, numRows);
+    const MixtureOfGaussians &mixture = m_mixtures[m_members[k].mixture];
+    const float slack = m_scoreTables.empty()
+                            ? 0.0f
+                            : m_scoreTables[m_members[k].mixture].boundSlack;
+    const size_t begin = firstRow * m_width;
+    const size_t end = (firstRow + numRows) * m_width;
+    for (size_t i = begin; i < end; i++) {
+      m_scoreBound = std::max(m_scoreBound,
+                              mixture.ScoreBound(m_sortCurrent[i]) + slack);
+    }
+  }
+  m_stepsSinceSort = 0;
+  m_timeSinceSort = 0.0f;
+}
+
+bool Simulation::VisibleRanges(Viewport viewport, MemberRanges &ranges) {
+  if (!m_index.Valid() || m_target.kind != TargetKind::Mixture)
+    return false;
+
+  // Diffusion plus drift, the latter bounded by the steepest score seen at
+  // the sort. Particles drift towards the modes, where the score shrinks.
+  const float margin = kCullSigmas * std::sqrt(2.0f * m_timeSinceSort) +
+                       m_timeSinceSort * m_scoreBound;
+
+  ranges.resize(m_members.size());
+  for (size_t k = 0; k < m_members.size(); k++)
+    m_index.VisibleRanges(k, viewport, margin, ranges[k]);
+  return true;
 }
 
 void Simulation::ResetParticles() {
   // Re-upload initial CPU positions into both ping-pong textures and reset step
-  glBindTexture(GL_TEXTURE_2D, m_colors[0]);
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kWidth, kHeight, GL_RG, GL_FLOAT,
-                  glm::value_ptr(m_particles[0]));
+  UploadTexels(m_format, m_colors[0], m_width, m_height, m_initialTexels);
+  UploadTexels(m_format, m_colors[1], m_width, m_height, m_initialTexels);
+  m_step = 0;
+  m_index.Clear();
+  ClearModes();
+}
 
-  glBindTexture(GL_TEXTURE_2D, m_colors[1]);
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kWidth, kHeight, GL_RG, GL_FLOAT,
-                  glm::value_ptr(m_particles[0]));
+void Simulation::ReadParticles(std::vector<glm::vec2> &particles) {
+  const int bing = m_step % 2;
+  const int bong = 1 - bing;
 
-  glBindTexture(GL_TEXTURE_2D, 0);
-  m_step = 0;
+  ::ReadParticles(m_format, m_fbos[bong], m_width, m_height, particles);
 }
 
-Simulation::~Simulation() {
+void Simulation::ReadParticles(int firstRow, int numRows,
+                               std::vector<glm::vec2> &particles) {
+  const int bing = m_step % 2;
+  const int bong = 1 - bing;
+
+  ::ReadParticles(m_format, m_fbos[bong], m_width, numRows, particles,
+                  firstRow);
+}
+
+Simulation::~Simulation() { DeleteObjects(); }
+
+void Simulation::DeleteObjects() {
   glDeleteVertexArrays(1, &m_quadVAO);
   glDeleteBuffers(1, &m_quadVBO);
-  glDeleteProgram(m_program);
-  glDeleteShader(m_vertShader);
-  glDeleteShader(m_fragShader);
-  glDeleteBuffers(1, &m_mogUBO);
+  DestroyTextures();
+  glDeleteBuffers(1, &m_ensembleUBO);
+  glDeleteBuffers(1, &m_mixtureUBO);
+  glDeleteTextures(1, &m_targetGrid);
+  glDeleteTextures(1, &m_scoreTableTexture);
 }
 
-size_t Simulation::Width() { return kWidth; }
-size_t Simulation::Height() { return kHeight; }
-size_t Simulation::NumParticles() { return kNumParticles; }
+size_t Simulation::Width() { return m_width; }
+size_t Simulation::Height() { return m_height; }
+size_t Simulation::NumParticles() { return m_width * m_height; }
+int Simulation::EnsembleSize() { return static_cast<int>(m_members.size()); }
+ParticleFormat Simulation::Format() { return m_format; }
+uint32_t Simulation::Step() { return static_cast<uint32_t>(m_step); }
 GLuint Simulation::ParticlesTexture() {
   const int bing = m_step % 2;
   const int bong = 1 - bing;
 
   return m_colors[bong];
 }
+
+GLuint Simulation::PreviousParticlesTexture() {
+  const int bing = m_step % 2;
+
+  return m_colors[bing];
+}
@@ -1,46 +1,183 @@
 #pragma once
 
 #include <GL/glew.h>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <vector>
 
 #include "mixture.h"
+#include "mode_tracking.h"
+#include "particle_storage.h"
+#include "score_table.h"
+#include "shader_variants.h"
+#include "spatial_index.h"
+#include "target.h"
+#include "utils.h"
+
+// One independent sub-population of an ensemble run. Members own contiguous
+// bands of particle rows (see EnsembleRowRange) and all advance in the same
+// simulation pass.
+struct EnsembleMember {
+  int mixture = 0; // Index into the mixtures passed to SetEnsemble
+  float dt = 0.00004f;
+  uint32_t seed = 0;
+};
+
+// Throws std::invalid_argument unless the ensemble fits kMaxEnsembleMembers
+// and every member's mixture index is valid.
+void ValidateEnsemble(const std::vector<MixtureOfGaussians> &mixtures,
+                      const std::vector<EnsembleMember> &members);
 
 class Simulation {
 public:
-  Simulation();
+  Simulation(size_t width = 1920, size_t height = 1080,
+             ParticleFormat format = ParticleFormat::RG32F);
   ~Simulation();
 
   void Update();
+  // Sets the mixture of every ensemble member.
   void SetMixture(const MixtureOfGaussians &m);
+  // Sets the dt of every ensemble member.
   void SetDt(float dt);
+  void SetEnsemble(const std::vector<MixtureOfGaussians> &mixtures,
+                   const std::vector<EnsembleMember> &members);
+  // Switching kinds recompiles the simulation program; the particles stay.
+  void SetTarget(const Target &target);
+  // Looks mixture scores up in a ScoreTable of at most maxSize nodes per side
+  // instead of evaluating every component, trading accuracy for a step cost
+  // independent of the component count; 0 evaluates them exactly. The tables
+  // are rebuilt on the CPU whenever the mixtures change.
+  void SetScoreTable(int maxSize);
+  // One per mixture, with their error estimates; empty when exact.
+  const std::vector<ScoreTable> &ScoreTables();
   void ResetParticles();
+  // Switching formats recreates the particle textures and resets them.
+  void SetParticleFormat(ParticleFormat format);
+  // Reads back the current positions, decoded to floats.
+  void ReadParticles(std::vector<glm::vec2> &particles);
+  // Same for particle rows [firstRow, firstRow + numRows) only, e.g. one
+  // member's band.
+  void ReadParticles(int firstRow, int numRows,
+                     std::vector<glm::vec2> &particles);
+
+  // Spatially sorts the particles every `steps` steps, 0 disables. Sorting
+  // reads the particles back, so it stalls the pipeline.
+  void SetSortInterval(int steps);
+  // Specializes the simulation program on the component count when every
+  // member's mixture has the same one; on by default. Until the variant has
+  // compiled in the background, Update runs the generic program.
+  void SetShaderSpecialization(bool enabled);
+  bool ShaderSpecialized();
+  // Waits for a variant still compiling and switches to it.
+  void FinishShaders();
+  // Reorders each member's particles by SpatialIndex cell.
+  void Sort();
+  // The particles of each member that may lie in the viewport, allowing for
+  // how far they can have moved since the last sort, at whatever dt each
+  // step had. Returns false when there was no sort since the particles, the
+  // mixtures or the member count last changed, and for targets other than
+  // mixtures, whose drift has no bound.
+  bool VisibleRanges(Viewport viewport, MemberRanges &ranges);
+
+  // Labels every particle of a mixture target with its component of largest
+  // responsibility, found while computing its score, and counts its hops
+  // between components in a second render target, see mode_tracking.h. The
+  // labels describe PreviousParticlesTexture(). Every `steps` steps the
+  // channel is read back and reduced into Modes(), which stalls like
+  // sorting; 0 stops tracking and frees the channel. Counts restart with
+  // the particles and whenever tracking starts.
+  void SetModeTracking(int steps);
+  // The last reduction; no members before the first one.
+  const ModeStatistics &Modes();
+
+  int EnsembleSize();
+  ParticleFormat Format();
+  // Steps taken since the particles were last reset.
+  uint32_t Step();
 
   size_t Width();
   size_t Height();
   size_t NumParticles();
   GLuint ParticlesTexture();
+  // Positions one step before ParticlesTexture(); the same positions right
+  // after a reset.
+  GLuint PreviousParticlesTexture();
 
 private:
-  void InitializeParticles();
+  void UploadEnsemble();
+  void BuildScoreTables();
+  std::string Prelude(int components);
+  // Switches to the program for the current format, target and mixtures.
+  void SelectProgram();
+  void UseProgram(GLuint program, bool specialized);
+  void CreateTextures();
+  void DestroyTextures();
+  // Everything the constructor creates besides m_variants
+  void DeleteObjects();
+  bool TracksModes();
+  // Adds or removes the mode channel of both framebuffers as tracking
+  // requires.
+  void UpdateModeChannel();
+  void ClearModes();
+  void ReadModes(GLuint fbo);
+  void ReduceModes();
 
 private:
+  size_t m_width;
+  size_t m_height;
+
   GLuint m_quadVAO;
   GLuint m_quadVBO;
 
-  GLuint m_vertShader;
-  GLuint m_fragShader;
+  ShaderVariants m_variants;
   GLuint m_program;
+  bool m_specialized;
+  bool m_specialize;
+  // Prelude of the variant to switch to once compiled, empty if none
+  std::string m_pendingPrelude;
 
   GLuint m_fbos[2];
   GLuint m_colors[2];
 
   int m_frameIdUniform;
   int m_particlesUniform;
-  int m_dtUniform;
-  float m_dt;
   int m_step;
-  std::vector<glm::vec2> m_particles;
+  ParticleFormat m_format;
+  // Initial positions encoded in m_format, once per format so that resets
+  // only upload
+  std::vector<uint8_t> m_initialTexels;
+
+  std::vector<MixtureOfGaussians> m_mixtures;
+  std::vector<EnsembleMember> m_members;
+  GLuint m_ensembleUBO;
+  GLuint m_mixtureUBO;
+
+  Target m_target;
+  TargetUniforms m_targetUniforms;
+  GLuint m_targetGrid;
+
+  int m_scoreTableSize;
+  std::vector<ScoreTable> m_scoreTables;
+  std::vector<glm::vec4> m_scoreTableBoxes;
+  GLuint m_scoreTableTexture;
+  GLint m_scoreTableUniform;
+  GLint m_scoreTableBoxesUniform;
+
+  SpatialIndex m_index;
+  int m_sortInterval;
+  int m_stepsSinceSort;
+  // Sum over those steps of the largest member dt, which may have changed
+  float m_timeSinceSort;
+  // Largest drift speed at the last sort
+  float m_scoreBound;
+  std::vector<glm::vec2> m_sortCurrent;
+  std::vector<glm::vec2> m_sortPrevious;
 
-  GLuint m_mogUBO;
+  int m_modeInterval;
+  int m_stepsSinceModes;
+  // Ping-pong like m_colors, 0 without tracking
+  GLuint m_modes[2];
+  GLint m_modesUniform;
+  ModeStatistics m_modeStatistics;
+  std::vector<uint32_t> m_modeTexels;
 };
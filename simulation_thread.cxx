@@ -0,0 +1,203 @@
+#include "simulation_thread.h"
+
+#include <utility>
+
+#if defined(EMSCRIPTEN) && !defined(__EMSCRIPTEN_PTHREADS__)
+static constexpr bool kThreaded = false;
+#else
+static constexpr bool kThreaded = true;
+#endif
+
+// Length of the window steps are counted over for StepsPerSecond()
+static constexpr double kRateWindow = 0.5;
+
+SimulationThread::SimulationThread(std::unique_ptr<CpuSimulation> simulation)
+    : m_simulation(std::move(simulation)), m_stop(false), m_paused(false),
+      m_pendingSteps(0), m_pendingReset(false), m_pendingEnsemble(false),
+      m_pendingTarget(false), m_busy(false),
+      m_windowStart(), m_windowSteps(0),
+      m_stepsPerSecond(0.0) {
+  // So that Frame() is valid after the first Update()
+  Publish();
+
+  if (kThreaded)
+    m_thread = std::thread(&SimulationThread::Run, this);
+}
+
+SimulationThread::~SimulationThread() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_one();
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+void SimulationThread::SetEnsemble(
+    const std::vector<MixtureOfGaussians> &mixtures,
+    const std::vector<EnsembleMember> &members) {
+  // Throw here rather than on the simulation thread
+  ValidateEnsemble(mixtures, members);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mixtures = mixtures;
+    m_members = members;
+    m_pendingEnsemble = true;
+  }
+  m_wake.notify_one();
+}
+
+void SimulationThread::SetTarget(const Target &target) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_target = target;
+    m_pendingTarget = true;
+  }
+  m_wake.notify_one();
+}
+
+void SimulationThread::ResetParticles() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pendingReset = true;
+  }
+  m_wake.notify_one();
+}
+
+void SimulationThread::SetPaused(bool paused) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_paused == paused)
+      return;
+    m_paused = paused;
+  }
+  m_wake.notify_one();
+}
+
+void SimulationThread::StepOnce() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pendingSteps++;
+  }
+  m_wake.notify_one();
+}
+
+bool SimulationThread::Update() {
+  if (!kThreaded)
+    Advance();
+  return m_frames.Update();
+}
+
+const ParticleFrame &SimulationThread::Frame() { return m_frames.Front(); }
+
+bool SimulationThread::Idle() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_paused && m_pendingSteps == 0 && !m_pendingReset &&
+         !m_pendingEnsemble && !m_pendingTarget && !m_busy;
+}
+
+double SimulationThread::StepsPerSecond() {
+  return m_stepsPerSecond.load(std::memory_order_relaxed);
+}
+
+int SimulationThread::Threads() { return m_simulation->Threads(); }
+
+void SimulationThread::Run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      auto due = [this] {
+        return m_stop || !m_paused || m_pendingSteps > 0 || m_pendingReset ||
+               m_pendingEnsemble || m_pendingTarget;
+      };
+      if (!due()) {
+        ResetRate();
+        m_wake.wait(lock, due);
+      }
+      if (m_stop)
+        return;
+    }
+    Advance();
+  }
+}
+
+bool SimulationThread::Advance() {
+  // Take the queued changes under the lock and apply them after releasing
+  // it: a reset is a full pass over the particles, and the UI thread takes
+  // the lock every frame.
+  bool ensemble, target, reset, step;
+  std::vector<MixtureOfGaussians> mixtures;
+  std::vector<EnsembleMember> members;
+  Target newTarget;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ensemble = m_pendingEnsemble;
+    target = m_pendingTarget;
+    reset = m_pendingReset;
+    // Only read again after the next Set call refills them
+    if (ensemble) {
+      mixtures = std::move(m_mixtures);
+      members = std::move(m_members);
+    }
+    if (target)
+      newTarget = std::move(m_target);
+    m_pendingEnsemble = m_pendingTarget = m_pendingReset = false;
+    step = !m_paused || m_pendingSteps > 0;
+    if (m_pendingSteps > 0)
+      m_pendingSteps--;
+    m_busy = step || ensemble || target || reset;
+  }
+  const bool changed = ensemble || target || reset;
+
+  if (ensemble)
+    m_simulation->SetEnsemble(mixtures, members);
+  if (target)
+    m_simulation->SetTarget(newTarget);
+  if (reset)
+    m_simulation->ResetParticles();
+
+  if (!step) {
+    ResetRate();
+    if (!changed)
+      return false;
+  }
+
+  if (step) {
+    if (m_windowStart == std::chrono::steady_clock::time_point())
+      m_windowStart = std::chrono::steady_clock::now();
+    m_simulation->Update();
+  }
+  Publish();
+  if (step)
+    CountStep();
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_busy = false;
+  return true;
+}
+
+void SimulationThread::Publish() {
+  m_simulation->ReadFrame(m_frames.Back());
+  m_frames.Publish();
+}
+
+void SimulationThread::CountStep() {
+  const auto now = std::chrono::steady_clock::now();
+  m_windowSteps++;
+  const double elapsed =
+      std::chrono::duration<double>(now - m_windowStart).count();
+  if (elapsed < kRateWindow)
+    return;
+
+  m_stepsPerSecond.store(m_windowSteps / elapsed, std::memory_order_relaxed);
+  m_windowStart = now;
+  m_windowSteps = 0;
+}
+
+void SimulationThread::ResetRate() {
+  // The next window starts with the next step, not now
+  m_windowStart = std::chrono::steady_clock::time_point();
+  m_windowSteps = 0;
+  m_stepsPerSecond.store(0.0, std::memory_order_relaxed);
+}
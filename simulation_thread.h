@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cpu_simulation.h"
+#include "triple_buffer.h"
+
+// Steps a CpuSimulation on its own thread, so a slow step never holds up
+// event handling or rendering. Completed steps are published as
+// ParticleFrames; settings changes are queued and applied between steps.
+// Without thread support (wasm without pthreads) Update() steps inline.
+class SimulationThread {
+public:
+  explicit SimulationThread(std::unique_ptr<CpuSimulation> simulation);
+  ~SimulationThread();
+
+  SimulationThread(const SimulationThread &) = delete;
+  SimulationThread &operator=(const SimulationThread &) = delete;
+
+  void SetEnsemble(const std::vector<MixtureOfGaussians> &mixtures,
+                   const std::vector<EnsembleMember> &members);
+  void SetTarget(const Target &target);
+  void ResetParticles();
+  void SetPaused(bool paused);
+  // Runs one step while paused.
+  void StepOnce();
+
+  // Takes the newest frame, returning false if there is none since the last
+  // call.
+  bool Update();
+  // The frame taken by the last successful Update().
+  const ParticleFrame &Frame();
+
+  // True while paused with no queued work, so no new frames will come.
+  bool Idle();
+
+  double StepsPerSecond();
+  int Threads();
+
+private:
+  void Run();
+  // Applies queued changes and steps if due. Returns false when there is
+  // nothing to do.
+  bool Advance();
+  void Publish();
+  void CountStep();
+  void ResetRate();
+
+private:
+  std::unique_ptr<CpuSimulation> m_simulation;
+  TripleBuffer<ParticleFrame> m_frames;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  bool m_stop;
+  bool m_paused;
+  int m_pendingSteps;
+  bool m_pendingReset;
+  bool m_pendingEnsemble;
+  bool m_pendingTarget;
+  // Set while Advance() works on taken changes or steps
+  bool m_busy;
+  std::vector<MixtureOfGaussians> m_mixtures;
+  std::vector<EnsembleMember> m_members;
+  Target m_target;
+
+  // Steps/s window, touched only by the stepping thread. m_windowStart is
+  // zero while paused.
+  std::chrono::steady_clock::time_point m_windowStart;
+  int m_windowSteps;
+  std::atomic<double> m_stepsPerSecond;
+  std::thread m_thread;
+};
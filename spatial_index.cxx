@@ -0,0 +1,139 @@
+#include "spatial_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+SpatialIndex::SpatialIndex() : m_ensembleSize(0) {}
+
+uint32_t SpatialIndex::Morton(uint32_t x, uint32_t y) {
+  // Spread the low 16 bits apart, x on the even bits
+  auto spread = [](uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+int SpatialIndex::CellCoordinate(float x) {
+  const float t = (x + kBound) / (2.0f * kBound) * kCellsPerSide;
+  // Also sends NaNs to cell 0
+  if (!(t >= 0.0f))
+    return 0;
+  return std::min(static_cast<int>(t), kCellsPerSide - 1);
+}
+
+float SpatialIndex::CellMin(int cell) {
+  if (cell == 0)
+    return -std::numeric_limits<float>::infinity();
+  return -kBound + 2.0f * kBound * cell / kCellsPerSide;
+}
+
+float SpatialIndex::CellMax(int cell) {
+  if (cell == kCellsPerSide - 1)
+    return std::numeric_limits<float>::infinity();
+  return -kBound + 2.0f * kBound * (cell + 1) / kCellsPerSide;
+}
+
+void SpatialIndex::Build(int width, int height, int ensembleSize,
+                         std::vector<glm::vec2> &particles,
+                         std::vector<glm::vec2> &companion) {
+  m_ensembleSize = ensembleSize;
+  m_cellStarts.assign(static_cast<size_t>(ensembleSize) * (kCells + 1), 0);
+  m_codes.resize(particles.size());
+  m_scratch.resize(particles.size());
+
+  for (int member = 0; member < ensembleSize; member++) {
+    int firstRow, numRows;
+    EnsembleRowRange(height, ensembleSize, member, firstRow, numRows);
+    const size_t begin = static_cast<size_t>(firstRow) * width;
+    const size_t end = begin + static_cast<size_t>(numRows) * width;
+    uint32_t *starts = &m_cellStarts[member * (kCells + 1)];
+
+    // Counting sort by cell
+    std::vector<uint32_t> counts(kCells, 0);
+    for (size_t i = begin; i < end; i++) {
+      m_codes[i] = Morton(CellCoordinate(particles[i].x),
+                          CellCoordinate(particles[i].y));
+      counts[m_codes[i]]++;
+    }
+    starts[0] = static_cast<uint32_t>(begin);
+    for (int c = 0; c < kCells; c++)
+      starts[c + 1] = starts[c] + counts[c];
+
+    // Codes become destination indices
+    std::vector<uint32_t> next(starts, starts + kCells);
+    for (size_t i = begin; i < end; i++)
+      m_codes[i] = next[m_codes[i]]++;
+
+    for (size_t i = begin; i < end; i++)
+      m_scratch[m_codes[i]] = particles[i];
+    std::copy(m_scratch.begin() + begin, m_scratch.begin() + end,
+              particles.begin() + begin);
+    if (!companion.empty()) {
+      for (size_t i = begin; i < end; i++)
+        m_scratch[m_codes[i]] = companion[i];
+      std::copy(m_scratch.begin() + begin, m_scratch.begin() + end,
+                companion.begin() + begin);
+    }
+  }
+}
+
+void SpatialIndex::Clear() {
+  m_ensembleSize = 0;
+  m_cellStarts.clear();
+}
+
+bool SpatialIndex::Valid() { return m_ensembleSize > 0; }
+int SpatialIndex::EnsembleSize() { return m_ensembleSize; }
+
+void SpatialIndex::VisibleRanges(int member, Viewport viewport, float margin,
+                                 std::vector<ParticleRange> &ranges) {
+  ranges.clear();
+  viewport.pmin -= glm::vec2(margin);
+  viewport.pmax += glm::vec2(margin);
+  Visit(&m_cellStarts[member * (kCells + 1)], 0, 0, kCellsPerSide, 0,
+        viewport, ranges);
+}
+
+// Walks the quadtree whose nodes are runs of Morton codes, so fully visible
+// nodes are emitted as a single range.
+void SpatialIndex::Visit(const uint32_t *starts, int x0, int y0, int size,
+                         uint32_t code, Viewport viewport,
+                         std::vector<ParticleRange> &ranges) {
+  if (CellMax(x0 + size - 1) < viewport.pmin.x ||
+      CellMin(x0) > viewport.pmax.x ||
+      CellMax(y0 + size - 1) < viewport.pmin.y ||
+      CellMin(y0) > viewport.pmax.y)
+    return;
+
+  const bool inside = CellMin(x0) >= viewport.pmin.x &&
+                      CellMax(x0 + size - 1) <= viewport.pmax.x &&
+                      CellMin(y0) >= viewport.pmin.y &&
+                      CellMax(y0 + size - 1) <= viewport.pmax.y;
+  if (inside || size == 1) {
+    const uint32_t first = starts[code];
+    const uint32_t last = starts[code + size * size];
+    if (first == last)
+      return;
+    if (!ranges.empty() &&
+        ranges.back().first + ranges.back().count == (int)first) {
+      ranges.back().count += last - first;
+    } else {
+      ranges.push_back({(int)first, (int)(last - first)});
+    }
+    return;
+  }
+
+  const int half = size / 2;
+  const uint32_t quarter = half * half;
+  Visit(starts, x0, y0, half, code, viewport, ranges);
+  Visit(starts, x0 + half, y0, half, code + quarter, viewport, ranges);
+  Visit(starts, x0, y0 + half, half, code + 2 * quarter, viewport, ranges);
+  Visit(starts, x0 + half, y0 + half, half, code + 3 * quarter, viewport,
+        ranges);
+}
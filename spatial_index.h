@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "utils.h"
+
+// Particles [first, first + count) in texture order.
+struct ParticleRange {
+  int first;
+  int count;
+};
+
+// One list of ranges per ensemble member.
+using MemberRanges = std::vector<std::vector<ParticleRange>>;
+
+// Grid of cells over [-kBound, kBound]^2 whose particles are stored
+// contiguously in Z (Morton) order within each ensemble band. Particles
+// outside the grid belong to the border cells, whose bounds extend to
+// infinity. Any rectangle then maps to a few runs of cells, each one range
+// of particles.
+class SpatialIndex {
+public:
+  static constexpr int kLevels = 7;
+  static constexpr int kCellsPerSide = 1 << kLevels;
+  static constexpr int kCells = kCellsPerSide * kCellsPerSide;
+  static constexpr float kBound = 2.0f;
+
+  SpatialIndex();
+
+  // Reorders each band of `particles`, a width x height row-major texture,
+  // by cell and applies the same permutation to `companion` (e.g. the
+  // previous positions) when it is not empty.
+  void Build(int width, int height, int ensembleSize,
+             std::vector<glm::vec2> &particles,
+             std::vector<glm::vec2> &companion);
+  // Applies the permutation of the last Build to `values`, one per
+  // particle.
+  template <typename T> void Reorder(std::vector<T> &values) const {
+    std::vector<T> reordered(values.size());
+    for (size_t i = 0; i < values.size(); i++)
+      reordered[m_codes[i]] = values[i];
+    values.swap(reordered);
+  }
+  void Clear();
+  bool Valid();
+  int EnsembleSize();
+
+  // Ranges of the cells of `member` that come within `margin` of the
+  // viewport, in texture order with adjacent runs merged.
+  void VisibleRanges(int member, Viewport viewport, float margin,
+                     std::vector<ParticleRange> &ranges);
+
+private:
+  static uint32_t Morton(uint32_t x, uint32_t y);
+  static int CellCoordinate(float x);
+  static float CellMin(int cell);
+  static float CellMax(int cell);
+  void Visit(const uint32_t *starts, int x0, int y0, int size,
+             uint32_t code, Viewport viewport,
+             std::vector<ParticleRange> &ranges);
+
+private:
+  int m_ensembleSize;
+  // kCells + 1 particle indices per member, in Morton order of the cells
+  std::vector<uint32_t> m_cellStarts;
+  std::vector<uint32_t> m_codes;
+  std::vector<glm::vec2> m_scratch;
+};
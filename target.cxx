@@ -0,0 +1,184 @@
+#include "target.h"
+
+#include "target.glsl.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+// PARTICLE_BOUND in particle_storage.glsl; no particle gets further out in
+// the fixed point formats, so the normalization integrates over this box.
+static constexpr float kBound = 4.0f;
+// Midpoint rule samples per side: several across the narrow Rosenbrock
+// valley, and quick enough to renormalize while a parameter is dragged
+static constexpr int kNormalizeSamples = 512;
+
+static const char *const kDefines[] = {
+    "#define TARGET_MIXTURE\n",
+    "#define TARGET_ROSENBROCK\n",
+    "#define TARGET_DOUBLE_WELL\n",
+    "#define TARGET_GRID\n",
+};
+static_assert(sizeof(kDefines) / sizeof(kDefines[0]) == kNumTargetKinds);
+
+const char *TargetName(TargetKind kind) {
+  switch (kind) {
+  case TargetKind::Mixture:
+    return "Mixture";
+  case TargetKind::Rosenbrock:
+    return "Rosenbrock";
+  case TargetKind::DoubleWell:
+    return "Double well";
+  case TargetKind::Grid:
+    return "Grid";
+  }
+  return "";
+}
+
+Target RosenbrockTarget(float a, float b, float c) {
+  Target t;
+  t.kind = TargetKind::Rosenbrock;
+  t.params = glm::vec4(a, b, c, 0.0f);
+  NormalizeTarget(t);
+  return t;
+}
+
+Target DoubleWellTarget(float w, float h, float s) {
+  Target t;
+  t.kind = TargetKind::DoubleWell;
+  t.params = glm::vec4(w, h, s, 0.0f);
+  NormalizeTarget(t);
+  return t;
+}
+
+Target GridTarget(int width, int height, glm::vec2 min, glm::vec2 max,
+                  std::vector<float> logDensity) {
+  if (width < 2 || height < 2)
+    throw std::invalid_argument("Grid targets need at least 2 x 2 values");
+  if (logDensity.size() != static_cast<size_t>(width) * height)
+    throw std::invalid_argument("Grid target size does not match its values");
+  if (!(min.x < max.x && min.y < max.y))
+    throw std::invalid_argument("Grid target box is empty");
+  for (float v : logDensity) {
+    if (!std::isfinite(v))
+      throw std::invalid_argument("Grid target values must be finite");
+  }
+
+  Target t;
+  t.kind = TargetKind::Grid;
+  t.params = glm::vec4(min, max);
+  t.gridWidth = width;
+  t.gridHeight = height;
+  t.gridLogDensity = std::move(logDensity);
+  NormalizeTarget(t);
+  return t;
+}
+
+Target TabulateMixture(const MixtureOfGaussians &mixture, int width,
+                       int height, glm::vec2 min, glm::vec2 max) {
+  const MixtureDensity density{&mixture};
+  const glm::vec2 cells(width - 1, height - 1);
+  std::vector<float> values(static_cast<size_t>(width) * height);
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      const glm::vec2 p = glm::mix(min, max, glm::vec2(i, j) / cells);
+      values[static_cast<size_t>(j) * width + i] = density.LogDensity(p);
+    }
+  }
+  return GridTarget(width, height, min, max, std::move(values));
+}
+
+template <typename Density>
+static void Normalize(const Density &density, Target &target) {
+  const double cell = 2.0 * kBound / kNormalizeSamples;
+  // Log-sum-exp in one pass, rescaling the sum whenever the maximum grows
+  double maxLog = -INFINITY;
+  double sum = 0.0;
+  for (int j = 0; j < kNormalizeSamples; j++) {
+    for (int i = 0; i < kNormalizeSamples; i++) {
+      const glm::vec2 p(-kBound + (i + 0.5) * cell, -kBound + (j + 0.5) * cell);
+      const double l = density.LogDensity(p);
+      if (l > maxLog) {
+        sum = sum * std::exp(maxLog - l) + 1.0;
+        maxLog = l;
+      } else {
+        sum += std::exp(l - maxLog);
+      }
+    }
+  }
+  target.logNormalizer =
+      static_cast<float>(maxLog + std::log(sum * cell * cell));
+  target.peak = static_cast<float>(std::exp(maxLog - target.logNormalizer));
+}
+
+void NormalizeTarget(Target &target) {
+  switch (target.kind) {
+  case TargetKind::Mixture:
+    target.logNormalizer = 0.0f;
+    target.peak = 0.0f;
+    break;
+  case TargetKind::Rosenbrock:
+    Normalize(RosenbrockDensity(target), target);
+    break;
+  case TargetKind::DoubleWell:
+    Normalize(DoubleWellDensity(target), target);
+    break;
+  case TargetKind::Grid:
+    Normalize(GridDensity{&target}, target);
+    break;
+  }
+}
+
+float TargetPeak(const Target &target, const MixtureOfGaussians &mixture) {
+  return target.kind == TargetKind::Mixture ? mixture.peak : target.peak;
+}
+
+bool SameTarget(const Target &a, const Target &b) {
+  return a.kind == b.kind && a.params == b.params &&
+         a.gridWidth == b.gridWidth && a.gridHeight == b.gridHeight &&
+         a.gridLogDensity == b.gridLogDensity;
+}
+
+std::string TargetPrelude(TargetKind kind, int components) {
+  std::string prelude = kDefines[static_cast<int>(kind)];
+  if (kind == TargetKind::Mixture && components > 0)
+    prelude += "#define NUM_COMPONENTS " + std::to_string(components) + "\n";
+  return prelude + std::string(reinterpret_cast<const char *>(TargetGlsl),
+                               TargetGlsl_len);
+}
+
+void TargetUniforms::Locate(GLuint program) {
+  params = glGetUniformLocation(program, "uTargetParams");
+  logNormalizer = glGetUniformLocation(program, "uTargetLogNormalizer");
+  grid = glGetUniformLocation(program, "uTargetGrid");
+}
+
+void TargetUniforms::Apply(const Target &target, GLuint gridTexture,
+                           int unit) const {
+  glUniform4f(params, target.params.x, target.params.y, target.params.z,
+              target.params.w);
+  glUniform1f(logNormalizer, target.logNormalizer);
+  if (target.kind == TargetKind::Grid) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, gridTexture);
+    glUniform1i(grid, unit);
+    glActiveTexture(GL_TEXTURE0);
+  }
+}
+
+void UploadTargetGrid(GLuint texture, const Target &target) {
+  if (target.kind != TargetKind::Grid)
+    return;
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, target.gridWidth, target.gridHeight,
+               0, GL_RED, GL_FLOAT, target.gridLogDensity.data());
+  // Read with texelFetch and interpolated in the shader, so that float
+  // textures need no filtering support
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
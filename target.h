@@ -0,0 +1,207 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+#include "mixture.h"
+#include "utils.h"
+
+// The density the particles sample. Every kind has a GLSL snippet in
+// shaders/target.glsl, compiled into its own shader variant by
+// TargetPrelude, and a C++ density below that CpuSimulation instantiates its
+// step loop with, so neither side branches on the kind per particle.
+//
+// Mixture is the original target: each ensemble member samples its own
+// mixture, passed with SetEnsemble. The other kinds are shared by all
+// members and ignore the mixtures.
+enum class TargetKind { Mixture, Rosenbrock, DoubleWell, Grid };
+static constexpr int kNumTargetKinds = 4;
+
+struct Target {
+  TargetKind kind = TargetKind::Mixture;
+  // Rosenbrock: a, b, c. Double well: well position w, barrier height h and
+  // y standard deviation s. Grid: box min (xy) and max (zw).
+  glm::vec4 params = glm::vec4(0.0f);
+  // Grid only: log densities at gridWidth x gridHeight nodes spanning the
+  // box, row-major from the min corner
+  int gridWidth = 0;
+  int gridHeight = 0;
+  std::vector<float> gridLogDensity;
+  // From NormalizeTarget, unused by Mixture whose peak comes with it
+  float logNormalizer = 0.0f;
+  float peak = 0.0f;
+};
+
+// Uniform buffer binding of MixtureBlock in shaders/target.glsl
+static constexpr int kMixtureBlockBinding = 1;
+
+// std140 mirror of MixtureBlock
+struct GpuMixtures {
+  MixtureOfGaussians mixtures[kMaxEnsembleMembers];
+};
+
+const char *TargetName(TargetKind kind);
+
+// log p = -((a - x)^2 + b (y - x^2)^2) / c, a banana along y = x^2
+Target RosenbrockTarget(float a = 0.4f, float b = 5.0f, float c = 0.1f);
+// log p = -h ((x / w)^2 - 1)^2 - y^2 / (2 s^2), modes at (+-w, 0)
+Target DoubleWellTarget(float w = 0.5f, float h = 4.0f, float s = 0.2f);
+// Throws std::invalid_argument unless the grid has at least 2 x 2 finite
+// values and the box is not empty.
+Target GridTarget(int width, int height, glm::vec2 min, glm::vec2 max,
+                  std::vector<float> logDensity);
+// The mixture's log density tabulated on a width x height grid.
+Target TabulateMixture(const MixtureOfGaussians &mixture, int width,
+                       int height, glm::vec2 min, glm::vec2 max);
+
+// Sets logNormalizer and peak by integrating the density numerically over
+// the particle bounds; the constructors above call it.
+void NormalizeTarget(Target &target);
+
+// Peak of the density the distribution renderers show: the mixture's for
+// Mixture targets.
+float TargetPeak(const Target &target, const MixtureOfGaussians &mixture);
+
+bool SameTarget(const Target &a, const Target &b);
+
+// The #define selecting `kind` followed by shaders/target.glsl. For Mixture
+// targets, components > 0 also defines NUM_COMPONENTS, specializing the
+// shader on mixtures of exactly that many components.
+std::string TargetPrelude(TargetKind kind, int components = 0);
+
+// Uniform locations of the target snippet in a linked program.
+struct TargetUniforms {
+  GLint params = -1;
+  GLint logNormalizer = -1;
+  GLint grid = -1;
+
+  void Locate(GLuint program);
+  // With the program in use, sets the uniforms and binds a Grid target's
+  // texture, filled by UploadTargetGrid, to texture unit `unit`.
+  void Apply(const Target &target, GLuint gridTexture, int unit) const;
+};
+
+// Uploads a Grid target's values into an R32F texture; no-op for the other
+// kinds.
+void UploadTargetGrid(GLuint texture, const Target &target);
+
+// C++ counterparts of shaders/target.glsl. Score is the gradient of
+// LogDensity; LogDensity is unnormalized except for the mixture's.
+
+struct MixtureDensity {
+  const MixtureOfGaussians *mixture;
+
+  glm::vec2 Score(glm::vec2 p) const { return mixture->Score(p); }
+
+  // Log-sum-exp, finite far from every component
+  float LogDensity(glm::vec2 p) const {
+    static constexpr float kTwoPi = 6.283185307179586f;
+
+    const MixtureOfGaussians &m = *mixture;
+    float maxE = -1e30f;
+    for (int i = 0; i < m.count; ++i) {
+      const glm::vec2 d = (p - m.g[i].mean) / m.g[i].sigma;
+      maxE = std::max(maxE, -0.5f * glm::dot(d, d));
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < m.count; ++i) {
+      const glm::vec2 d = (p - m.g[i].mean) / m.g[i].sigma;
+      sum += std::exp(-0.5f * glm::dot(d, d) - maxE) /
+             (kTwoPi * m.g[i].sigma.x * m.g[i].sigma.y);
+    }
+    return maxE + std::log(sum / static_cast<float>(m.count));
+  }
+};
+
+struct RosenbrockDensity {
+  float a, b, c;
+
+  explicit RosenbrockDensity(const Target &t)
+      : a(t.params.x), b(t.params.y), c(t.params.z) {}
+
+  glm::vec2 Score(glm::vec2 p) const {
+    const float u = a - p.x;
+    const float v = p.y - p.x * p.x;
+    return glm::vec2(2.0f * u + 4.0f * b * p.x * v, -2.0f * b * v) / c;
+  }
+
+  float LogDensity(glm::vec2 p) const {
+    const float u = a - p.x;
+    const float v = p.y - p.x * p.x;
+    return -(u * u + b * v * v) / c;
+  }
+};
+
+struct DoubleWellDensity {
+  float w, h, s;
+
+  explicit DoubleWellDensity(const Target &t)
+      : w(t.params.x), h(t.params.y), s(t.params.z) {}
+
+  glm::vec2 Score(glm::vec2 p) const {
+    const float q = (p.x * p.x) / (w * w) - 1.0f;
+    return glm::vec2(-4.0f * h * q * p.x / (w * w), -p.y / (s * s));
+  }
+
+  float LogDensity(glm::vec2 p) const {
+    const float q = (p.x * p.x) / (w * w) - 1.0f;
+    return -h * q * q - 0.5f * p.y * p.y / (s * s);
+  }
+};
+
+// Bilinear in the table, with the quadratic wall of TARGET_GRID_WALL outside
+// the box.
+struct GridDensity {
+  static constexpr float kWall = 100.0f;
+
+  const Target *target;
+
+  void Sample(glm::vec2 p, float &logP, glm::vec2 &grad) const {
+    const Target &t = *target;
+    const glm::vec2 lo(t.params.x, t.params.y);
+    const glm::vec2 hi(t.params.z, t.params.w);
+    const glm::vec2 cells(t.gridWidth - 1, t.gridHeight - 1);
+
+    const glm::vec2 inside = glm::clamp(p, lo, hi);
+    const glm::vec2 u = (inside - lo) / (hi - lo) * cells;
+    const int cx = std::min(static_cast<int>(u.x), t.gridWidth - 2);
+    const int cy = std::min(static_cast<int>(u.y), t.gridHeight - 2);
+    const glm::vec2 f = u - glm::vec2(cx, cy);
+
+    const float *row = &t.gridLogDensity[static_cast<size_t>(cy) *
+                                         t.gridWidth];
+    const float v00 = row[cx], v10 = row[cx + 1];
+    const float v01 = row[cx + t.gridWidth], v11 = row[cx + t.gridWidth + 1];
+
+    logP = glm::mix(glm::mix(v00, v10, f.x), glm::mix(v01, v11, f.x), f.y);
+    grad = glm::vec2(glm::mix(v10 - v00, v11 - v01, f.y),
+                     glm::mix(v01 - v00, v11 - v10, f.x)) *
+           cells / (hi - lo);
+    if (inside.x != p.x)
+      grad.x = 0.0f;
+    if (inside.y != p.y)
+      grad.y = 0.0f;
+
+    const glm::vec2 outside = p - inside;
+    logP -= 0.5f * kWall * glm::dot(outside, outside);
+    grad -= kWall * outside;
+  }
+
+  glm::vec2 Score(glm::vec2 p) const {
+    float logP;
+    glm::vec2 grad;
+    Sample(p, logP, grad);
+    return grad;
+  }
+
+  float LogDensity(glm::vec2 p) const {
+    float logP;
+    glm::vec2 grad;
+    Sample(p, logP, grad);
+    return logP;
+  }
+};
@@ -0,0 +1,240 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Chunks per thread when ParallelFor picks the grain; enough for stealing to
+// even out uneven chunks without making them tiny.
+static constexpr size_t kChunksPerSlot = 8;
+
+static uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return static_cast<uint64_t>(begin) << 32 | end;
+}
+
+#ifdef __linux__
+// Parses a sysfs CPU list such as "0-15,32-47".
+static std::vector<int> ParseCpuList(const char *list) {
+  std::vector<int> cpus;
+  const char *p = list;
+  for (;;) {
+    int first, last, n;
+    if (sscanf(p, "%d%n", &first, &n) != 1)
+      break;
+    p += n;
+    last = first;
+    if (*p == '-' && sscanf(p + 1, "%d%n", &last, &n) == 1)
+      p += 1 + n;
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+    if (*p != ',')
+      break;
+    p++;
+  }
+  return cpus;
+}
+
+// CPUs of every NUMA node with any, empty if sysfs has no node information.
+static std::vector<std::vector<int>> ReadNumaNodes() {
+  std::vector<std::vector<int>> nodes;
+  for (int node = 0;; node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+      break;
+    char line[4096];
+    if (fgets(line, sizeof(line), file) != nullptr) {
+      std::vector<int> cpus = ParseCpuList(line);
+      if (!cpus.empty())
+        nodes.push_back(std::move(cpus));
+    }
+    fclose(file);
+  }
+  return nodes;
+}
+#endif
+
+ThreadPool::ThreadPool(int threads)
+    : m_nodes(1), m_fn(nullptr), m_count(0), m_grain(1), m_generation(0),
+      m_pending(0), m_stop(false) {
+#if defined(EMSCRIPTEN) && !defined(__EMSCRIPTEN_PTHREADS__)
+  threads = 0;
+#else
+  if (threads < 0)
+    threads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+#endif
+
+  const int size = threads + 1;
+#ifdef __linux__
+  m_nodeCpus = ReadNumaNodes();
+  // Pinning a single node only takes freedom away from the scheduler
+  if (m_nodeCpus.size() > 1)
+    m_nodes = static_cast<int>(m_nodeCpus.size());
+  else
+    m_nodeCpus.clear();
+#endif
+
+  // Contiguous groups of slots per node, matching the contiguous initial
+  // shares of ParallelFor
+  m_slotNodes.resize(size);
+  for (int slot = 0; slot < size; slot++)
+    m_slotNodes[slot] = slot * m_nodes / size;
+
+  m_victims.resize(size);
+  for (int slot = 0; slot < size; slot++) {
+    for (int sameNode = 1; sameNode >= 0; sameNode--) {
+      for (int i = 1; i < size; i++) {
+        const int victim = (slot + i) % size;
+        if ((m_slotNodes[victim] == m_slotNodes[slot]) == (sameNode == 1))
+          m_victims[slot].push_back(victim);
+      }
+    }
+  }
+
+  m_ranges.reset(new WorkRange[size]);
+  for (int slot = 0; slot < size; slot++)
+    m_ranges[slot].bounds.store(0, std::memory_order_relaxed);
+
+  m_workers.reserve(threads);
+  for (int i = 0; i < threads; i++)
+    m_workers.emplace_back(&ThreadPool::WorkerLoop, this, i + 1);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (std::thread &worker : m_workers)
+    worker.join();
+}
+
+int ThreadPool::Size() { return static_cast<int>(m_workers.size()) + 1; }
+int ThreadPool::Nodes() { return m_nodes; }
+
+void ThreadPool::ParallelFor(
+    size_t count, const std::function<void(size_t, size_t, int)> &fn,
+    size_t grain) {
+  if (m_workers.empty() || count < 2) {
+    fn(0, count, 0);
+    return;
+  }
+
+  const size_t slots = static_cast<size_t>(Size());
+  if (grain == 0)
+    grain = std::max<size_t>(1, count / (slots * kChunksPerSlot));
+  grain = std::max(grain, count / UINT32_MAX + 1);
+  const size_t chunks = (count + grain - 1) / grain;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t slot = 0; slot < slots; slot++) {
+      m_ranges[slot].bounds.store(
+          PackRange(static_cast<uint32_t>(chunks * slot / slots),
+                    static_cast<uint32_t>(chunks * (slot + 1) / slots)),
+          std::memory_order_relaxed);
+    }
+    m_fn = &fn;
+    m_count = count;
+    m_grain = grain;
+    m_pending = static_cast<int>(m_workers.size());
+    m_generation++;
+  }
+  m_wake.notify_all();
+
+  RunSlot(0);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return m_pending == 0; });
+  m_fn = nullptr;
+}
+
+void ThreadPool::RunSlot(int slot) {
+  do {
+    uint32_t chunk;
+    while (TakeChunk(slot, chunk)) {
+      const size_t begin = chunk * m_grain;
+      const size_t end = std::min(m_count, begin + m_grain);
+      (*m_fn)(begin, end, slot);
+    }
+  } while (Steal(slot));
+}
+
+bool ThreadPool::TakeChunk(int slot, uint32_t &chunk) {
+  std::atomic<uint64_t> &bounds = m_ranges[slot].bounds;
+  uint64_t range = bounds.load(std::memory_order_acquire);
+  for (;;) {
+    const uint32_t begin = static_cast<uint32_t>(range >> 32);
+    const uint32_t end = static_cast<uint32_t>(range);
+    if (begin >= end)
+      return false;
+    if (bounds.compare_exchange_weak(range, PackRange(begin + 1, end),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+      chunk = begin;
+      return true;
+    }
+  }
+}
+
+bool ThreadPool::Steal(int slot) {
+  for (int victim : m_victims[slot]) {
+    std::atomic<uint64_t> &bounds = m_ranges[victim].bounds;
+    uint64_t range = bounds.load(std::memory_order_acquire);
+    for (;;) {
+      const uint32_t begin = static_cast<uint32_t>(range >> 32);
+      const uint32_t end = static_cast<uint32_t>(range);
+      if (begin >= end)
+        break;
+      // The owner works from the front, so take the back half
+      const uint32_t split = end - (end - begin + 1) / 2;
+      if (bounds.compare_exchange_weak(range, PackRange(begin, split),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+        m_ranges[slot].bounds.store(PackRange(split, end),
+                                    std::memory_order_release);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void ThreadPool::WorkerLoop(int slot) {
+#ifdef __linux__
+  if (!m_nodeCpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : m_nodeCpus[m_slotNodes[slot]])
+      CPU_SET(cpu, &set);
+    // Best effort, e.g. containers may restrict the allowed CPUs
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+#endif
+
+  unsigned seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+      if (m_stop)
+        return;
+      seen = m_generation;
+    }
+
+    RunSlot(slot);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending--;
+    }
+    m_done.notify_one();
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running one parallel loop at a time. The
+// calling thread takes a share of the work too, so a pool without workers
+// (e.g. a wasm build without pthreads) runs everything inline.
+//
+// On multi-socket Linux hosts the workers are spread over the NUMA nodes in
+// contiguous groups and pinned to their node's CPUs.
+class ThreadPool {
+public:
+  // `threads` workers besides the caller; negative uses one per core.
+  explicit ThreadPool(int threads = -1);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Number of threads sharing a loop, including the caller.
+  int Size();
+  // Number of NUMA nodes the workers are spread over, 1 if unknown.
+  int Nodes();
+
+  // Splits [0, count) into chunks of `grain` items (0 picks a few chunks per
+  // thread) and calls fn(begin, end, slot) for each, slot being the
+  // [0, Size()) index of the thread running it. Returns once every chunk is
+  // done.
+  //
+  // Each slot starts on its own contiguous share of the chunks, the same one
+  // in every loop of the same count and grain, so memory first touched by a
+  // loop stays on the node of the threads that use it. Slots that run out
+  // steal the back half of another slot's remaining chunks, trying slots on
+  // their own node first.
+  void ParallelFor(size_t count,
+                   const std::function<void(size_t, size_t, int)> &fn,
+                   size_t grain = 0);
+
+private:
+  // Chunks [begin, end) not yet started, packed as begin << 32 | end so both
+  // ends move with one compare-exchange.
+  struct alignas(64) WorkRange {
+    std::atomic<uint64_t> bounds;
+  };
+
+  void WorkerLoop(int slot);
+  void RunSlot(int slot);
+  bool TakeChunk(int slot, uint32_t &chunk);
+  bool Steal(int slot);
+
+private:
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+
+  int m_nodes;
+  // CPUs of each node, empty when workers are not pinned
+  std::vector<std::vector<int>> m_nodeCpus;
+  std::vector<int> m_slotNodes;
+  // Slots to steal from, same node first
+  std::vector<std::vector<int>> m_victims;
+  std::unique_ptr<WorkRange[]> m_ranges;
+
+  const std::function<void(size_t, size_t, int)> *m_fn;
+  size_t m_count;
+  size_t m_grain;
+  unsigned m_generation;
+  int m_pending;
+  bool m_stop;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Hands the latest value from one producer thread to one consumer thread.
+// Each side owns one of three buffers and they swap through the third with a
+// single atomic exchange, so neither ever blocks or waits for the other.
+template <typename T> class TripleBuffer {
+public:
+  TripleBuffer() : m_back(0), m_middle(1), m_front(2) {}
+
+  TripleBuffer(const TripleBuffer &) = delete;
+  TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+  // Producer: the buffer to fill next.
+  T &Back() { return m_buffers[m_back]; }
+  // Producer: makes Back() the newest value and hands out another buffer.
+  void Publish() {
+    m_back = m_middle.exchange(m_back | kFresh, std::memory_order_acq_rel) &
+             kIndexMask;
+  }
+
+  // Consumer: swaps in the newest value; false if none was published since
+  // the last call.
+  bool Update() {
+    if (!(m_middle.load(std::memory_order_relaxed) & kFresh))
+      return false;
+    m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) &
+              kIndexMask;
+    return true;
+  }
+  // Consumer: the value taken by the last successful Update().
+  T &Front() { return m_buffers[m_front]; }
+
+private:
+  static constexpr uint8_t kIndexMask = 3;
+  static constexpr uint8_t kFresh = 4;
+
+  T m_buffers[3];
+  uint8_t m_back;
+  // Index of the shared buffer, plus kFresh while it holds an unread value
+  std::atomic<uint8_t> m_middle;
+  uint8_t m_front;
+};
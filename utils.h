@@ -18,6 +18,11 @@ struct Viewport {
   float Height() const { return pmax.y - pmin.y; }
 
   glm::vec2 Center() const { return 0.5f * (pmin + pmax); }
+
+  bool operator==(const Viewport &o) const {
+    return pmin == o.pmin && pmax == o.pmax;
+  }
+  bool operator!=(const Viewport &o) const { return !(*this == o); }
 };
 
 static Viewport EnforceAspectRatio(Viewport particleViewport,
@@ -44,6 +49,26 @@ static Viewport EnforceAspectRatio(Viewport particleViewport,
   return result;
 }
 
+static constexpr int kMaxEnsembleMembers = 8;
+
+// Ensemble members own contiguous bands of particle rows. Must match the
+// member lookup in simulation.frag.
+static void EnsembleRowRange(int height, int members, int member, int &first,
+                             int &count) {
+  first = member * height / members;
+  count = (member + 1) * height / members - first;
+}
+
+// Returns an embedded shader with `prelude` spliced in right after its
+// #version line.
+static std::string ShaderSource(const unsigned char *src, unsigned int len,
+                                const std::string &prelude) {
+  std::string source(reinterpret_cast<const char *>(src), len);
+  const size_t eol = source.find('\n');
+  source.insert(eol == std::string::npos ? source.size() : eol + 1, prelude);
+  return source;
+}
+
 static void CheckCompilationResult(GLuint shader, const char *name) {
   int success;
   glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
@@ -59,3 +84,19 @@ static void CheckCompilationResult(GLuint shader, const char *name) {
     }
   }
 }
+
+static void CheckLinkResult(GLuint program, const char *name) {
+  int success;
+  glGetProgramiv(program, GL_LINK_STATUS, &success);
+  if (success != GL_TRUE) {
+    int bufflen;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &bufflen);
+    std::string log;
+    if (bufflen > 1) {
+      log.resize(bufflen + 1);
+      glGetProgramInfoLog(program, bufflen, 0, log.data());
+    }
+    throw std::runtime_error(std::string("Error linking program ") + name +
+                             ": " + log);
+  }
+}